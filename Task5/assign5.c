@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <limits.h>
 
 #include <assert.h>
@@ -12,8 +14,24 @@
 
 #include <stdbool.h>
 
+#include <stdint.h>
+
+#include <unistd.h>
+
+#include <fcntl.h>
+
+#include <pthread.h>
+
+#include <time.h>
+
+#include <sys/mman.h>
+
 #include <sys/uio.h>
 
+#include <sys/statvfs.h>
+
+#include <sys/xattr.h>
+
 #include "assign5.h"
 
 
@@ -21,26 +39,858 @@
 #define ASSIGN_DIR 2
 #define USERNAME_FILE 3
 #define FEATURE_FILE 4
-#define FILE_COUNT 1000
-#define MAX_FILES 1024
+#define INODE_CHUNK_SHIFT 10
+#define INODE_CHUNK_SIZE (1 << INODE_CHUNK_SHIFT)
+#define INODE_CHUNK_MAX 16384
+#define FILE_NAME_MAX 255
+#define FILE_LINK_MAX 65000
+#define INDEX_MIN_BUCKETS 64
+#define FILE_PAGE_SHIFT 12
+#define FILE_PAGE_SIZE (1 << FILE_PAGE_SHIFT)
+#define PAGE_DIRTY 0x1
+// The page's memory belongs to the dedup table and must not be modified
+#define PAGE_SHARED 0x2
+// Compressing the page didn't save enough to keep (cleared by a write)
+#define PAGE_INCOMPRESSIBLE 0x4
+#define DEDUP_MIN_BUCKETS 1024
+// Unmatched pages remembered as candidates for a later page with the same hash
+#define DEDUP_CANDIDATES (1 << 16)
+// Decompressed copies of compressed pages kept for reads, beyond which the
+// oldest are dropped again
+#define COMPRESS_CACHE_PAGES 256
+#define COMPRESS_DEFAULT_RATIO 75
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+// Largest write (and readahead) to ask the kernel for; it caps this to what
+// it and the session's buffers support
+#define WRITE_MAX (1 << 20)
+
+#define DISK_MAGIC 0x41354653
+#define DISK_VERSION 4
+#define DISK_BLOCK_SIZE FILE_PAGE_SIZE
+#define DISK_DEFAULT_BLOCKS (1 << 18)
+#define DISK_DIRECT 12
+#define DISK_PTRS_PER_BLOCK (DISK_BLOCK_SIZE / sizeof(uint32_t))
+#define DISK_BITS_PER_BLOCK (DISK_BLOCK_SIZE * 8)
+#define DISK_INODE_SIZE 256
+#define DISK_INODES_PER_BLOCK (DISK_BLOCK_SIZE / DISK_INODE_SIZE)
+// Names up to this long are kept in the inode record; longer ones go in the
+// record's slot of the name table
+#define DISK_NAME_INLINE 64
+#define DISK_NAME_SLOT 256
+// Extended attributes: entries that fit stay in the inode record, the rest
+// of an inode's entries spill into a block of their own. An entry is its
+// name length, a 16-bit little-endian value length, the name and the value.
+#define XATTR_INLINE_SIZE 24
+#define XATTR_SPILL_MAX DISK_BLOCK_SIZE
+#define XATTR_HEADER 3
+#define CACHE_DEFAULT_MB 64
+#define CACHE_READAHEAD 16
+// Blocks per pwritev() call, the Linux IOV_MAX
+#define CACHE_WRITE_IOV 1024
+#define JOURNAL_MAGIC 0x4a524e4c
+#define JOURNAL_BLOCKS 4096
+#define JOURNAL_COMMIT 0x1
+#define JOURNAL_WINDOW_US 1000
+#define JOURNAL_BATCH_MAX 256
+// Seconds the kernel may cache attributes and names: the assignment files
+// never change, other inodes are kept coherent by invalidation notices
+// (or, without a session to send them on, expire quickly)
+#define TIMEOUT_IMMUTABLE 86400.0
+#define TIMEOUT_NOTIFIED 60.0
+#define TIMEOUT_DEFAULT 1.0
+// Latency histogram buckets: bucket b counts operations that took
+// [2^b, 2^(b+1)) ns, with the last one open-ended
+#define STATS_BUCKETS 40
+// Synthetic files in the root directory get inode numbers far beyond
+// anything the inode table can hand out
+#define SYNTHETIC_INO_BASE ((fuse_ino_t) 1 << 48)
+
+/*
+ * On-disk layout of the backing file (integers are in host byte order):
+ *
+ *   block 0                superblock
+ *   blocks 1 .. n          free-block bitmap, one bit per block
+ *   next JOURNAL_BLOCKS    metadata journal
+ *   all other blocks       allocated from the bitmap
+ *
+ * Allocated blocks hold file pages, indirect map blocks and the inode table.
+ * The inode table is stored like a file whose block map lives in the
+ * superblock, with one DISK_INODE_SIZE record per inode number, so mounting
+ * only reads the superblock, the bitmap and the inode table. Block 0 is
+ * never allocated, so a block number of 0 means "no block".
+ *
+ * Once a snapshot has shared a file block, the block share table (one byte
+ * per block counting its owners beyond the first) is stored the same way.
+ * So is the name table, with a DISK_NAME_SLOT slot per inode number for
+ * names too long for the record: block b of it holds the long names of the
+ * records in block b of the inode table, and only blocks with a long name
+ * in them are ever written.
+ */
+struct disk_map {
+  uint32_t direct[DISK_DIRECT];
+  // Block of DISK_PTRS_PER_BLOCK page pointers following the direct ones
+  uint32_t indirect;
+  // Block of pointers to further indirect blocks
+  uint32_t dindirect;
+};
+
+struct disk_superblock {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t block_size;
+  uint32_t flags;
+  uint64_t total_blocks;
+  uint64_t free_blocks;
+  uint64_t bitmap_start;
+  uint64_t bitmap_blocks;
+  // Number of records in the inode table (one more than the highest inode)
+  uint64_t inode_count;
+  // Last generation number handed out by the inode allocator
+  uint64_t generation;
+  struct disk_map itable_map;
+  uint64_t journal_start;
+  uint64_t journal_blocks;
+  // Sequence number of the first transaction that has not been
+  // checkpointed (replay starts at journal block 0 with this number)
+  uint64_t journal_seq;
+  // The block share table (all zero if nothing has been shared)
+  struct disk_map refs_map;
+  // The name table (all zero if no name has been too long for its record)
+  struct disk_map names_map;
+};
+
+struct disk_inode {
+  // A record with st_mode of 0 is a free inode
+  uint32_t mode;
+  uint32_t nlink;
+  uint32_t uid;
+  uint32_t gid;
+  uint64_t size;
+  uint64_t generation;
+  uint64_t parent;
+  uint64_t dir_cookie;
+  uint64_t next_cookie;
+  int64_t atime;
+  int64_t mtime;
+  int64_t ctime;
+  uint32_t atime_nsec;
+  uint32_t mtime_nsec;
+  uint32_t ctime_nsec;
+  uint32_t rdev;
+  struct disk_map map;
+  // Hard links: the inode this record is an extra name for (0 if none)
+  uint64_t link_target;
+  uint8_t name_len;
+  char name[DISK_NAME_INLINE];
+  uint8_t xattr_inline_len;
+  uint8_t xattr_inline[XATTR_INLINE_SIZE];
+  uint16_t xattr_spill_len;
+  uint32_t xattr_block;
+};
 
+/*
+ * Metadata journal: physical images of every metadata block a transaction
+ * changes (inode table, bitmap, block maps, superblock). A transaction is
+ * one or more descriptor blocks, each followed by the images it lists; the
+ * last descriptor carries JOURNAL_COMMIT. Replay applies complete
+ * transactions whose checksums match, in sequence order.
+ */
+#define JOURNAL_DESC_MAX ((DISK_BLOCK_SIZE - 32) / sizeof(uint64_t))
+
+struct journal_header {
+  uint32_t magic;
+  uint32_t flags;
+  uint64_t seq;
+  // FNV-1a over this header (with checksum zeroed) and its images
+  uint64_t checksum;
+  uint32_t count;
+  uint32_t reserved;
+  uint64_t blocks[JOURNAL_DESC_MAX];
+};
+
+_Static_assert(sizeof(struct journal_header) == DISK_BLOCK_SIZE,
+  "journal descriptors are one block");
+_Static_assert(sizeof(struct disk_superblock) <= DISK_BLOCK_SIZE,
+  "superblock must fit in block 0");
+_Static_assert(sizeof(struct disk_inode) == DISK_INODE_SIZE,
+  "inode records must tile inode table blocks exactly");
+_Static_assert(DISK_NAME_SLOT * DISK_INODES_PER_BLOCK == DISK_BLOCK_SIZE &&
+  DISK_NAME_SLOT > FILE_NAME_MAX,
+  "name table blocks must line up with inode table blocks");
+
+/*
+ * An inode's place in the directory tree, split by how it is used. Lookups
+ * walk hash chains and readdir walks child lists across many inodes, so
+ * everything they touch is packed into one cache line per inode (struct
+ * file_node). The rest (struct file_meta) and the attributes (struct stat)
+ * are only read for the inodes a reply is about.
+ */
 typedef struct file_node {
+  uint32_t name_hash;
+  // S_IFMT bits of the mode, which never change (for a hard link, those of
+  // the inode it names)
+  uint16_t type;
   bool is_directory;
-  char name[64];
+  // Next inode in the same name index bucket (0 terminates the chain);
+  // free inodes are chained through this field instead
+  fuse_ino_t hash_next;
+  // 0 for an inode whose own name was removed while it had other links
   fuse_ino_t parent_inode;
-}
+  // Interned in the name arena (see name_length()); never NULL
+  const char * name;
+  // Set if this entry is an extra name (hard link) for another inode, which
+  // has the attributes and contents; such entries are never seen by the
+  // kernel
+  fuse_ino_t link_target;
+
+  // Next sibling within the parent directory, in creation order, and the
+  // entry's readdir cookie there (never reused)
+  fuse_ino_t next_sibling;
+  off_t dir_cookie;
+  // Directories only: start of the ordered child list
+  fuse_ino_t first_child;
+} __attribute__((aligned(64)))
 file_node;
 
+_Static_assert(sizeof(struct file_node) == 64,
+  "the fields lookups and readdir scan must fit one cache line");
+
+struct file_meta {
+  // Bumped every time the inode number is handed out again
+  uint64_t generation;
+  // Previous sibling, for unlinking from the middle of the child list
+  fuse_ino_t prev_sibling;
+  // Directories only: end of the child list and the next cookie to hand out
+  fuse_ino_t last_child;
+  off_t next_cookie;
+  // References the kernel holds from entry replies, dropped again by forget
+  uint64_t nlookup;
+  // Set once the last name is gone while the kernel still holds references:
+  // the inode lives on, nameless, until they have all been forgotten
+  bool orphaned;
+
+  // Extended attributes, packed first into xattr_inline and then into
+  // xattr_spill, which is NULL until a spill block on disk is read
+  uint8_t xattr_inline_len;
+  uint8_t xattr_inline[XATTR_INLINE_SIZE];
+  uint16_t xattr_spill_len;
+  uint8_t * xattr_spill;
+  uint32_t xattr_block;
+  // The spill block must be rewritten at the next sync
+  bool xattr_dirty;
+};
+
+/*
+ * readdir cookies: "." is 1, ".." is 2 and children count up from 3 in the
+ * order they were added, so an offset stays valid across unrelated inserts
+ * and removals.
+ */
+#define DIR_COOKIE_DOT 1
+#define DIR_COOKIE_DOTDOT 2
+#define DIR_COOKIE_FIRST 3
+
+/**
+ * Per-opendir state: where the previous readdir chunk stopped, so that the
+ * next one can resume without searching the child list.
+ */
+struct dir_handle {
+  fuse_ino_t resume_ino;
+  off_t resume_cookie;
+};
+
+/*
+ * Hash index of directory entries keyed by (parent_inode, name).
+ *
+ * Every named inode is chained into exactly one bucket, so lookups, unlinks
+ * and duplicate checks cost O(1) on average instead of a scan of every inode.
+ * The bucket count is a power of two and doubles once the load factor
+ * reaches one.
+ */
+struct name_index {
+  // Held shared by lookups, exclusively to insert or remove
+  pthread_rwlock_t lock;
+  fuse_ino_t * buckets;
+  size_t bucket_count;
+  size_t entries;
+};
+
+/*
+ * Directory entry names, interned in slabs of fixed-size slots so that an
+ * inode pays for the name it has rather than the longest one allowed. A
+ * slot holds the name's length, the name and a NUL, in the smallest size
+ * class that fits. Freed slots go on their class's free list for the next
+ * name of that class; slabs are only released with the inode table.
+ */
+#define NAME_CLASSES 5
+#define NAME_SLAB_SIZE (16 << 10)
+
+struct name_slab {
+  struct name_slab * next;
+  // Slots start here, 8-byte aligned so free ones can hold a pointer
+  uint64_t slots[];
+};
+
+struct name_arena {
+  // Leaf lock, taken with directory and index locks held
+  pthread_mutex_t lock;
+  struct name_slab * slabs;
+  // Per class: freed slots, chained through their first bytes, and the part
+  // of a slab not handed out yet
+  char * free[NAME_CLASSES];
+  char * fresh[NAME_CLASSES];
+  char * fresh_end[NAME_CLASSES];
+
+  // Names in use, the bytes of the slots they occupy and of all slabs
+  size_t live;
+  size_t slot_bytes;
+  size_t slab_bytes;
+};
+
+/**
+ * A page compressed with lz_compress().
+ */
+struct lz_page {
+  uint16_t size;
+  uint8_t data[];
+};
+
+struct file_page {
+  // In-memory copy of the page, or NULL if it is a hole or not loaded yet
+  char * mem;
+  // Compressed copy of a cold page (with or without `mem` as well)
+  struct lz_page * zmem;
+  // The shared copy `mem` belongs to, while PAGE_SHARED
+  struct dedup_entry * shared;
+  // Backing-file block holding the page, or 0 if it has never been written
+  uint32_t block;
+  uint32_t flags;
+};
+
+/**
+ * File contents, stored as fixed-size pages that are allocated on first
+ * write. A NULL page is a hole and reads back as zeros, so extending a file
+ * never copies existing data and seeking past EOF costs nothing.
+ */
 typedef struct file_data {
-  char * content;
+  // Page i holds bytes [i * FILE_PAGE_SIZE, (i + 1) * FILE_PAGE_SIZE)
+  struct file_page * pages;
+  // Capacity of `pages` (grows geometrically, independent of `size`)
+  size_t page_count;
   size_t size;
+
+  // Block map as stored in the backing file
+  struct disk_map map;
+  // Indirect blocks hanging off map.dindirect
+  uint32_t * dind_blocks;
+  size_t dind_count;
+  // Has `map` been expanded into pages[].block yet? (loaded lazily)
+  bool map_loaded;
+  // Do the on-disk map blocks need to be rewritten?
+  bool map_dirty;
+  // Is this file on the disk's dirty-file list?
+  bool on_dirty_list;
+  // Page range [dirty_first, dirty_last) holding every PAGE_DIRTY page, so
+  // that a flush of a large file only visits what was written since the last
+  uint64_t dirty_first;
+  uint64_t dirty_last;
+
+  // Bumped by every change to the contents, and its value at the last
+  // open: a file that hasn't changed since keeps the kernel's page cache
+  uint32_t version;
+  uint32_t open_version;
+
+  // The inode that owns this data, for background work that starts from
+  // a page, and when its pages were last used (with compression on)
+  fuse_ino_t ino;
+  uint32_t last_use;
 }
 file_data;
 
-struct stat * file_stats;
-file_data * file_contents;
-struct file_node * helper_array;
-int current_file_count = 4;
+/**
+ * Per-open state of a regular file, kept in fi->fh.
+ */
+struct open_file {
+  fuse_ino_t ino;
+  // The inode's generation at open, so that a handle can tell if the
+  // inode number has been handed out again
+  uint64_t generation;
+  // inode_data(ino), valid while the generation matches
+  struct file_data * data;
+  bool writable;
+  bool append;
+};
+
+/**
+ * A fixed-size slab of inodes.
+ *
+ * Chunks are allocated on demand and released once every inode in them has
+ * been freed, so memory follows the number of live files. Entries never move
+ * once allocated, so pointers to them stay valid while the table grows.
+ */
+struct inode_chunk {
+  struct stat stats[INODE_CHUNK_SIZE];
+  struct file_node nodes[INODE_CHUNK_SIZE];
+  struct file_meta meta[INODE_CHUNK_SIZE];
+  struct file_data data[INODE_CHUNK_SIZE];
+
+  // Per-inode locks: readers of a directory's children or a file's pages
+  // share it, anything that changes them takes it exclusively
+  pthread_rwlock_t locks[INODE_CHUNK_SIZE];
+  // Per-inode sequence counters for lock-free copies of stats[] (odd while
+  // a writer is changing the stat)
+  unsigned seqs[INODE_CHUNK_SIZE];
+
+  // Number of allocated inodes in this chunk (atomic)
+  unsigned live;
+  // Slots [0, bump) have been handed out at least once (atomic)
+  unsigned bump;
+  // Recycled inode numbers in this chunk (0 terminates the list)
+  fuse_ino_t free_head;
+  pthread_mutex_t free_lock;
+};
+
+/*
+ * Inode allocator: a directory of chunks plus a hint pointing at the lowest
+ * chunk that may have a free slot. Allocating from the lowest chunk keeps
+ * inode numbers dense, which lets chunks near the top empty out and be
+ * returned to the system.
+ *
+ * The directory never moves and every field is updated atomically, so
+ * threads allocate without a global lock. Empty chunks are only freed by
+ * inode_reclaim(), while no operation is running.
+ */
+struct inode_table {
+  struct inode_chunk ** chunks;
+  size_t chunk_count;
+  size_t alloc_hint;
+  size_t live;
+  // Unlinked inodes kept for the kernel's references (included in live)
+  size_t orphans;
+  // File pages held in memory (without a backing file, that is all data)
+  size_t pages;
+  uint64_t generation;
+};
+
+/*
+ * Content-addressed store of file pages that hold identical data, when
+ * mounted with -o dedup. A page whose last byte has just been written is
+ * hashed and, if the table has a page with the same contents (confirmed
+ * with a byte compare), shares that page's memory instead of keeping its
+ * own. Shared memory is never modified: a write to it copies first.
+ *
+ * A page without a match stays private, and is only remembered as a
+ * candidate: where to look when a later page hashes the same. If the two
+ * compare equal, the candidate's memory becomes the shared copy.
+ *
+ * Snapshots share pages through the same entries, with or without -o dedup,
+ * but don't hash them: those copies can't be found by their contents.
+ *
+ * This saves memory, not space in the backing file: every page still
+ * has its own block there.
+ */
+struct dedup_entry {
+  struct dedup_entry * next;
+  uint64_t hash;
+  // Is it in the buckets under `hash`?
+  bool indexed;
+  char * mem;
+  // File pages pointing at `mem`
+  uint64_t refs;
+};
+
+/**
+ * A private page that hashed to `hash` when it was last written. Only a
+ * hint: the page may have changed or gone since.
+ */
+struct dedup_candidate {
+  uint64_t hash;
+  fuse_ino_t ino;
+  size_t index;
+};
+
+struct dedup_table {
+  bool enabled;
+  // Leaf lock, taken with file pages' inodes locked
+  pthread_mutex_t lock;
+  struct dedup_entry ** buckets;
+  size_t bucket_count;
+  // Distinct shared pages, and the file pages that point at them
+  size_t entries;
+  uint64_t refs;
+  // DEDUP_CANDIDATES slots by hash, the newest unmatched page winning
+  struct dedup_candidate * candidates;
+
+  uint64_t hashed;
+  uint64_t collisions;
+  uint64_t copies;
+};
+
+/**
+ * A page whose decompressed copy is being kept for reads.
+ */
+struct compress_cached {
+  fuse_ino_t ino;
+  size_t index;
+};
+
+/*
+ * Compression of cold file data, when mounted with -o compress_idle=N. A
+ * background thread compresses the pages of regular files that haven't
+ * been used for N seconds, keeping the result if it is small enough. A
+ * read decompresses a page next to its compressed copy; the thread drops
+ * the oldest such copies once there are more than COMPRESS_CACHE_PAGES. A
+ * write discards the compressed copy.
+ *
+ * With a backing file, cold pages are released instead once they are clean:
+ * reading one back costs less than keeping it twice.
+ */
+struct compress_state {
+  // Idle seconds before a file's pages are compressed (0: off)
+  unsigned idle;
+  // Largest compressed page worth keeping, in bytes
+  size_t limit;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t thread;
+  bool running;
+  // Ring of decompressed pages, oldest first
+  struct compress_cached * ring;
+  size_t ring_head;
+  size_t ring_count;
+
+  // Compressed pages and their size (atomic)
+  uint64_t pages;
+  uint64_t bytes;
+  // Pages compressed, found incompressible, decompressed, and released
+  // (atomic)
+  uint64_t compressed;
+  uint64_t rejected;
+  uint64_t decompressed;
+  uint64_t released;
+};
+
+/**
+ * One block held by the CLOCK cache.
+ */
+struct cache_buf {
+  uint64_t block;
+  char * mem;
+  bool valid;
+  bool dirty;
+  // Second-chance bit, set on every access and cleared by the clock hand
+  bool referenced;
+  // Next buffer in the same hash bucket (-1 terminates the chain)
+  int32_t hash_next;
+};
+
+/*
+ * Block cache between the filesystem and the backing file, in one of two
+ * modes:
+ *
+ *  - mmap: the whole backing file is mapped and block I/O is a memcpy to or
+ *    from the mapping. The kernel's page cache decides what stays resident;
+ *    madvise() tells it that access is mostly random, plus read-ahead for
+ *    files being read in order.
+ *  - CLOCK: a fixed budget of block buffers, found through a hash table and
+ *    evicted with the CLOCK (second chance) algorithm.
+ *
+ * In both modes writes only dirty the cache. Dirty blocks go to the backing
+ * file in batches, sorted by block number and with adjacent blocks
+ * coalesced into a single pwritev() or msync() call.
+ */
+struct block_cache {
+  bool use_mmap;
+
+  char * map;
+  size_t map_size;
+  // mmap mode: one flag per block plus a list of the dirty ones
+  bool * map_dirty;
+
+  struct cache_buf * bufs;
+  size_t nbufs;
+  size_t hand;
+  int32_t * hash;
+  size_t hash_mask;
+
+  // Blocks waiting for writeback (block numbers in mmap mode, buffer
+  // indices in CLOCK mode)
+  uint64_t * dirty;
+  size_t dirty_count;
+
+  uint64_t reads;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t writeback_blocks;
+  uint64_t writeback_batches;
+  uint64_t writeback_calls;
+};
+
+/**
+ * State of the mounted backing file (fd is -1 when running from memory only).
+ */
+struct disk_state {
+  int fd;
+  struct disk_superblock sb;
+
+  // In-memory copy of the free-block bitmap, written back per block
+  uint64_t * bitmap;
+  bool * bitmap_dirty;
+  // Blocks freed since the last checkpoint: an uncheckpointed transaction
+  // may still replay an old image over them, so they are reused last
+  uint64_t * reuse_fence;
+  // Word of the bitmap where the next allocation search starts
+  size_t alloc_cursor;
+
+  // The inode table, stored as a file of serialized inode records
+  struct file_data itable;
+  // One flag per inode table block whose records have changed
+  bool * itable_dirty;
+  size_t itable_dirty_size;
+
+  // Extra owners of each block shared by snapshots (NULL until the first
+  // one), with a flag per table block that has changed
+  uint8_t * refs;
+  bool * refs_dirty;
+  struct file_data refs_file;
+
+  // Names too long for their inode records
+  struct file_data names_file;
+
+  // Files with dirty pages or block maps
+  fuse_ino_t * dirty_files;
+  size_t dirty_count;
+  size_t dirty_capacity;
+
+  struct block_cache cache;
+};
+
+/**
+ * A reply held back until the metadata change it reports is durable.
+ */
+struct pending_reply {
+  fuse_req_t req;
+  enum {
+    PENDING_ERR, PENDING_ENTRY, PENDING_CREATE, PENDING_ATTR, PENDING_OPEN,
+    PENDING_WRITE
+  } kind;
+  struct fuse_entry_param entry;
+  struct fuse_file_info fi;
+  size_t count;
+};
+
+/**
+ * Journal state: the transaction being assembled and the group commit
+ * queue.
+ */
+struct journal_state {
+  // While set, metadata writes are captured into the transaction
+  bool capturing;
+  uint64_t * txn_blocks;
+  char * txn_images;
+  size_t txn_count;
+  size_t txn_capacity;
+
+  // Next free journal block and the sequence number it will get
+  uint64_t head;
+  uint64_t seq;
+  // Superblock as of the last commit (the in-memory one may be ahead)
+  struct disk_superblock committed;
+
+  // Commit every operation on its own instead of in groups
+  bool sync_commit;
+  long window_us;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t committer;
+  bool running;
+  struct pending_reply * pending;
+  size_t pending_count;
+  size_t pending_capacity;
+  struct timespec first_pending;
+  // Operations running under fs_lock, any of which may still join the group
+  unsigned active;
+  // Set when a reply was queued with no other operation running, so that
+  // waiting out the window would only add latency
+  bool group_closed;
+
+  // Journal blocks that operations since the last capture have reserved
+  // (see journal_reserve), and those waiting for the next capture to start
+  // over
+  size_t reserved;
+  unsigned reserve_waiting;
+  uint64_t captures;
+  pthread_cond_t captured;
+
+  uint64_t commits;
+  uint64_t commit_ops;
+  uint64_t checkpoints;
+};
+
+/**
+ * Kernel cache invalidations waiting for the notifier thread.
+ *
+ * A notification can block until the kernel has finished the request that
+ * caused it, so none are sent from a request handler.
+ */
+struct notify_state {
+  struct fuse_session * session;
+  // Cache timeout for inodes that can change
+  double timeout;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t thread;
+  bool running;
+  fuse_ino_t * queue;
+  size_t count;
+  size_t capacity;
+
+  uint64_t sent;
+};
+
+/*
+ * The operations in assign5_ops that run under fs_lock, each of which gets
+ * counters, a latency histogram and trace records.
+ */
+#define ASSIGN5_OPS(X) \
+  X(create) X(fallocate) X(forget) X(forget_multi) X(fsync) X(fsyncdir) \
+  X(getattr) X(getxattr) X(link) X(listxattr) X(lookup) X(mkdir) X(mknod) \
+  X(open) X(opendir) X(read) X(readdir) X(readdirplus) X(release) \
+  X(releasedir) X(removexattr) X(rename) X(rmdir) X(setattr) X(setxattr) \
+  X(statfs) X(unlink) X(write)
+
+#define OP_ID(op) OP_ ## op,
+#define OP_NAME(op) #op,
+
+enum op_id {
+  ASSIGN5_OPS(OP_ID)
+  OP_COUNT
+};
+
+static const char * const op_names[OP_COUNT] = {
+  ASSIGN5_OPS(OP_NAME)
+};
+
+/**
+ * Counters for one operation, updated atomically by every worker thread
+ * (and kept on separate cache lines so that busy operations don't slow
+ * each other down).
+ */
+struct op_stats {
+  uint64_t calls;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t buckets[STATS_BUCKETS];
+} __attribute__((aligned(64)));
+
+/**
+ * One traced operation. `seq` is written last, so that a reader can tell
+ * a complete record from one that is being overwritten.
+ */
+struct trace_record {
+  uint64_t seq;
+  uint64_t start_ns;
+  uint64_t latency_ns;
+  fuse_ino_t ino;
+  enum op_id op;
+};
+
+/**
+ * Trace ring: the most recent operations, oldest first from `head`.
+ */
+struct trace_ring {
+  struct trace_record * records;
+  // Ring size minus one (the size is a power of two)
+  size_t mask;
+  // Total number of records ever added
+  uint64_t head;
+};
+
+/**
+ * A file in the root directory whose contents are generated when it is
+ * opened. A command file also runs each write as a command.
+ */
+struct synthetic_file {
+  const char * name;
+  void( * generate)(FILE * out);
+  int( * command)(char * args);
+};
+
+/**
+ * Contents of an open synthetic file, as of its open().
+ */
+struct synthetic_handle {
+  char * data;
+  size_t size;
+};
+
+/**
+ * Counters for /.snapshot (atomic).
+ */
+struct snapshot_state {
+  uint64_t taken;
+  uint64_t files;
+  uint64_t directories;
+  // File blocks and in-memory pages shared with a snapshot, and pages that
+  // had to be copied instead
+  uint64_t shared_blocks;
+  uint64_t shared_pages;
+  uint64_t copied_pages;
+};
+
+static struct inode_table inodes;
+static struct name_index dir_index = {
+  .lock = PTHREAD_RWLOCK_INITIALIZER
+};
+static struct name_arena names = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static struct disk_state disk = {
+  .fd = -1
+};
+static struct journal_state journal = {
+  .captured = PTHREAD_COND_INITIALIZER,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+};
+static struct notify_state notify = {
+  .timeout = TIMEOUT_DEFAULT,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+};
+static struct dedup_table dedup = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static struct compress_state compress = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+};
+static struct snapshot_state snapshot;
+static struct op_stats op_stats[OP_COUNT];
+static struct trace_ring trace;
+// Did the kernel agree to cache writes (so it owns file sizes and appends)?
+static bool writeback_cache;
+
+/*
+ * Held shared by every operation and exclusively by the journal committer,
+ * which needs a stable view of all metadata while it builds a transaction.
+ */
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Serializes renames, the only operations that move directories, so that a
+// rename can trust the ancestry of the directories it locks
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Leaf locks for state shared by all inodes: the bitmap (with the reuse
+// fence, free-block count and block share table), the dirty lists and the
+// block cache
+static pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static
 const int AllRead = S_IRUSR | S_IRGRP | S_IROTH;
@@ -58,452 +908,7000 @@ const char FeaturesContents[] = "The following features are implemented:\n"
 "-File creation\n"
 "-Unlinking files\n"
 "-Permission setting\n"
-"-Writing to file\n";
+"-Writing to file\n"
+"-Renaming files\n"
+"-Hard links\n"
+"-Extended attributes\n"
+"-Copy-on-write snapshots\n";
 
-const char * get_response_data(const char * content, off_t off, size_t size, size_t * response_len);
-void clear_file_entry(int index);
+void clear_file_entry(fuse_ino_t ino);
+static struct file_data * dedup_lock_file(fuse_ino_t ino);
+static void inode_unlock(fuse_ino_t ino);
+static void inode_forget(fuse_ino_t ino, uint64_t count);
+static int snapshot_command(char * args);
 
-static void assign5_init(void * userdata, struct fuse_conn_info * conn) {
-  struct backing_file * backing = userdata;
-  fprintf(stderr, "*** %s '%s'\n", __func__, backing -> bf_path);
+static int disk_io(bool write, uint64_t block, void * buf) {
+  char * p = buf;
+  size_t done = 0;
+  off_t base = (off_t) block * DISK_BLOCK_SIZE;
 
-  file_stats = calloc(FILE_COUNT + 1, sizeof( * file_stats));
-  helper_array = calloc(FILE_COUNT + 1, sizeof(struct file_node));
-  file_contents = calloc(FILE_COUNT + 1, sizeof(struct file_data));
+  while (done < DISK_BLOCK_SIZE) {
+    ssize_t len = write ?
+      pwrite(disk.fd, p + done, DISK_BLOCK_SIZE - done, base + done) :
+      pread(disk.fd, p + done, DISK_BLOCK_SIZE - done, base + done);
 
-  struct {
-    fuse_ino_t ino;
-    mode_t mode;
-    int is_directory;
-    fuse_ino_t parent_inode;
-    const char * name;
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (len < 0) {
+      return EIO;
+    }
+
+    if (len == 0) {
+      // Reading past EOF of a sparse backing file: the rest is zeros
+      memset(p + done, 0, DISK_BLOCK_SIZE - done);
+      break;
+    }
+
+    done += len;
+  }
+
+  return 0;
+}
+
+static int cache_order(const void * a, const void * b) {
+  uint64_t x = * (const uint64_t * ) a;
+  uint64_t y = * (const uint64_t * ) b;
+  return (x > y) - (x < y);
+}
+
+static uint64_t cache_dirty_block(size_t i) {
+  struct block_cache * cache = & disk.cache;
+  return cache -> use_mmap ? cache -> dirty[i] : cache -> bufs[cache -> dirty[i]].block;
+}
+
+static int cache_dirty_order(const void * a, const void * b) {
+  const struct block_cache * cache = & disk.cache;
+  uint64_t x = cache -> bufs[ * (const uint64_t * ) a].block;
+  uint64_t y = cache -> bufs[ * (const uint64_t * ) b].block;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Write every dirty block back to the backing file, sorted by block number
+ * and with runs of adjacent blocks coalesced into one call each. Called with
+ * cache_lock held.
+ *
+ * @returns    0, or EIO if a run failed (its blocks stay dirty, to be
+ *             written by the next writeback)
+ */
+static int cache_writeback(void) {
+  struct block_cache * cache = & disk.cache;
+  if (cache -> dirty_count == 0) {
+    return 0;
+  }
+
+  qsort(cache -> dirty, cache -> dirty_count, sizeof( * cache -> dirty),
+    cache -> use_mmap ? cache_order : cache_dirty_order);
+
+  struct iovec iov[CACHE_WRITE_IOV];
+  int err = 0;
+  // Blocks whose write failed stay dirty, at the front of the list
+  size_t kept = 0;
+
+  for (size_t i = 0; i < cache -> dirty_count;) {
+    uint64_t first = cache_dirty_block(i);
+    size_t run = 1;
+
+    while (i + run < cache -> dirty_count && run < CACHE_WRITE_IOV &&
+      cache_dirty_block(i + run) == first + run) {
+      run++;
+    }
+
+    bool written;
+    if (cache -> use_mmap) {
+      char * start = cache -> map + first * DISK_BLOCK_SIZE;
+      written = msync(start, run * DISK_BLOCK_SIZE, MS_ASYNC) == 0;
+      for (size_t j = 0; written && j < run; j++) {
+        cache -> map_dirty[first + j] = false;
+      }
+    } else {
+      for (size_t j = 0; j < run; j++) {
+        iov[j].iov_base = cache -> bufs[cache -> dirty[i + j]].mem;
+        iov[j].iov_len = DISK_BLOCK_SIZE;
+      }
+
+      size_t len = run * DISK_BLOCK_SIZE;
+      written = pwritev(disk.fd, iov, run, (off_t) first * DISK_BLOCK_SIZE) ==
+        (ssize_t) len;
+      for (size_t j = 0; written && j < run; j++) {
+        cache -> bufs[cache -> dirty[i + j]].dirty = false;
+      }
+    }
+
+    if (written) {
+      cache -> writeback_blocks += run;
+    } else {
+      err = EIO;
+      memmove(cache -> dirty + kept, cache -> dirty + i, run * sizeof( * cache -> dirty));
+      kept += run;
+    }
+    cache -> writeback_calls++;
+    i += run;
+  }
+
+  cache -> writeback_batches++;
+  cache -> dirty_count = kept;
+
+  return err;
+}
+
+static int32_t * cache_bucket(uint64_t block) {
+  struct block_cache * cache = & disk.cache;
+  return & cache -> hash[(block * 0x9e3779b97f4a7c15ull >> 32) & cache -> hash_mask];
+}
+
+static struct cache_buf * cache_lookup(uint64_t block) {
+  struct block_cache * cache = & disk.cache;
+
+  for (int32_t i = * cache_bucket(block); i >= 0; i = cache -> bufs[i].hash_next) {
+    if (cache -> bufs[i].block == block) {
+      return & cache -> bufs[i];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Pick a buffer to reuse with the CLOCK algorithm.
+ *
+ * Meeting a dirty victim triggers a batched writeback of everything that is
+ * dirty, rather than one synchronous write per eviction.
+ */
+static struct cache_buf * cache_victim(void) {
+  struct block_cache * cache = & disk.cache;
+
+  for (;;) {
+    struct cache_buf * buf = & cache -> bufs[cache -> hand];
+    cache -> hand = (cache -> hand + 1) % cache -> nbufs;
+
+    if (!buf -> valid) {
+      if (buf -> mem == NULL && (buf -> mem = malloc(DISK_BLOCK_SIZE)) == NULL) {
+        return NULL;
+      }
+      return buf;
+    }
+
+    if (buf -> referenced) {
+      buf -> referenced = false;
+      continue;
+    }
+
+    if (buf -> dirty && cache_writeback() != 0) {
+      return NULL;
+    }
+
+    for (int32_t * link = cache_bucket(buf -> block); * link >= 0;
+      link = & cache -> bufs[ * link].hash_next) {
+      if ( & cache -> bufs[ * link] == buf) {
+        * link = buf -> hash_next;
+        break;
+      }
+    }
+
+    buf -> valid = false;
+    cache -> evictions++;
+    return buf;
+  }
+}
+
+static void cache_insert(struct cache_buf * buf, uint64_t block) {
+  int32_t * head = cache_bucket(block);
+
+  buf -> block = block;
+  buf -> valid = true;
+  buf -> referenced = true;
+  buf -> hash_next = * head;
+  * head = buf - disk.cache.bufs;
+}
+
+static int cache_mark_dirty(uint64_t block, struct cache_buf * buf) {
+  struct block_cache * cache = & disk.cache;
+
+  if (cache -> use_mmap) {
+    if (cache -> map_dirty[block]) {
+      return 0;
+    }
+    cache -> map_dirty[block] = true;
+  } else {
+    if (buf -> dirty) {
+      return 0;
+    }
+    buf -> dirty = true;
+  }
+
+  cache -> dirty[cache -> dirty_count++] = cache -> use_mmap ?
+    block : (uint64_t)(buf - cache -> bufs);
+  return 0;
+}
+
+/**
+ * Hint that `count` blocks starting at `block` are about to be read.
+ */
+static void cache_prefetch(uint64_t block, size_t count) {
+  struct block_cache * cache = & disk.cache;
+
+  if (cache -> use_mmap) {
+    madvise(cache -> map + block * DISK_BLOCK_SIZE, count * DISK_BLOCK_SIZE,
+      MADV_WILLNEED);
+  } else {
+    posix_fadvise(disk.fd, (off_t) block * DISK_BLOCK_SIZE,
+      (off_t) count * DISK_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+  }
+}
+
+/**
+ * Find the image of `block` in the transaction being assembled.
+ */
+static char * journal_image(uint64_t block) {
+  for (size_t i = 0; i < journal.txn_count; i++) {
+    if (journal.txn_blocks[i] == block) {
+      return journal.txn_images + i * DISK_BLOCK_SIZE;
+    }
+  }
+
+  return NULL;
+}
+
+static int cache_flush(void) {
+  pthread_mutex_lock( & cache_lock);
+  int err = cache_writeback();
+  pthread_mutex_unlock( & cache_lock);
+
+  return err;
+}
+
+static int disk_read(uint64_t block, void * buf) {
+  struct block_cache * cache = & disk.cache;
+  __atomic_add_fetch( & cache -> reads, 1, __ATOMIC_RELAXED);
+
+  char * image = journal.capturing ? journal_image(block) : NULL;
+  if (image != NULL) {
+    memcpy(buf, image, DISK_BLOCK_SIZE);
+    return 0;
+  }
+
+  if (cache -> use_mmap) {
+    memcpy(buf, cache -> map + block * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+    return 0;
+  }
+
+  int err = 0;
+  pthread_mutex_lock( & cache_lock);
+
+  struct cache_buf * cached = cache_lookup(block);
+  if (cached != NULL) {
+    cache -> hits++;
+  } else {
+    cache -> misses++;
+    if ((cached = cache_victim()) == NULL) {
+      err = EIO;
+    } else if ((err = disk_io(false, block, cached -> mem)) == 0) {
+      cache_insert(cached, block);
+    }
+  }
+
+  if (err == 0) {
+    cached -> referenced = true;
+    memcpy(buf, cached -> mem, DISK_BLOCK_SIZE);
+  }
+
+  pthread_mutex_unlock( & cache_lock);
+  return err;
+}
+
+static int disk_write(uint64_t block, const void * buf) {
+  struct block_cache * cache = & disk.cache;
+  int err = 0;
+
+  pthread_mutex_lock( & cache_lock);
+
+  if (cache -> use_mmap) {
+    memcpy(cache -> map + block * DISK_BLOCK_SIZE, buf, DISK_BLOCK_SIZE);
+    err = cache_mark_dirty(block, NULL);
+    pthread_mutex_unlock( & cache_lock);
+    return err;
+  }
+
+  // Whole-block writes never need the old contents
+  struct cache_buf * cached = cache_lookup(block);
+  if (cached == NULL) {
+    if ((cached = cache_victim()) != NULL) {
+      cache_insert(cached, block);
+    }
+  }
+
+  if (cached == NULL) {
+    err = EIO;
+  } else {
+    cached -> referenced = true;
+    memcpy(cached -> mem, buf, DISK_BLOCK_SIZE);
+    err = cache_mark_dirty(block, cached);
+  }
+
+  pthread_mutex_unlock( & cache_lock);
+  return err;
+}
+
+/**
+ * Write a metadata block. While a transaction is being assembled the block
+ * only goes into the transaction; it reaches the cache once the transaction
+ * is committed to the journal.
+ */
+static int disk_write_meta(uint64_t block, const void * buf) {
+  if (!journal.capturing) {
+    return disk_write(block, buf);
+  }
+
+  char * image = journal_image(block);
+  if (image == NULL) {
+    if (journal.txn_count == journal.txn_capacity) {
+      size_t capacity = journal.txn_capacity ? journal.txn_capacity * 2 : 64;
+      uint64_t * blocks = realloc(journal.txn_blocks, capacity * sizeof( * blocks));
+      if (blocks == NULL) {
+        return ENOMEM;
+      }
+      journal.txn_blocks = blocks;
+
+      char * images = realloc(journal.txn_images, capacity * DISK_BLOCK_SIZE);
+      if (images == NULL) {
+        return ENOMEM;
+      }
+      journal.txn_images = images;
+      journal.txn_capacity = capacity;
+    }
+
+    journal.txn_blocks[journal.txn_count] = block;
+    image = journal.txn_images + journal.txn_count++ * DISK_BLOCK_SIZE;
+  }
+
+  memcpy(image, buf, DISK_BLOCK_SIZE);
+  return 0;
+}
+
+/**
+ * Set up the block cache once the size of the backing file is known.
+ */
+static int cache_init(const struct assign5_options * options) {
+  struct block_cache * cache = & disk.cache;
+  memset(cache, 0, sizeof( * cache));
+  cache -> use_mmap = options -> ao_cache_mmap;
+
+  if (cache -> use_mmap) {
+    cache -> map_size = disk.sb.total_blocks * DISK_BLOCK_SIZE;
+    cache -> map = mmap(NULL, cache -> map_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED, disk.fd, 0);
+    if (cache -> map == MAP_FAILED) {
+      cache -> map = NULL;
+      return errno;
+    }
+
+    // Metadata and small files are scattered; sequential readers get
+    // explicit read-ahead from cache_prefetch()
+    madvise(cache -> map, cache -> map_size, MADV_RANDOM);
+
+    cache -> map_dirty = calloc(disk.sb.total_blocks, sizeof( * cache -> map_dirty));
+    cache -> dirty = malloc(disk.sb.total_blocks * sizeof( * cache -> dirty));
+    return (cache -> map_dirty && cache -> dirty) ? 0 : ENOMEM;
+  }
+
+  size_t budget = options -> ao_cache_mb ? options -> ao_cache_mb : CACHE_DEFAULT_MB;
+  cache -> nbufs = budget * (1024 * 1024 / DISK_BLOCK_SIZE);
+  if (cache -> nbufs < 16) {
+    cache -> nbufs = 16;
+  }
+
+  size_t buckets = 1;
+  while (buckets < cache -> nbufs) {
+    buckets *= 2;
+  }
+  cache -> hash_mask = buckets - 1;
+
+  // Buffer memory is allocated on first use, so a small filesystem never
+  // pays for the whole budget
+  cache -> bufs = calloc(cache -> nbufs, sizeof( * cache -> bufs));
+  cache -> hash = malloc(buckets * sizeof( * cache -> hash));
+  cache -> dirty = malloc(cache -> nbufs * sizeof( * cache -> dirty));
+  if (!cache -> bufs || !cache -> hash || !cache -> dirty) {
+    return ENOMEM;
+  }
+
+  memset(cache -> hash, 0xff, buckets * sizeof( * cache -> hash));
+  return 0;
+}
+
+static void cache_release(void) {
+  struct block_cache * cache = & disk.cache;
+
+  if (cache -> map != NULL) {
+    munmap(cache -> map, cache -> map_size);
+  }
+
+  for (size_t i = 0; i < cache -> nbufs; i++) {
+    free(cache -> bufs[i].mem);
+  }
+
+  free(cache -> bufs);
+  free(cache -> hash);
+  free(cache -> map_dirty);
+  free(cache -> dirty);
+  memset(cache, 0, sizeof( * cache));
+}
+
+static void cache_report(FILE * out) {
+  struct block_cache * cache = & disk.cache;
+
+  if (cache -> use_mmap) {
+    fprintf(out, "block cache: mmap, %zu MiB mapped, %lu reads\n",
+      cache -> map_size >> 20, (unsigned long) cache -> reads);
+  } else {
+    fprintf(out, "block cache: CLOCK, %zu buffers, %lu reads, %lu hits"
+      " (%.1f%%), %lu misses, %lu evictions\n",
+      cache -> nbufs, (unsigned long) cache -> reads,
+      (unsigned long) cache -> hits,
+      cache -> reads ? 100.0 * cache -> hits / cache -> reads : 0.0,
+      (unsigned long) cache -> misses, (unsigned long) cache -> evictions);
+  }
+
+  fprintf(out, "writeback: %lu blocks in %lu calls over %lu batches\n",
+    (unsigned long) cache -> writeback_blocks,
+    (unsigned long) cache -> writeback_calls,
+    (unsigned long) cache -> writeback_batches);
+}
+
+static void bitmap_set(uint64_t block, bool used) {
+  uint64_t bit = 1ull << (block % 64);
+
+  if (used) {
+    disk.bitmap[block / 64] |= bit;
+    disk.sb.free_blocks--;
+  } else {
+    disk.bitmap[block / 64] &= ~bit;
+    disk.sb.free_blocks++;
+  }
+
+  disk.bitmap_dirty[block / DISK_BITS_PER_BLOCK] = true;
+}
+
+/**
+ * Allocate a block from the bitmap, searching onward from the last
+ * allocation so that sequential writers get (mostly) contiguous blocks.
+ *
+ * @returns    a block number, or 0 if the backing file is full
+ */
+static uint32_t block_alloc(void) {
+  size_t words = (disk.sb.total_blocks + 63) / 64;
+  pthread_mutex_lock( & block_lock);
+
+  // Fenced blocks are only handed out when the disk is otherwise full
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t n = 0; n < words; n++) {
+      size_t w = (disk.alloc_cursor + n) % words;
+      uint64_t used = disk.bitmap[w] | (pass == 0 ? disk.reuse_fence[w] : 0);
+      if (used == UINT64_MAX) {
+        continue;
+      }
+
+      uint64_t block = w * 64 + __builtin_ctzll(~used);
+      if (block >= disk.sb.total_blocks) {
+        continue;
+      }
+
+      bitmap_set(block, true);
+      disk.alloc_cursor = w;
+      pthread_mutex_unlock( & block_lock);
+      return block;
+    }
+  }
+
+  pthread_mutex_unlock( & block_lock);
+  return 0;
+}
+
+static bool block_taken(uint64_t block, bool fenced) {
+  uint64_t used = disk.bitmap[block / 64] | (fenced ? disk.reuse_fence[block / 64] : 0);
+  return (used >> (block % 64)) & 1;
+}
+
+/**
+ * Allocate a run of up to `want` physically contiguous blocks, for
+ * preallocation. Like block_alloc(), this prefers unfenced blocks.
+ *
+ * @returns    the first block of the run, or 0 if the backing file is
+ *             full, with the length of the run in `got`
+ */
+static uint32_t block_alloc_run(size_t want, size_t * got) {
+  size_t words = (disk.sb.total_blocks + 63) / 64;
+  pthread_mutex_lock( & block_lock);
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t n = 0; n < words; n++) {
+      size_t w = (disk.alloc_cursor + n) % words;
+      uint64_t used = disk.bitmap[w] | (pass == 0 ? disk.reuse_fence[w] : 0);
+      if (used == UINT64_MAX) {
+        continue;
+      }
+
+      uint64_t start = w * 64 + __builtin_ctzll(~used);
+      size_t len = 0;
+      while (len < want && start + len < disk.sb.total_blocks &&
+        !block_taken(start + len, pass == 0)) {
+        bitmap_set(start + len, true);
+        len++;
+      }
+      if (len == 0) {
+        continue;
+      }
+
+      disk.alloc_cursor = ((start + len) / 64) % words;
+      pthread_mutex_unlock( & block_lock);
+      * got = len;
+      return start;
+    }
+  }
+
+  pthread_mutex_unlock( & block_lock);
+  * got = 0;
+  return 0;
+}
+
+static size_t refs_blocks(void) {
+  return (disk.sb.total_blocks + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+}
+
+/**
+ * Give `block` another owner, creating the block share table on first use.
+ *
+ * @returns    false if it can't be shared (its count is at the limit, or
+ *             there is no memory for the table)
+ */
+static bool block_share(uint32_t block) {
+  pthread_mutex_lock( & block_lock);
+
+  if (disk.refs == NULL) {
+    uint8_t * refs = calloc(refs_blocks(), DISK_BLOCK_SIZE);
+    bool * dirty = calloc(refs_blocks(), sizeof( * dirty));
+    if (refs != NULL && dirty != NULL) {
+      disk.refs_dirty = dirty;
+      __atomic_store_n( & disk.refs, refs, __ATOMIC_RELEASE);
+    } else {
+      free(refs);
+      free(dirty);
+    }
+  }
+
+  bool shared = disk.refs != NULL && disk.refs[block] < UINT8_MAX;
+  if (shared) {
+    disk.refs[block]++;
+    disk.refs_dirty[block / DISK_BLOCK_SIZE] = true;
+  }
+
+  pthread_mutex_unlock( & block_lock);
+  return shared;
+}
+
+/**
+ * Drop one of the extra owners of `block`, if it has any. Called with
+ * block_lock held.
+ */
+static bool block_put(uint32_t block) {
+  if (disk.refs == NULL || disk.refs[block] == 0) {
+    return false;
+  }
+
+  disk.refs[block]--;
+  disk.refs_dirty[block / DISK_BLOCK_SIZE] = true;
+  return true;
+}
+
+/**
+ * Give up a file's claim on a block it is about to stop writing in place.
+ *
+ * @returns    true if the block is shared, and the file needs a new one
+ */
+static bool block_unshare(uint32_t block) {
+  if (__atomic_load_n( & disk.refs, __ATOMIC_ACQUIRE) == NULL) {
+    return false;
+  }
+
+  pthread_mutex_lock( & block_lock);
+  bool shared = block_put(block);
+  pthread_mutex_unlock( & block_lock);
+  return shared;
+}
+
+static void block_free(uint32_t block) {
+  if (block != 0) {
+    pthread_mutex_lock( & block_lock);
+    // A shared block only loses an owner
+    if (!block_put(block)) {
+      bitmap_set(block, false);
+      disk.reuse_fence[block / 64] |= 1ull << (block % 64);
+    }
+    pthread_mutex_unlock( & block_lock);
+  }
+}
+
+/**
+ * Make sure the page table has room for at least `count` pages.
+ */
+static int data_reserve(struct file_data * data, size_t count) {
+  if (count <= data -> page_count) {
+    return 0;
+  }
+
+  size_t capacity = data -> page_count ? data -> page_count : 1;
+  while (capacity < count) {
+    capacity *= 2;
+  }
+
+  struct file_page * pages = realloc(data -> pages, capacity * sizeof( * pages));
+  if (pages == NULL) {
+    return ENOMEM;
+  }
+
+  memset(pages + data -> page_count, 0,
+    (capacity - data -> page_count) * sizeof( * pages));
+  data -> pages = pages;
+  data -> page_count = capacity;
+
+  return 0;
+}
+
+/**
+ * Expand the on-disk block map of a file into pages[].block, reading its
+ * indirect blocks. This happens on the first access to a file's data, not
+ * at mount time.
+ */
+static int data_load_map(struct file_data * data) {
+  if (data -> map_loaded) {
+    return 0;
+  }
+
+  // Blocks preallocated past the end of the file (fallocate() with
+  // FALLOC_FL_KEEP_SIZE) are in the map too, so cover every pointer in it
+  size_t npages = (data -> size + FILE_PAGE_SIZE - 1) >> FILE_PAGE_SHIFT;
+  for (size_t i = DISK_DIRECT; i > npages; i--) {
+    if (data -> map.direct[i - 1] != 0) {
+      npages = i;
+    }
+  }
+  if (data -> map.indirect != 0 && npages < DISK_DIRECT + DISK_PTRS_PER_BLOCK) {
+    npages = DISK_DIRECT + DISK_PTRS_PER_BLOCK;
+  }
+
+  int err = data_reserve(data, npages);
+  if (err != 0) {
+    return err;
+  }
+
+  for (size_t i = 0; i < DISK_DIRECT && i < npages; i++) {
+    data -> pages[i].block = data -> map.direct[i];
+  }
+
+  uint32_t * ptrs = malloc(DISK_BLOCK_SIZE);
+  if (ptrs == NULL) {
+    return ENOMEM;
+  }
+
+  size_t base = DISK_DIRECT;
+  if (data -> map.indirect != 0 && (err = disk_read(data -> map.indirect, ptrs)) == 0) {
+    for (size_t i = 0; i < DISK_PTRS_PER_BLOCK && base + i < npages; i++) {
+      data -> pages[base + i].block = ptrs[i];
+    }
+  }
+  base += DISK_PTRS_PER_BLOCK;
+
+  if (err == 0 && data -> map.dindirect != 0) {
+    data -> dind_blocks = malloc(DISK_BLOCK_SIZE);
+    if (data -> dind_blocks == NULL) {
+      err = ENOMEM;
+    } else if ((err = disk_read(data -> map.dindirect, data -> dind_blocks)) == 0) {
+      data -> dind_count = 0;
+      for (size_t j = 0; j < DISK_PTRS_PER_BLOCK && data -> dind_blocks[j] != 0; j++) {
+        data -> dind_count = j + 1;
+      }
+
+      if (npages < base + data -> dind_count * DISK_PTRS_PER_BLOCK) {
+        npages = base + data -> dind_count * DISK_PTRS_PER_BLOCK;
+        err = data_reserve(data, npages);
+      }
+
+      for (size_t j = 0; err == 0 && j < data -> dind_count; j++) {
+        err = disk_read(data -> dind_blocks[j], ptrs);
+        for (size_t i = 0; err == 0 && i < DISK_PTRS_PER_BLOCK; i++) {
+          size_t index = base + j * DISK_PTRS_PER_BLOCK + i;
+          if (index < npages) {
+            data -> pages[index].block = ptrs[i];
+          }
+        }
+      }
+    }
+  }
+
+  free(ptrs);
+  if (err == 0) {
+    data -> map_loaded = true;
+  }
+
+  return err;
+}
+
+/**
+ * Mark page `index` as needing to be written to the backing file. A clean
+ * page may share its block with a snapshot, and then moves to a new one.
+ */
+static void page_dirty(struct file_data * data, size_t index) {
+  struct file_page * page = & data -> pages[index];
+  if (!(page -> flags & PAGE_DIRTY) && page -> block != 0 &&
+    block_unshare(page -> block)) {
+    page -> block = 0;
+    data -> map_dirty = true;
+  }
+  page -> flags |= PAGE_DIRTY;
+
+  if (data -> dirty_first >= data -> dirty_last) {
+    data -> dirty_first = index;
+    data -> dirty_last = index + 1;
+  } else if (index < data -> dirty_first) {
+    data -> dirty_first = index;
+  } else if (index >= data -> dirty_last) {
+    data -> dirty_last = index + 1;
+  }
+}
+
+/**
+ * Hash a page's contents: four independent multiply-rotate lanes over
+ * 64-bit words, so that the loop isn't one long dependency chain.
+ */
+static uint64_t page_hash(const char * mem) {
+  const uint64_t prime1 = 0x9e3779b185ebca87ull;
+  const uint64_t prime2 = 0xc2b2ae3d27d4eb4full;
+  uint64_t lane[4] = { prime1, prime2, -prime1, 0 };
+
+  for (size_t i = 0; i < FILE_PAGE_SIZE; i += 4 * sizeof(uint64_t)) {
+    for (int j = 0; j < 4; j++) {
+      uint64_t word;
+      memcpy( & word, mem + i + j * sizeof(word), sizeof(word));
+      lane[j] += word * prime2;
+      lane[j] = ((lane[j] << 31) | (lane[j] >> 33)) * prime1;
+    }
+  }
+
+  uint64_t hash = ((lane[0] << 1) | (lane[0] >> 63)) +
+    ((lane[1] << 7) | (lane[1] >> 57)) +
+    ((lane[2] << 12) | (lane[2] >> 52)) +
+    ((lane[3] << 18) | (lane[3] >> 46));
+  hash ^= hash >> 33;
+  hash *= prime2;
+  hash ^= hash >> 29;
+  return hash;
+}
+
+static struct dedup_entry ** dedup_bucket(uint64_t hash) {
+  return & dedup.buckets[hash & (dedup.bucket_count - 1)];
+}
+
+/**
+ * Take `entry` out of the buckets, if it is in them. Called with dedup.lock
+ * held.
+ */
+static void dedup_unlink(struct dedup_entry * entry) {
+  if (!entry -> indexed) {
+    return;
+  }
+
+  struct dedup_entry ** link = dedup_bucket(entry -> hash);
+  while ( * link != entry) {
+    link = & ( * link) -> next;
+  }
+  * link = entry -> next;
+}
+
+static void dedup_grow(void) {
+  size_t count = dedup.bucket_count ? dedup.bucket_count * 2 : DEDUP_MIN_BUCKETS;
+  struct dedup_entry ** buckets = calloc(count, sizeof( * buckets));
+  if (buckets == NULL) {
+    return;
+  }
+
+  struct dedup_entry ** old_buckets = dedup.buckets;
+  size_t old_count = dedup.bucket_count;
+  dedup.buckets = buckets;
+  dedup.bucket_count = count;
+
+  for (size_t i = 0; i < old_count; i++) {
+    struct dedup_entry * entry = old_buckets[i];
+    while (entry != NULL) {
+      struct dedup_entry * next = entry -> next;
+      struct dedup_entry ** head = dedup_bucket(entry -> hash);
+      entry -> next = * head;
+      * head = entry;
+      entry = next;
+    }
+  }
+
+  free(old_buckets);
+}
+
+/**
+ * Make private page `page` the first reference to a shared copy of its
+ * memory, for pages that are about to point at it. Called with dedup.lock
+ * held.
+ *
+ * @returns    its entry, or NULL without memory
+ */
+static struct dedup_entry * dedup_publish(struct file_page * page) {
+  struct dedup_entry * entry = malloc(sizeof( * entry));
+  if (entry == NULL) {
+    return NULL;
+  }
+
+  entry -> next = NULL;
+  entry -> hash = 0;
+  entry -> indexed = false;
+  entry -> mem = page -> mem;
+  entry -> refs = 1;
+  dedup.entries++;
+  dedup.refs++;
+  page -> shared = entry;
+  page -> flags |= PAGE_SHARED;
+  return entry;
+}
+
+/**
+ * Let later pages with contents hashing to `hash` find `entry`. Called with
+ * dedup.lock held.
+ */
+static void dedup_index(struct dedup_entry * entry, uint64_t hash) {
+  if (dedup.entries >= dedup.bucket_count) {
+    dedup_grow();
+  }
+  if (dedup.buckets == NULL) {
+    return;
+  }
+
+  struct dedup_entry ** head = dedup_bucket(hash);
+  entry -> hash = hash;
+  entry -> indexed = true;
+  entry -> next = * head;
+  * head = entry;
+}
+
+/**
+ * Point private page `page` at shared copy `entry` of the same bytes,
+ * freeing its own memory. Called with dedup.lock held.
+ */
+static void dedup_attach(struct file_page * page, struct dedup_entry * entry) {
+  entry -> refs++;
+  dedup.refs++;
+  free(page -> mem);
+  __atomic_sub_fetch( & inodes.pages, 1, __ATOMIC_RELAXED);
+  page -> mem = entry -> mem;
+  page -> shared = entry;
+  page -> flags |= PAGE_SHARED;
+}
+
+/**
+ * Replace fully-written private page `index` of `data` with a shared page
+ * holding the same bytes. Without one, compare it with the last page that
+ * hashed the same, and share the two if they match; otherwise it stays
+ * private as the candidate for its hash. Called with the inode write-locked.
+ */
+static void page_share(struct file_data * data, size_t index) {
+  struct file_page * page = & data -> pages[index];
+  uint64_t hash = page_hash(page -> mem);
+  pthread_mutex_lock( & dedup.lock);
+  dedup.hashed++;
+
+  for (struct dedup_entry * entry = dedup.buckets ? * dedup_bucket(hash) : NULL;
+    entry != NULL; entry = entry -> next) {
+    if (entry -> hash != hash) {
+      continue;
+    }
+    if (memcmp(entry -> mem, page -> mem, FILE_PAGE_SIZE) != 0) {
+      dedup.collisions++;
+      continue;
+    }
+
+    dedup_attach(page, entry);
+    pthread_mutex_unlock( & dedup.lock);
+    return;
+  }
+
+  if (dedup.candidates == NULL &&
+    (dedup.candidates = calloc(DEDUP_CANDIDATES, sizeof(struct dedup_candidate))) == NULL) {
+    pthread_mutex_unlock( & dedup.lock);
+    return;
+  }
+  struct dedup_candidate * slot = & dedup.candidates[hash & (DEDUP_CANDIDATES - 1)];
+  struct dedup_candidate seen = * slot;
+  slot -> hash = hash;
+  slot -> ino = data -> ino;
+  slot -> index = index;
+  pthread_mutex_unlock( & dedup.lock);
+
+  if (seen.ino == 0 || seen.hash != hash ||
+    (seen.ino == data -> ino && seen.index == index)) {
+    return;
+  }
+
+  // Another file's lock is only tried: this one is already held
+  struct file_data * other_data = seen.ino == data -> ino ? data :
+    dedup_lock_file(seen.ino);
+  if (other_data == NULL) {
+    return;
+  }
+
+  struct file_page * other = seen.index < other_data -> page_count ?
+    & other_data -> pages[seen.index] : NULL;
+  if (other != NULL && other -> mem != NULL && other -> zmem == NULL &&
+    !(other -> flags & PAGE_SHARED)) {
+    bool equal = memcmp(other -> mem, page -> mem, FILE_PAGE_SIZE) == 0;
+    pthread_mutex_lock( & dedup.lock);
+    struct dedup_entry * entry;
+    if (!equal) {
+      dedup.collisions++;
+    } else if ((entry = dedup_publish(other)) != NULL) {
+      dedup_index(entry, hash);
+      dedup_attach(page, entry);
+    }
+    pthread_mutex_unlock( & dedup.lock);
+  }
+
+  if (other_data != data) {
+    inode_unlock(seen.ino);
+  }
+}
+
+/**
+ * Give a shared page memory of its own before it is modified (unless
+ * `discard`, when the caller is about to overwrite all of it). The last
+ * page pointing at a shared copy just takes it back.
+ *
+ * @returns    0 or ENOMEM
+ */
+static int page_unshare(struct file_page * page, bool discard) {
+  struct dedup_entry * entry = page -> shared;
+  char * copy = NULL;
+
+  // At most twice round: first to see if a copy is needed at all
+  for (;;) {
+    pthread_mutex_lock( & dedup.lock);
+
+    if (entry -> refs == 1) {
+      dedup_unlink(entry);
+      dedup.entries--;
+      dedup.refs--;
+      pthread_mutex_unlock( & dedup.lock);
+      free(entry);
+      if (copy != NULL) {
+        free(copy);
+        __atomic_sub_fetch( & inodes.pages, 1, __ATOMIC_RELAXED);
+      }
+      break;
+    }
+
+    if (copy != NULL) {
+      entry -> refs--;
+      dedup.refs--;
+      dedup.copies++;
+      pthread_mutex_unlock( & dedup.lock);
+      page -> mem = copy;
+      break;
+    }
+    pthread_mutex_unlock( & dedup.lock);
+
+    // The shared memory can't go away while this page still refers to it
+    if ((copy = malloc(FILE_PAGE_SIZE)) == NULL) {
+      return ENOMEM;
+    }
+    __atomic_add_fetch( & inodes.pages, 1, __ATOMIC_RELAXED);
+    if (!discard) {
+      memcpy(copy, page -> mem, FILE_PAGE_SIZE);
+    }
+  }
+
+  page -> shared = NULL;
+  page -> flags &= ~PAGE_SHARED;
+  return 0;
+}
+
+/**
+ * Drop a shared page's reference, freeing the memory with the last one.
+ */
+static void dedup_put(const struct file_page * page) {
+  struct dedup_entry * entry = page -> shared;
+  pthread_mutex_lock( & dedup.lock);
+
+  dedup.refs--;
+  if (--entry -> refs == 0) {
+    dedup_unlink(entry);
+    dedup.entries--;
+  } else {
+    entry = NULL;
+  }
+
+  pthread_mutex_unlock( & dedup.lock);
+
+  if (entry != NULL) {
+    free(entry -> mem);
+    free(entry);
+    __atomic_sub_fetch( & inodes.pages, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * Give `to` the contents of `from` by sharing its memory (made a shared
+ * copy first if it isn't one, without hashing it), or by copying it if
+ * that fails.
+ *
+ * @returns    0 or ENOMEM
+ */
+static int page_clone(struct file_page * from, struct file_page * to) {
+  pthread_mutex_lock( & dedup.lock);
+  struct dedup_entry * entry = from -> flags & PAGE_SHARED ?
+    from -> shared : dedup_publish(from);
+  if (entry != NULL) {
+    entry -> refs++;
+    dedup.refs++;
+  }
+  pthread_mutex_unlock( & dedup.lock);
+
+  if (entry != NULL) {
+    to -> mem = from -> mem;
+    to -> shared = entry;
+    to -> flags |= PAGE_SHARED;
+    __atomic_add_fetch( & snapshot.shared_pages, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  if ((to -> mem = malloc(FILE_PAGE_SIZE)) == NULL) {
+    return ENOMEM;
+  }
+  memcpy(to -> mem, from -> mem, FILE_PAGE_SIZE);
+  __atomic_add_fetch( & inodes.pages, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch( & snapshot.copied_pages, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static void dedup_report(FILE * out) {
+  pthread_mutex_lock( & dedup.lock);
+  uint64_t saved = dedup.refs - dedup.entries;
+  fprintf(out, "dedup: %zu shared pages for %lu file pages (ratio %.2f),"
+    " %lu KiB saved, %zu KiB of index\n", dedup.entries,
+    (unsigned long) dedup.refs,
+    dedup.entries ? (double) dedup.refs / dedup.entries : 1.0,
+    (unsigned long)(saved * FILE_PAGE_SIZE >> 10),
+    (dedup.entries * sizeof(struct dedup_entry) +
+      dedup.bucket_count * sizeof( * dedup.buckets) +
+      (dedup.candidates ? DEDUP_CANDIDATES * sizeof(struct dedup_candidate) : 0)) >> 10);
+  fprintf(out, "dedup: %lu pages hashed, %lu hash collisions, %lu copies on write\n",
+    (unsigned long) dedup.hashed, (unsigned long) dedup.collisions,
+    (unsigned long) dedup.copies);
+  pthread_mutex_unlock( & dedup.lock);
+}
+
+static uint32_t lz_load32(const uint8_t * p) {
+  uint32_t value;
+  memcpy( & value, p, sizeof(value));
+  return value;
+}
+
+/**
+ * Write an LZ length: a nibble in the token, continued in bytes of 255 and
+ * a final byte below 255.
+ */
+static uint8_t * lz_put_length(uint8_t * op, size_t length) {
+  for (length -= 15; length >= 255; length -= 255) {
+    * op++ = 255;
+  }
+  * op++ = length;
+  return op;
+}
+
+/**
+ * Compress `size` (at most 64 KiB) bytes in the style of LZ4: a sequence
+ * of tokens, each a run of literals followed by a back-reference, with
+ * the last one literals only.
+ *
+ * @returns    the compressed size, or 0 if it would exceed `capacity`
+ */
+static size_t lz_compress(const uint8_t * src, size_t size, uint8_t * dst,
+  size_t capacity) {
+  // Positions (plus one, so that zero means none) of recent 4-byte strings
+  uint16_t table[1 << LZ_HASH_BITS] = { 0 };
+  uint8_t * op = dst;
+  uint8_t * const end = dst + capacity;
+  size_t ip = 0;
+  size_t anchor = 0;
+
+  for (;;) {
+    size_t match = 0;
+    size_t length = 0;
+
+    while (ip + LZ_MIN_MATCH <= size) {
+      uint32_t seq = lz_load32(src + ip);
+      uint32_t hash = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+      size_t candidate = table[hash];
+      table[hash] = ip + 1;
+
+      if (candidate != 0 && lz_load32(src + candidate - 1) == seq) {
+        match = candidate - 1;
+        length = LZ_MIN_MATCH;
+        while (ip + length < size && src[match + length] == src[ip + length]) {
+          length++;
+        }
+        break;
+      }
+      ip++;
+    }
+
+    size_t literals = (length ? ip : size) - anchor;
+    // Token, literal length bytes, literals, offset and match length bytes
+    size_t worst = 1 + literals / 255 + 1 + literals + 2 + length / 255 + 1;
+    if ((size_t)(end - op) < worst) {
+      return 0;
+    }
+
+    uint8_t * token = op++;
+    * token = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15) {
+      op = lz_put_length(op, literals);
+    }
+    memcpy(op, src + anchor, literals);
+    op += literals;
+
+    if (length == 0) {
+      return op - dst;
+    }
+
+    size_t offset = ip - match;
+    * op++ = offset & 0xff;
+    * op++ = offset >> 8;
+    * token |= (length - LZ_MIN_MATCH < 15) ? length - LZ_MIN_MATCH : 15;
+    if (length - LZ_MIN_MATCH >= 15) {
+      op = lz_put_length(op, length - LZ_MIN_MATCH);
+    }
+
+    ip += length;
+    anchor = ip;
+  }
+}
+
+/**
+ * Read the rest of an LZ length whose token nibble was 15.
+ *
+ * @returns    false if the input ends first
+ */
+static bool lz_get_length(const uint8_t * src, size_t size, size_t * ip,
+  size_t * length) {
+  uint8_t byte;
+  do {
+    if ( * ip >= size) {
+      return false;
+    }
+    byte = src[( * ip)++];
+    * length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+/**
+ * Reverse lz_compress(), checking every length and offset against the
+ * buffers.
+ *
+ * @returns    0, or EIO if the input is corrupt or doesn't fill `size` bytes
+ */
+static int lz_decompress(const uint8_t * src, size_t src_size, uint8_t * dst,
+  size_t size) {
+  size_t ip = 0;
+  size_t op = 0;
+
+  while (ip < src_size) {
+    uint8_t token = src[ip++];
+
+    size_t literals = token >> 4;
+    if (literals == 15 && !lz_get_length(src, src_size, & ip, & literals)) {
+      return EIO;
+    }
+    if (literals > src_size - ip || literals > size - op) {
+      return EIO;
+    }
+    memcpy(dst + op, src + ip, literals);
+    ip += literals;
+    op += literals;
+
+    if (ip == src_size) {
+      break;
+    }
+
+    if (src_size - ip < 2) {
+      return EIO;
+    }
+    size_t offset = src[ip] | (size_t) src[ip + 1] << 8;
+    ip += 2;
+
+    size_t length = token & 15;
+    if (length == 15 && !lz_get_length(src, src_size, & ip, & length)) {
+      return EIO;
+    }
+    length += LZ_MIN_MATCH;
+    if (offset == 0 || offset > op || length > size - op) {
+      return EIO;
+    }
+
+    // Byte by byte: the source may overlap what is being written
+    for (size_t i = 0; i < length; i++, op++) {
+      dst[op] = dst[op - offset];
+    }
+  }
+
+  return op == size ? 0 : EIO;
+}
+
+/**
+ * Seconds on a coarse monotonic clock, for idle times.
+ */
+static uint32_t compress_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, & now);
+  return now.tv_sec;
+}
+
+/**
+ * Compress a resident page, keeping only the compressed copy if it is
+ * small enough (and marking the page so it isn't tried again otherwise).
+ * A page that already has a compressed copy just loses its plain one.
+ */
+static void page_compress(struct file_page * page) {
+  if (page -> zmem == NULL) {
+    uint8_t buffer[FILE_PAGE_SIZE];
+    size_t size = lz_compress((const uint8_t * ) page -> mem, FILE_PAGE_SIZE,
+      buffer, compress.limit);
+
+    if (size == 0) {
+      page -> flags |= PAGE_INCOMPRESSIBLE;
+      __atomic_add_fetch( & compress.rejected, 1, __ATOMIC_RELAXED);
+      return;
+    }
+
+    struct lz_page * zmem = malloc(sizeof( * zmem) + size);
+    if (zmem == NULL) {
+      return;
+    }
+
+    zmem -> size = size;
+    memcpy(zmem -> data, buffer, size);
+    page -> zmem = zmem;
+    __atomic_add_fetch( & compress.pages, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch( & compress.bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch( & compress.compressed, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_add_fetch( & compress.released, 1, __ATOMIC_RELAXED);
+  }
+
+  free(page -> mem);
+  page -> mem = NULL;
+  __atomic_sub_fetch( & inodes.pages, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drop a page's compressed copy.
+ */
+static void page_discard_compressed(struct file_page * page) {
+  __atomic_sub_fetch( & compress.pages, 1, __ATOMIC_RELAXED);
+  __atomic_sub_fetch( & compress.bytes, page -> zmem -> size, __ATOMIC_RELAXED);
+  free(page -> zmem);
+  page -> zmem = NULL;
+}
+
+/**
+ * Remember that page `index` of inode `ino` now has a decompressed copy,
+ * waking the compressor thread if there are too many.
+ */
+static void compress_cache_push(fuse_ino_t ino, size_t index) {
+  size_t capacity = 4 * COMPRESS_CACHE_PAGES;
+  pthread_mutex_lock( & compress.lock);
+
+  // If the thread is this far behind, the idle scan drops the copy later
+  if (compress.ring != NULL && compress.ring_count < capacity) {
+    struct compress_cached * slot =
+      & compress.ring[(compress.ring_head + compress.ring_count) % capacity];
+    slot -> ino = ino;
+    slot -> index = index;
+    if (++compress.ring_count > COMPRESS_CACHE_PAGES) {
+      pthread_cond_signal( & compress.wake);
+    }
+  }
+
+  pthread_mutex_unlock( & compress.lock);
+}
+
+/**
+ * Make a page safe to modify: give it private memory if it is shared, and
+ * forget any compressed copy. With `discard`, the caller is about to
+ * overwrite all of it, so a shared page's contents needn't be copied.
+ *
+ * @returns    0 or ENOMEM
+ */
+static int page_prepare_write(struct file_page * page, bool discard) {
+  if (page -> flags & PAGE_SHARED) {
+    int err = page_unshare(page, discard);
+    if (err != 0) {
+      return err;
+    }
+  }
+
+  if (page -> zmem != NULL) {
+    page_discard_compressed(page);
+  }
+  page -> flags &= ~PAGE_INCOMPRESSIBLE;
+
+  return 0;
+}
+
+/**
+ * Free the memory behind a page (not its block in the backing file).
+ */
+static void page_release(struct file_page * page) {
+  if (page -> zmem != NULL) {
+    page_discard_compressed(page);
+  }
+
+  if (page -> flags & PAGE_SHARED) {
+    dedup_put(page);
+    page -> mem = NULL;
+    page -> shared = NULL;
+    page -> flags &= ~PAGE_SHARED;
+  } else if (page -> mem != NULL) {
+    free(page -> mem);
+    page -> mem = NULL;
+    __atomic_sub_fetch( & inodes.pages, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * Find the page covering `index`, reading it from the backing file if it
+ * isn't resident and optionally allocating it if it is a hole.
+ *
+ * @param   pagep    set to the page, or NULL for a hole
+ *
+ * @returns    0 on success or an errno value
+ */
+static int data_page(struct file_data * data, size_t index, bool create,
+  char ** pagep) {
+  * pagep = NULL;
+
+  int err = data_load_map(data);
+  if (err != 0) {
+    return err;
+  }
+
+  if (index < data -> page_count && data -> pages[index].mem != NULL) {
+    * pagep = data -> pages[index].mem;
+    return 0;
+  }
+
+  if (index < data -> page_count && data -> pages[index].zmem != NULL) {
+    struct file_page * page = & data -> pages[index];
+    char * mem = malloc(FILE_PAGE_SIZE);
+    if (mem == NULL) {
+      return ENOMEM;
+    }
+
+    err = lz_decompress(page -> zmem -> data, page -> zmem -> size,
+      (uint8_t * ) mem, FILE_PAGE_SIZE);
+    if (err != 0) {
+      free(mem);
+      return err;
+    }
+
+    page -> mem = mem;
+    __atomic_add_fetch( & inodes.pages, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch( & compress.decompressed, 1, __ATOMIC_RELAXED);
+    compress_cache_push(data -> ino, index);
+
+    * pagep = mem;
+    return 0;
+  }
+
+  // A preallocated page (dirty but never loaded) reads as zeroes, whatever
+  // its block held before
+  bool on_disk = index < data -> page_count && data -> pages[index].block != 0 &&
+    !(data -> pages[index].flags & PAGE_DIRTY);
+  if (!on_disk && !create) {
+    return 0;
+  }
+
+  if ((err = data_reserve(data, index + 1)) != 0) {
+    return err;
+  }
+
+  struct file_page * page = & data -> pages[index];
+  page -> mem = malloc(FILE_PAGE_SIZE);
+  if (page -> mem == NULL) {
+    return ENOMEM;
+  }
+  __atomic_add_fetch( & inodes.pages, 1, __ATOMIC_RELAXED);
+
+  if (on_disk) {
+    // A fault right after the previous page looks like a sequential read:
+    // ask for the physically contiguous pages that follow
+    if (index > 0 && data -> pages[index - 1].mem != NULL) {
+      size_t run = 0;
+      while (run < CACHE_READAHEAD && index + run + 1 < data -> page_count &&
+        data -> pages[index + run + 1].mem == NULL &&
+        data -> pages[index + run + 1].block == page -> block + run + 1) {
+        run++;
+      }
+      if (run > 0) {
+        cache_prefetch(page -> block + 1, run);
+      }
+    }
+    err = disk_read(page -> block, page -> mem);
+  } else {
+    memset(page -> mem, 0, FILE_PAGE_SIZE);
+  }
+
+  if (err != 0) {
+    page_release(page);
+    return err;
+  }
+
+  * pagep = page -> mem;
+  return 0;
+}
+
+/**
+ * Copy `size` bytes from `buf` into the file at `off`, allocating only the
+ * pages that the write touches.
+ *
+ * @returns    0 on success or an errno value
+ */
+static int data_write(struct file_data * data, const char * buf, size_t size,
+  off_t off) {
+  size_t pos = off;
+  int err = 0;
+
+  data -> version++;
+  if (compress.idle != 0) {
+    data -> last_use = compress_clock();
+  }
+
+  while (size > 0) {
+    size_t index = pos >> FILE_PAGE_SHIFT;
+    size_t page_off = pos & (FILE_PAGE_SIZE - 1);
+    size_t len = FILE_PAGE_SIZE - page_off;
+    if (len > size) {
+      len = size;
+    }
+
+    char * page;
+    if ((err = data_page(data, index, true, & page)) != 0) {
+      break;
+    }
+
+    struct file_page * fp = & data -> pages[index];
+    if ((err = page_prepare_write(fp, len == FILE_PAGE_SIZE)) != 0) {
+      break;
+    }
+    page = fp -> mem;
+
+    memcpy(page + page_off, buf, len);
+    page_dirty(data, index);
+
+    // A page written up to its end is (for a sequential writer) complete
+    if (dedup.enabled && page_off + len == FILE_PAGE_SIZE && data != & disk.itable) {
+      page_share(data, index);
+    }
+
+    buf += len;
+    pos += len;
+    size -= len;
+  }
+
+  if (pos > data -> size) {
+    data -> size = pos;
+  }
+
+  return err;
+}
+
+// Shared source for holes: reads of unallocated pages point here
+static const char ZeroPage[FILE_PAGE_SIZE];
+
+/**
+ * Change the size of a file. Shrinking releases the pages (and blocks) past
+ * the new end and zeroes the rest of the last page, so that growing the
+ * file again exposes zeroes; growing just leaves a hole.
+ *
+ * @returns    0 on success or an errno value
+ */
+static int data_truncate(struct file_data * data, size_t size) {
+  int err = (disk.fd >= 0) ? data_load_map(data) : 0;
+  if (err != 0) {
+    return err;
+  }
+
+  size_t keep = (size + FILE_PAGE_SIZE - 1) >> FILE_PAGE_SHIFT;
+  size_t tail = size & (FILE_PAGE_SIZE - 1);
+  data -> version++;
+
+  if (tail != 0 && keep <= data -> page_count) {
+    char * page;
+    if ((err = data_page(data, keep - 1, false, & page)) != 0) {
+      return err;
+    }
+    struct file_page * fp = & data -> pages[keep - 1];
+    if (page != NULL && (err = page_prepare_write(fp, false)) != 0) {
+      return err;
+    }
+    if (page != NULL) {
+      memset(fp -> mem + tail, 0, FILE_PAGE_SIZE - tail);
+      page_dirty(data, keep - 1);
+    }
+  }
+
+  for (size_t i = keep; i < data -> page_count; i++) {
+    struct file_page * page = & data -> pages[i];
+    page_release(page);
+    if (page -> block != 0) {
+      block_free(page -> block);
+      page -> block = 0;
+      data -> map_dirty = true;
+    }
+    page -> flags = 0;
+  }
+
+  if (data -> dirty_last > keep) {
+    data -> dirty_last = keep;
+  }
+
+  // Give back most of an oversized page table too
+  if (keep < data -> page_count / 4) {
+    size_t capacity = keep ? keep : 1;
+    struct file_page * pages = realloc(data -> pages, capacity * sizeof( * pages));
+    if (pages != NULL) {
+      data -> pages = pages;
+      data -> page_count = capacity;
+    }
+  }
+
+  data -> size = size;
+  return 0;
+}
+
+/**
+ * Preallocate the pages covering `len` bytes at `off`. With a backing file
+ * they get physically contiguous blocks where possible (and read as zeroes
+ * until written); without one they are allocated in memory.
+ *
+ * @returns    0 on success or an errno value
+ */
+static int data_allocate(struct file_data * data, off_t off, off_t len) {
+  size_t first = off >> FILE_PAGE_SHIFT;
+  size_t last = (off + len + FILE_PAGE_SIZE - 1) >> FILE_PAGE_SHIFT;
+  data -> version++;
+
+  int err = (disk.fd >= 0) ? data_load_map(data) : 0;
+  if (err == 0) {
+    err = data_reserve(data, last);
+  }
+
+  if (disk.fd < 0) {
+    for (size_t i = first; err == 0 && i < last; i++) {
+      char * page;
+      err = data_page(data, i, true, & page);
+    }
+    return err;
+  }
+
+  size_t i = first;
+  while (err == 0 && i < last) {
+    if (data -> pages[i].block != 0) {
+      i++;
+      continue;
+    }
+
+    size_t want = 1;
+    while (i + want < last && data -> pages[i + want].block == 0) {
+      want++;
+    }
+
+    size_t got;
+    uint32_t start = block_alloc_run(want, & got);
+    if (start == 0) {
+      err = ENOSPC;
+      break;
+    }
+
+    for (size_t k = 0; k < got; k++, i++) {
+      data -> pages[i].block = start + k;
+      page_dirty(data, i);
+    }
+    data -> map_dirty = true;
+  }
+
+  return err;
+}
+
+/**
+ * How many iovecs does data_map() need for a read of `size` bytes at `off`?
+ */
+static size_t data_map_count(off_t off, size_t size) {
+  size_t first = off >> FILE_PAGE_SHIFT;
+  size_t last = (off + size + FILE_PAGE_SIZE - 1) >> FILE_PAGE_SHIFT;
+  return last - first;
+}
+
+/**
+ * Describe up to `size` bytes at `off` as a list of page-backed iovecs,
+ * without copying anything. Holes map to a shared zero page.
+ *
+ * Without `load`, nothing is read in or decompressed (nor is the block map
+ * loaded), so the file need only be read-locked.
+ *
+ * @returns    the number of iovecs filled in (0 at or beyond end of file),
+ *             or a negative errno value: -EAGAIN without `load` if a page
+ *             isn't resident, or the error loading it
+ */
+static int data_map(struct file_data * data, off_t off, size_t size,
+  struct iovec * iov, bool load) {
+  if (off < 0 || (size_t) off >= data -> size) {
+    return 0;
+  }
+
+  if (size > data -> size - off) {
+    size = data -> size - off;
+  }
+
+  if (!data -> map_loaded) {
+    int err = load ? data_load_map(data) : EAGAIN;
+    if (err != 0) {
+      return -err;
+    }
+  }
+
+  if (compress.idle != 0) {
+    // Concurrent readers may all store this
+    __atomic_store_n( & data -> last_use, compress_clock(), __ATOMIC_RELAXED);
+  }
+
+  size_t pos = off;
+  int count = 0;
+
+  while (size > 0) {
+    size_t page_off = pos & (FILE_PAGE_SIZE - 1);
+    size_t len = FILE_PAGE_SIZE - page_off;
+    if (len > size) {
+      len = size;
+    }
+
+    size_t index = pos >> FILE_PAGE_SHIFT;
+    struct file_page * slot = index < data -> page_count ?
+      & data -> pages[index] : NULL;
+    char * page = slot ? slot -> mem : NULL;
+
+    // Anything but a resident page or a hole has to be loaded
+    if (page == NULL && slot != NULL && (slot -> zmem != NULL ||
+        (slot -> block != 0 && !(slot -> flags & PAGE_DIRTY)))) {
+      int err = load ? data_page(data, index, false, & page) : EAGAIN;
+      if (err != 0) {
+        return -err;
+      }
+    }
+
+    iov[count].iov_base = (void * )((page ? page : ZeroPage) + page_off);
+    iov[count].iov_len = len;
+    count++;
+
+    pos += len;
+    size -= len;
+  }
+
+  return count;
+}
+
+/**
+ * Write one level of block pointers, allocating the pointer block if needed
+ * and releasing it once nothing points through it any more.
+ */
+static int data_store_ptrs(uint32_t * blockp, const uint32_t * ptrs, bool used) {
+  if (!used) {
+    block_free( * blockp);
+    * blockp = 0;
+    return 0;
+  }
+
+  if ( * blockp == 0 && ( * blockp = block_alloc()) == 0) {
+    return ENOSPC;
+  }
+
+  return disk_write_meta( * blockp, ptrs);
+}
+
+/**
+ * Rewrite the on-disk block map of a file from pages[].block.
+ */
+static int data_store_map(struct file_data * data) {
+  size_t npages = data -> page_count;
+  while (npages > 0 && data -> pages[npages - 1].block == 0) {
+    npages--;
+  }
+
+  for (size_t i = 0; i < DISK_DIRECT; i++) {
+    data -> map.direct[i] = i < npages ? data -> pages[i].block : 0;
+  }
+
+  uint32_t * ptrs = calloc(1, DISK_BLOCK_SIZE);
+  if (ptrs == NULL) {
+    return ENOMEM;
+  }
+
+  size_t base = DISK_DIRECT;
+  for (size_t i = 0; i < DISK_PTRS_PER_BLOCK && base + i < npages; i++) {
+    ptrs[i] = data -> pages[base + i].block;
+  }
+
+  int err = data_store_ptrs( & data -> map.indirect, ptrs, npages > base);
+  base += DISK_PTRS_PER_BLOCK;
+
+  size_t dind_needed = npages > base ?
+    (npages - base + DISK_PTRS_PER_BLOCK - 1) / DISK_PTRS_PER_BLOCK : 0;
+  if (err == 0 && dind_needed > DISK_PTRS_PER_BLOCK) {
+    err = EFBIG;
+  }
+
+  if (err == 0 && dind_needed > 0 && data -> dind_blocks == NULL) {
+    data -> dind_blocks = calloc(1, DISK_BLOCK_SIZE);
+    if (data -> dind_blocks == NULL) {
+      err = ENOMEM;
+    }
+  }
+
+  size_t dind_old = data -> dind_count;
+  for (size_t j = 0; err == 0 && (j < dind_old || j < dind_needed); j++) {
+    memset(ptrs, 0, DISK_BLOCK_SIZE);
+    for (size_t i = 0; i < DISK_PTRS_PER_BLOCK; i++) {
+      size_t index = base + j * DISK_PTRS_PER_BLOCK + i;
+      if (index < npages) {
+        ptrs[i] = data -> pages[index].block;
+      }
+    }
+
+    err = data_store_ptrs( & data -> dind_blocks[j], ptrs, j < dind_needed);
+  }
+
+  if (err == 0) {
+    data -> dind_count = dind_needed;
+    err = data_store_ptrs( & data -> map.dindirect, data -> dind_blocks,
+      dind_needed > 0);
+  }
+
+  free(ptrs);
+  if (err == 0) {
+    data -> map_dirty = false;
+  }
+
+  return err;
+}
+
+/**
+ * Give the run of dirty, blockless pages starting at `index` physically
+ * contiguous blocks, so that sequentially written data is stored (and later
+ * read back) in large runs rather than wherever single blocks were free.
+ *
+ * @returns    0 or ENOSPC
+ */
+static int data_place_run(struct file_data * data, size_t index, size_t end) {
+  size_t want = 1;
+  while (index + want < end && data -> pages[index + want].block == 0 &&
+    (data -> pages[index + want].flags & PAGE_DIRTY)) {
+    want++;
+  }
+
+  size_t got;
+  uint32_t start = block_alloc_run(want, & got);
+  if (start == 0) {
+    return ENOSPC;
+  }
+
+  for (size_t k = 0; k < got; k++) {
+    data -> pages[index + k].block = start + k;
+  }
+  data -> map_dirty = true;
+
+  return 0;
+}
+
+/**
+ * Write a file's dirty pages to the backing file, giving blocks to pages
+ * that don't have one yet, then store its block map if that changed.
+ */
+static int data_flush(struct file_data * data) {
+  if (!data -> map_loaded) {
+    // Nothing can be dirty in a file whose data was never touched
+    return 0;
+  }
+
+  size_t end = data -> dirty_last < data -> page_count ?
+    data -> dirty_last : data -> page_count;
+
+  for (size_t i = data -> dirty_first; i < end; i++) {
+    struct file_page * page = & data -> pages[i];
+    if (!(page -> flags & PAGE_DIRTY)) {
+      continue;
+    }
+
+    if (page -> block == 0 && data_place_run(data, i, end) != 0) {
+      data -> dirty_first = i;
+      return ENOSPC;
+    }
+
+    // The inode, share and name tables are metadata; file contents are not
+    // journaled. Preallocated pages that were never written are zero-filled.
+    int err = (data == & disk.itable || data == & disk.refs_file ||
+        data == & disk.names_file) ?
+      disk_write_meta(page -> block, page -> mem) :
+      disk_write(page -> block, page -> mem ? page -> mem : ZeroPage);
+    if (err != 0) {
+      data -> dirty_first = i;
+      return err;
+    }
+
+    page -> flags &= ~PAGE_DIRTY;
+  }
+
+  data -> dirty_first = data -> dirty_last = 0;
+  return data -> map_dirty ? data_store_map(data) : 0;
+}
+
+/**
+ * Free the memory behind clean pages that can be read back from the
+ * backing file.
+ */
+static void data_drop_clean(struct file_data * data) {
+  for (size_t i = 0; i < data -> page_count; i++) {
+    struct file_page * page = & data -> pages[i];
+    if (page -> block != 0 && !(page -> flags & PAGE_DIRTY)) {
+      page_release(page);
+    }
+  }
+}
+
+/**
+ * Release a file's in-memory pages (its blocks stay allocated on disk).
+ */
+static void data_release(struct file_data * data) {
+  for (size_t i = 0; i < data -> page_count; i++) {
+    page_release( & data -> pages[i]);
+  }
+
+  free(data -> pages);
+  free(data -> dind_blocks);
+  data -> pages = NULL;
+  data -> page_count = 0;
+  data -> dind_blocks = NULL;
+  data -> dind_count = 0;
+  data -> size = 0;
+}
+
+/**
+ * Delete a file's contents: release its memory and return its data and map
+ * blocks to the free-block bitmap.
+ */
+static void data_discard(struct file_data * data) {
+  if (disk.fd >= 0 && data_load_map(data) == 0) {
+    for (size_t i = 0; i < data -> page_count; i++) {
+      block_free(data -> pages[i].block);
+    }
+
+    for (size_t j = 0; j < data -> dind_count; j++) {
+      block_free(data -> dind_blocks[j]);
+    }
+
+    block_free(data -> map.indirect);
+    block_free(data -> map.dindirect);
+    memset( & data -> map, 0, sizeof(data -> map));
+  }
+
+  data_release(data);
+}
+
+/**
+ * Make `to` (zeroed) a copy of `from` that shares its clean blocks and its
+ * in-memory pages, so that only later writes to either file copy anything.
+ * Holes and unwritten preallocated pages become holes.
+ *
+ * @returns    0 on success or an errno value (with `to` discarded)
+ */
+static int data_clone(struct file_data * from, struct file_data * to) {
+  int err = data_load_map(from);
+  size_t npages = (from -> size + FILE_PAGE_SIZE - 1) >> FILE_PAGE_SHIFT;
+  if (npages > from -> page_count) {
+    npages = from -> page_count;
+  }
+
+  if (err == 0) {
+    err = data_reserve(to, npages);
+  }
+  to -> size = from -> size;
+  to -> map_loaded = true;
+  to -> map_dirty = true;
+
+  for (size_t i = 0; err == 0 && i < npages; i++) {
+    struct file_page * page = & from -> pages[i];
+    bool on_disk = page -> block != 0 && !(page -> flags & PAGE_DIRTY);
+
+    if (on_disk && block_share(page -> block)) {
+      to -> pages[i].block = page -> block;
+      __atomic_add_fetch( & snapshot.shared_blocks, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    char * mem = NULL;
+    if (on_disk || page -> mem != NULL || page -> zmem != NULL) {
+      err = data_page(from, i, false, & mem);
+    }
+    if (mem != NULL && (err = page_clone(page, & to -> pages[i])) == 0) {
+      page_dirty(to, i);
+    }
+  }
+
+  if (err != 0) {
+    data_discard(to);
+  }
+
+  return err;
+}
+
+static struct inode_chunk * inode_chunk(fuse_ino_t ino) {
+  size_t index = ino >> INODE_CHUNK_SHIFT;
+  return index < __atomic_load_n( & inodes.chunk_count, __ATOMIC_ACQUIRE) ?
+    __atomic_load_n( & inodes.chunks[index], __ATOMIC_ACQUIRE) : NULL;
+}
+
+static struct stat * inode_stat(fuse_ino_t ino) {
+  return & inodes.chunks[ino >> INODE_CHUNK_SHIFT] -> stats[ino & (INODE_CHUNK_SIZE - 1)];
+}
+
+static struct file_node * inode_node(fuse_ino_t ino) {
+  return & inodes.chunks[ino >> INODE_CHUNK_SHIFT] -> nodes[ino & (INODE_CHUNK_SIZE - 1)];
+}
+
+static struct file_meta * inode_meta(fuse_ino_t ino) {
+  return & inodes.chunks[ino >> INODE_CHUNK_SHIFT] -> meta[ino & (INODE_CHUNK_SIZE - 1)];
+}
+
+static struct file_data * inode_data(fuse_ino_t ino) {
+  return & inodes.chunks[ino >> INODE_CHUNK_SHIFT] -> data[ino & (INODE_CHUNK_SIZE - 1)];
+}
+
+/**
+ * The inode that directory entry `entry` names.
+ */
+static fuse_ino_t entry_inode(fuse_ino_t entry) {
+  fuse_ino_t target = inode_node(entry) -> link_target;
+  return target ? target : entry;
+}
+
+/**
+ * Is `ino` a currently-allocated inode?
+ */
+static bool inode_exists(fuse_ino_t ino) {
+  return ino != 0 && inode_chunk(ino) != NULL &&
+    __atomic_load_n( & inode_stat(ino) -> st_ino, __ATOMIC_ACQUIRE) == ino;
+}
+
+static pthread_rwlock_t * inode_lock(fuse_ino_t ino) {
+  return & inodes.chunks[ino >> INODE_CHUNK_SHIFT] -> locks[ino & (INODE_CHUNK_SIZE - 1)];
+}
+
+/**
+ * Lock an inode that is expected to exist.
+ *
+ * @returns    true with the lock held, or false (and no lock) if `ino` is
+ *             not allocated
+ */
+static bool inode_lock_live(fuse_ino_t ino, bool write) {
+  if (ino == 0 || inode_chunk(ino) == NULL) {
+    return false;
+  }
+
+  if (write) {
+    pthread_rwlock_wrlock(inode_lock(ino));
+  } else {
+    pthread_rwlock_rdlock(inode_lock(ino));
+  }
+
+  if (!inode_exists(ino)) {
+    pthread_rwlock_unlock(inode_lock(ino));
+    return false;
+  }
+
+  return true;
+}
+
+static void inode_unlock(fuse_ino_t ino) {
+  pthread_rwlock_unlock(inode_lock(ino));
+}
+
+/**
+ * Write-lock regular file `ino` to check a dedup candidate in it, without
+ * waiting: the caller holds another inode's lock.
+ *
+ * @returns    its data with the lock held, or NULL if it is gone or busy
+ */
+static struct file_data * dedup_lock_file(fuse_ino_t ino) {
+  if (!inode_exists(ino) || pthread_rwlock_trywrlock(inode_lock(ino)) != 0) {
+    return NULL;
+  }
+  if (!inode_exists(ino) || !S_ISREG(inode_stat(ino) -> st_mode)) {
+    inode_unlock(ino);
+    return NULL;
+  }
+  return inode_data(ino);
+}
+
+static unsigned * inode_seq(fuse_ino_t ino) {
+  return & inodes.chunks[ino >> INODE_CHUNK_SHIFT] -> seqs[ino & (INODE_CHUNK_SIZE - 1)];
+}
+
+/*
+ * Changes to a struct stat are bracketed by stat_write_begin() and
+ * stat_write_end() (with the inode's write lock held), so that getattr and
+ * lookup can take consistent copies without any lock: see inode_stat_copy().
+ */
+static void stat_write_begin(fuse_ino_t ino) {
+  __atomic_add_fetch(inode_seq(ino), 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void stat_write_end(fuse_ino_t ino) {
+  __atomic_add_fetch(inode_seq(ino), 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copy the stat of `ino` without locking, retrying if a writer was active.
+ *
+ * @returns    true if `ino` was allocated when the copy was taken
+ */
+static bool inode_stat_copy(fuse_ino_t ino, struct stat * out) {
+  if (ino == 0 || inode_chunk(ino) == NULL) {
+    return false;
+  }
+
+  unsigned * seq = inode_seq(ino);
+  unsigned before;
+
+  do {
+    while ((before = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1) {}
+    memcpy(out, inode_stat(ino), sizeof( * out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(seq, __ATOMIC_RELAXED) != before);
+
+  return out -> st_ino == ino;
+}
+
+/**
+ * Count a reference the kernel is about to take by receiving an entry for
+ * `ino` (from lookup, an entry-creating operation or readdirplus).
+ */
+static void lookup_get(fuse_ino_t ino) {
+  __atomic_add_fetch( & inode_meta(ino) -> nlookup, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drop `count` kernel references to `ino`. A forget that doesn't match the
+ * references counted can't take the count below zero.
+ *
+ * @returns    true if this dropped the last reference
+ */
+static bool lookup_put(fuse_ino_t ino, uint64_t count) {
+  uint64_t * nlookup = & inode_meta(ino) -> nlookup;
+  uint64_t old = __atomic_load_n(nlookup, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(nlookup, & old,
+      old > count ? old - count : 0, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+
+  return old != 0 && old <= count;
+}
+
+/**
+ * The assignment directory and its files can never be changed, so the
+ * kernel may cache them indefinitely.
+ */
+static bool inode_immutable(fuse_ino_t ino) {
+  return ino >= ASSIGN_DIR && ino <= FEATURE_FILE;
+}
+
+/**
+ * How long the kernel may cache the attributes of `ino` and its name.
+ */
+static double inode_timeout(fuse_ino_t ino) {
+  return inode_immutable(ino) ? TIMEOUT_IMMUTABLE : notify.timeout;
+}
+
+/**
+ * Record a change to the attributes of `ino` that the kernel did not ask
+ * for, so that its cached copy gets invalidated.
+ *
+ * The kernel updates its caches for the inode a request names by itself;
+ * this covers the side effects, such as a directory gaining or losing an
+ * entry. Repeated changes to one inode are sent as one notification.
+ */
+static void inode_changed(fuse_ino_t ino) {
+  if (notify.session == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock( & notify.lock);
+
+  if (notify.count > 0 && notify.queue[notify.count - 1] == ino) {
+    pthread_mutex_unlock( & notify.lock);
+    return;
+  }
+
+  if (notify.count == notify.capacity) {
+    size_t capacity = notify.capacity ? notify.capacity * 2 : 64;
+    fuse_ino_t * queue = realloc(notify.queue, capacity * sizeof( * queue));
+    if (queue != NULL) {
+      notify.queue = queue;
+      notify.capacity = capacity;
+    }
+  }
+
+  // Without memory for the queue the change shows up at the next timeout
+  if (notify.count < notify.capacity) {
+    notify.queue[notify.count++] = ino;
+    pthread_cond_signal( & notify.wake);
+  }
+
+  pthread_mutex_unlock( & notify.lock);
+}
+
+static int ino_compare(const void * a, const void * b) {
+  fuse_ino_t x = * (const fuse_ino_t * ) a;
+  fuse_ino_t y = * (const fuse_ino_t * ) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Notifier loop: send everything queued by inode_changed(), once per inode.
+ */
+static void * notify_sender(void * arg) {
+  // The queue being sent; handlers fill the other one meanwhile
+  fuse_ino_t * batch = NULL;
+  size_t batch_capacity = 0;
+
+  pthread_mutex_lock( & notify.lock);
+
+  for (;;) {
+    while (notify.running && notify.count == 0) {
+      pthread_cond_wait( & notify.wake, & notify.lock);
+    }
+    if (!notify.running) {
+      break;
+    }
+
+    fuse_ino_t * queue = notify.queue;
+    size_t count = notify.count;
+    size_t capacity = notify.capacity;
+    notify.queue = batch;
+    notify.capacity = batch_capacity;
+    notify.count = 0;
+    batch = queue;
+    batch_capacity = capacity;
+    pthread_mutex_unlock( & notify.lock);
+
+    qsort(batch, count, sizeof( * batch), ino_compare);
+    for (size_t i = 0; i < count; i++) {
+      if (i > 0 && batch[i] == batch[i - 1]) {
+        continue;
+      }
+
+      // A negative offset invalidates the attributes but not the pages;
+      // -ENOENT just means that the kernel has nothing cached
+      int err = fuse_lowlevel_notify_inval_inode(notify.session, batch[i], -1, 0);
+      if (err == 0) {
+        notify.sent++;
+      } else if (err != -ENOENT) {
+        fprintf(stderr, "%s: inode %zu: %s\n", __func__, (size_t) batch[i],
+          strerror(-err));
+      }
+    }
+
+    pthread_mutex_lock( & notify.lock);
+  }
+
+  pthread_mutex_unlock( & notify.lock);
+  free(batch);
+  return NULL;
+}
+
+/**
+ * Start sending invalidations on `session`, which lets mutable inodes be
+ * cached for longer. Without a session they keep the short default timeout.
+ */
+static void notify_start(struct fuse_session * session) {
+  if (session == NULL) {
+    return;
+  }
+
+  notify.session = session;
+  notify.running = true;
+  if (pthread_create( & notify.thread, NULL, notify_sender, NULL) != 0) {
+    fprintf(stderr, "%s: no notifier thread, using short cache timeouts\n",
+      __func__);
+    notify.session = NULL;
+    notify.running = false;
+    return;
+  }
+
+  notify.timeout = TIMEOUT_NOTIFIED;
+}
+
+/**
+ * Stop the notifier, dropping anything still queued: the kernel forgets
+ * its caches at unmount anyway.
+ */
+static void notify_stop(void) {
+  pthread_mutex_lock( & notify.lock);
+  bool running = notify.running;
+  notify.running = false;
+  pthread_cond_broadcast( & notify.wake);
+  pthread_mutex_unlock( & notify.lock);
+
+  if (running) {
+    pthread_join(notify.thread, NULL);
+    fprintf(stderr, "notify: %lu attribute invalidations\n",
+      (unsigned long) notify.sent);
+  }
+
+  free(notify.queue);
+  notify.session = NULL;
+  notify.timeout = TIMEOUT_DEFAULT;
+  notify.queue = NULL;
+  notify.count = 0;
+  notify.capacity = 0;
+  notify.sent = 0;
+}
+
+/**
+ * Release the plain copy of page `index` of `ino` if it also has a
+ * compressed one, i.e. it was only decompressed for reading.
+ */
+static void compress_evict(fuse_ino_t ino, size_t index) {
+  pthread_rwlock_rdlock( & fs_lock);
+
+  if (inode_lock_live(ino, true)) {
+    struct file_data * data = inode_data(ino);
+    if (index < data -> page_count && data -> pages[index].mem != NULL &&
+      data -> pages[index].zmem != NULL) {
+      page_compress( & data -> pages[index]);
+    }
+    inode_unlock(ino);
+  }
+
+  pthread_rwlock_unlock( & fs_lock);
+}
+
+/**
+ * Compress (or, with a backing file, release) the resident pages of a
+ * regular file that hasn't been used for compress.idle seconds. Called
+ * with the inode write-locked.
+ */
+static void compress_file(struct file_data * data, uint32_t now) {
+  if (now - data -> last_use < compress.idle) {
+    return;
+  }
+
+  for (size_t i = 0; i < data -> page_count; i++) {
+    struct file_page * page = & data -> pages[i];
+    if (page -> mem == NULL) {
+      continue;
+    }
+
+    if (page -> zmem != NULL) {
+      page_compress(page);
+    } else if (disk.fd >= 0) {
+      if (page -> block != 0 && !(page -> flags & PAGE_DIRTY)) {
+        page_release(page);
+        __atomic_add_fetch( & compress.released, 1, __ATOMIC_RELAXED);
+      }
+    } else if (!(page -> flags & (PAGE_SHARED | PAGE_INCOMPRESSIBLE))) {
+      page_compress(page);
+    }
+  }
+}
+
+/**
+ * Look for idle files, one inode chunk at a time so that the committer is
+ * never kept out for long. Busy inodes are skipped: they aren't idle.
+ */
+static void compress_scan(void) {
+  uint32_t now = compress_clock();
+  size_t chunks = __atomic_load_n( & inodes.chunk_count, __ATOMIC_ACQUIRE);
+
+  for (size_t i = 0; i < chunks; i++) {
+    pthread_rwlock_rdlock( & fs_lock);
+
+    struct inode_chunk * chunk = inode_chunk(i << INODE_CHUNK_SHIFT);
+    unsigned bump = chunk ? __atomic_load_n( & chunk -> bump, __ATOMIC_ACQUIRE) : 0;
+    for (unsigned j = 0; j < bump; j++) {
+      fuse_ino_t ino = (i << INODE_CHUNK_SHIFT) | j;
+      if (!inode_exists(ino) ||
+        pthread_rwlock_trywrlock(inode_lock(ino)) != 0) {
+        continue;
+      }
+
+      if (inode_exists(ino) && S_ISREG(inode_stat(ino) -> st_mode)) {
+        compress_file(inode_data(ino), now);
+      }
+      inode_unlock(ino);
+    }
+
+    pthread_rwlock_unlock( & fs_lock);
+  }
+}
+
+/**
+ * Compressor loop: trim the decompressed pages whenever there are too many
+ * of them, and look for idle files every half idle period.
+ */
+static void * compress_worker(void * arg) {
+  unsigned interval = compress.idle > 1 ? compress.idle / 2 : 1;
+  size_t capacity = 4 * COMPRESS_CACHE_PAGES;
+  uint32_t last_scan = compress_clock();
+
+  pthread_mutex_lock( & compress.lock);
+
+  for (;;) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, & deadline);
+    deadline.tv_sec += interval;
+
+    while (compress.running && compress.ring_count <= COMPRESS_CACHE_PAGES &&
+      pthread_cond_timedwait( & compress.wake, & compress.lock, & deadline) != ETIMEDOUT) {}
+    if (!compress.running) {
+      break;
+    }
+
+    // Inode locks come before compress.lock, so never hold both
+    while (compress.ring_count > COMPRESS_CACHE_PAGES) {
+      struct compress_cached oldest = compress.ring[compress.ring_head];
+      compress.ring_head = (compress.ring_head + 1) % capacity;
+      compress.ring_count--;
+
+      pthread_mutex_unlock( & compress.lock);
+      compress_evict(oldest.ino, oldest.index);
+      pthread_mutex_lock( & compress.lock);
+    }
+
+    if (compress_clock() - last_scan >= interval) {
+      pthread_mutex_unlock( & compress.lock);
+      compress_scan();
+      last_scan = compress_clock();
+      pthread_mutex_lock( & compress.lock);
+    }
+  }
+
+  pthread_mutex_unlock( & compress.lock);
+  return NULL;
+}
+
+/**
+ * Start compressing cold file data if the mount options ask for it.
+ */
+static void compress_start(const struct assign5_options * options) {
+  if (options -> ao_compress_idle == 0) {
+    return;
+  }
+
+  unsigned ratio = options -> ao_compress_ratio ?
+    options -> ao_compress_ratio : COMPRESS_DEFAULT_RATIO;
+  if (ratio > 100) {
+    ratio = 100;
+  }
+
+  compress.idle = options -> ao_compress_idle;
+  compress.limit = (size_t) FILE_PAGE_SIZE * ratio / 100;
+  compress.ring = calloc(4 * COMPRESS_CACHE_PAGES, sizeof( * compress.ring));
+  compress.running = true;
+
+  if (compress.ring == NULL ||
+    pthread_create( & compress.thread, NULL, compress_worker, NULL) != 0) {
+    fprintf(stderr, "%s: no compressor thread, keeping file data as is\n",
+      __func__);
+    free(compress.ring);
+    compress.ring = NULL;
+    compress.idle = 0;
+    compress.running = false;
+  }
+}
+
+static void compress_report(FILE * out) {
+  uint64_t pages = __atomic_load_n( & compress.pages, __ATOMIC_RELAXED);
+  uint64_t bytes = __atomic_load_n( & compress.bytes, __ATOMIC_RELAXED);
+  fprintf(out, "compress: %lu compressed pages in %lu KiB (%.0f%%)\n",
+    (unsigned long) pages, (unsigned long)(bytes >> 10),
+    pages ? 100.0 * bytes / (pages * FILE_PAGE_SIZE) : 0.0);
+  fprintf(out, "compress: %lu pages compressed, %lu incompressible,"
+    " %lu decompressed, %lu released\n",
+    (unsigned long) __atomic_load_n( & compress.compressed, __ATOMIC_RELAXED),
+    (unsigned long) __atomic_load_n( & compress.rejected, __ATOMIC_RELAXED),
+    (unsigned long) __atomic_load_n( & compress.decompressed, __ATOMIC_RELAXED),
+    (unsigned long) __atomic_load_n( & compress.released, __ATOMIC_RELAXED));
+}
+
+/**
+ * Stop the compressor. Compressed pages stay as they are until the tables
+ * are released.
+ */
+static void compress_stop(void) {
+  pthread_mutex_lock( & compress.lock);
+  bool running = compress.running;
+  compress.running = false;
+  pthread_cond_broadcast( & compress.wake);
+  pthread_mutex_unlock( & compress.lock);
+
+  if (running) {
+    pthread_join(compress.thread, NULL);
+    compress_report(stderr);
+  }
+
+  free(compress.ring);
+  compress.ring = NULL;
+  compress.ring_head = 0;
+  compress.ring_count = 0;
+  compress.idle = 0;
+  compress.compressed = compress.rejected = 0;
+  compress.decompressed = compress.released = 0;
+}
+
+/**
+ * Note that the on-disk record of `ino` needs rewriting at the next sync.
+ */
+static void inode_dirty(fuse_ino_t ino) {
+  if (disk.fd < 0) {
+    return;
+  }
+
+  size_t block = ino / DISK_INODES_PER_BLOCK;
+  pthread_mutex_lock( & dirty_lock);
+
+  if (block >= disk.itable_dirty_size) {
+    size_t size = disk.itable_dirty_size ? disk.itable_dirty_size : 64;
+    while (size <= block) {
+      size *= 2;
+    }
+
+    bool * dirty = realloc(disk.itable_dirty, size * sizeof( * dirty));
+    if (dirty == NULL) {
+      pthread_mutex_unlock( & dirty_lock);
+      return;
+    }
+
+    memset(dirty + disk.itable_dirty_size, 0,
+      (size - disk.itable_dirty_size) * sizeof( * dirty));
+    disk.itable_dirty = dirty;
+    disk.itable_dirty_size = size;
+  }
+
+  disk.itable_dirty[block] = true;
+  pthread_mutex_unlock( & dirty_lock);
+}
+
+/**
+ * Note that `ino` has dirty pages (or a dirty xattr spill block) that must
+ * be written at the next sync.
+ */
+static void file_dirty(fuse_ino_t ino) {
+  struct file_data * data = inode_data(ino);
+  if (disk.fd < 0 || data -> on_dirty_list) {
+    return;
+  }
+
+  pthread_mutex_lock( & dirty_lock);
+
+  if (disk.dirty_count == disk.dirty_capacity) {
+    size_t capacity = disk.dirty_capacity ? disk.dirty_capacity * 2 : 64;
+    fuse_ino_t * files = realloc(disk.dirty_files, capacity * sizeof( * files));
+    if (files == NULL) {
+      pthread_mutex_unlock( & dirty_lock);
+      return;
+    }
+
+    disk.dirty_files = files;
+    disk.dirty_capacity = capacity;
+  }
+
+  disk.dirty_files[disk.dirty_count++] = ino;
+  data -> on_dirty_list = true;
+  pthread_mutex_unlock( & dirty_lock);
+}
+
+/**
+ * Read the spill block of `ino` (write-locked) if it hasn't been yet.
+ *
+ * @returns    0 or an errno value
+ */
+static int xattr_load(fuse_ino_t ino) {
+  struct file_meta * meta = inode_meta(ino);
+  if (meta -> xattr_spill_len == 0 || meta -> xattr_spill != NULL) {
+    return 0;
+  }
+
+  uint8_t * block = malloc(DISK_BLOCK_SIZE);
+  if (block == NULL) {
+    return ENOMEM;
+  }
+
+  int err = disk_read(meta -> xattr_block, block);
+  if (err == 0) {
+    // Trimmed to size, or kept whole if that fails
+    uint8_t * spill = realloc(block, meta -> xattr_spill_len);
+    meta -> xattr_spill = spill ? spill : block;
+  } else {
+    free(block);
+  }
+
+  return err;
+}
+
+/**
+ * Write the spill block of `ino`, allocating it on first use and freeing it
+ * once nothing has spilled. Called while capturing a transaction.
+ *
+ * @returns    0 or an errno value
+ */
+static int xattr_store(fuse_ino_t ino) {
+  struct file_meta * meta = inode_meta(ino);
+  meta -> xattr_dirty = false;
+
+  if (meta -> xattr_spill_len == 0) {
+    block_free(meta -> xattr_block);
+    meta -> xattr_block = 0;
+    return 0;
+  }
+
+  if (meta -> xattr_block == 0 && (meta -> xattr_block = block_alloc()) == 0) {
+    return ENOSPC;
+  }
+
+  uint8_t * block = calloc(1, DISK_BLOCK_SIZE);
+  if (block == NULL) {
+    return ENOMEM;
+  }
+
+  memcpy(block, meta -> xattr_spill, meta -> xattr_spill_len);
+  int err = disk_write_meta(meta -> xattr_block, block);
+  free(block);
+  return err;
+}
+
+/**
+ * Drop every extended attribute of `ino`, including its spill block.
+ */
+static void xattr_release(fuse_ino_t ino) {
+  struct file_meta * meta = inode_meta(ino);
+
+  if (disk.fd >= 0) {
+    block_free(meta -> xattr_block);
+  }
+  free(meta -> xattr_spill);
+  meta -> xattr_spill = NULL;
+  meta -> xattr_spill_len = 0;
+  meta -> xattr_inline_len = 0;
+  meta -> xattr_block = 0;
+  meta -> xattr_dirty = false;
+}
+
+// Slot sizes of the name arena's classes; the last fits FILE_NAME_MAX
+static
+const size_t NameClassSize[NAME_CLASSES] = { 16, 32, 64, 128, 264 };
+
+// The name of an inode that has none, interned statically
+static
+const char NameNone[2];
+#define NAME_NONE (NameNone + 1)
+
+/**
+ * Length of an interned name, from the byte in front of it.
+ */
+static size_t name_length(const char * name) {
+  return (unsigned char) name[-1];
+}
+
+static int name_class(size_t len) {
+  int class = 0;
+  while (NameClassSize[class] < len + 2) {
+    class++;
+  }
+
+  return class;
+}
+
+/**
+ * Copy the `len` bytes of `name` into the name arena.
+ *
+ * @returns    the interned, NUL-terminated copy, or NULL if out of memory
+ */
+static const char * name_intern(const char * name, size_t len) {
+  if (len == 0) {
+    return NAME_NONE;
+  }
+
+  int class = name_class(len);
+  size_t size = NameClassSize[class];
+
+  pthread_mutex_lock( & names.lock);
+  char * slot = names.free[class];
+  if (slot != NULL) {
+    names.free[class] = * (char ** ) slot;
+  } else {
+    if ((size_t)(names.fresh_end[class] - names.fresh[class]) < size) {
+      struct name_slab * slab = malloc(NAME_SLAB_SIZE);
+      if (slab == NULL) {
+        pthread_mutex_unlock( & names.lock);
+        return NULL;
+      }
+
+      // Whatever is left of the previous slab is given up
+      slab -> next = names.slabs;
+      names.slabs = slab;
+      names.slab_bytes += NAME_SLAB_SIZE;
+      names.fresh[class] = (char * ) slab -> slots;
+      names.fresh_end[class] = (char * ) slab + NAME_SLAB_SIZE;
+    }
+
+    slot = names.fresh[class];
+    names.fresh[class] += size;
+  }
+  names.live++;
+  names.slot_bytes += size;
+  pthread_mutex_unlock( & names.lock);
+
+  slot[0] = len;
+  memcpy(slot + 1, name, len);
+  slot[len + 1] = '\0';
+  return slot + 1;
+}
+
+/**
+ * Return an interned name's slot (if any) to the arena. Nothing may be
+ * reading the name any more.
+ */
+static void name_release(const char * name) {
+  if (name == NULL || name == NAME_NONE) {
+    return;
+  }
+
+  char * slot = (char * ) name - 1;
+  int class = name_class(name_length(name));
+
+  pthread_mutex_lock( & names.lock);
+  * (char ** ) slot = names.free[class];
+  names.free[class] = slot;
+  names.live--;
+  names.slot_bytes -= NameClassSize[class];
+  pthread_mutex_unlock( & names.lock);
+}
+
+/**
+ * Free every slab, once no inode refers to a name any more.
+ */
+static void names_release(void) {
+  while (names.slabs != NULL) {
+    struct name_slab * next = names.slabs -> next;
+    free(names.slabs);
+    names.slabs = next;
+  }
+
+  memset(names.free, 0, sizeof(names.free));
+  memset(names.fresh, 0, sizeof(names.fresh));
+  memset(names.fresh_end, 0, sizeof(names.fresh_end));
+  names.live = names.slot_bytes = names.slab_bytes = 0;
+}
+
+static void names_report(FILE * out) {
+  pthread_mutex_lock( & names.lock);
+  fprintf(out, "names: %zu interned in %zu bytes of slots (%.1f per name),"
+    " %zu KiB of slabs\n", names.live, names.slot_bytes,
+    names.live ? (double) names.slot_bytes / names.live : 0.0,
+    names.slab_bytes >> 10);
+  pthread_mutex_unlock( & names.lock);
+}
+
+static struct inode_chunk * chunk_new(size_t index) {
+  // Keep every node on a cache line of its own
+  struct inode_chunk * chunk = aligned_alloc(_Alignof(struct inode_chunk),
+    sizeof( * chunk));
+  if (chunk == NULL) {
+    return NULL;
+  }
+  memset(chunk, 0, sizeof( * chunk));
+
+  for (size_t j = 0; j < INODE_CHUNK_SIZE; j++) {
+    pthread_rwlock_init( & chunk -> locks[j], NULL);
+  }
+  pthread_mutex_init( & chunk -> free_lock, NULL);
+
+  // Inode 0 is never valid
+  chunk -> bump = (index == 0) ? 1 : 0;
+  return chunk;
+}
+
+static void chunk_free(struct inode_chunk * chunk) {
+  for (size_t j = 0; j < INODE_CHUNK_SIZE; j++) {
+    pthread_rwlock_destroy( & chunk -> locks[j]);
+  }
+  pthread_mutex_destroy( & chunk -> free_lock);
+  free(chunk);
+}
+
+/**
+ * Find chunk `index`, creating it (and extending chunk_count) if needed.
+ * Threads that race to create the same chunk agree on one of them.
+ */
+static struct inode_chunk * chunk_get(size_t index) {
+  size_t count = __atomic_load_n( & inodes.chunk_count, __ATOMIC_ACQUIRE);
+  while (count <= index && !__atomic_compare_exchange_n( & inodes.chunk_count,
+      & count, index + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {}
+
+  struct inode_chunk * chunk = __atomic_load_n( & inodes.chunks[index], __ATOMIC_ACQUIRE);
+  if (chunk != NULL) {
+    return chunk;
+  }
+
+  struct inode_chunk * created = chunk_new(index);
+  if (created == NULL) {
+    return NULL;
+  }
+
+  if (__atomic_compare_exchange_n( & inodes.chunks[index], & chunk, created,
+      false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    return created;
+  }
+
+  chunk_free(created);
+  return chunk;
+}
+
+/**
+ * Allocate an inode number, preferring recycled numbers in low chunks.
+ *
+ * @returns    the new inode number (with zeroed stat and data), or 0 if the
+ *             table is full or out of memory
+ */
+static fuse_ino_t inode_alloc(void) {
+  for (size_t i = __atomic_load_n( & inodes.alloc_hint, __ATOMIC_RELAXED);
+    i < INODE_CHUNK_MAX; i++) {
+    struct inode_chunk * chunk = chunk_get(i);
+    if (chunk == NULL) {
+      return 0;
+    }
+
+    // Recycled numbers first; the list needs a lock, but it is per chunk
+    fuse_ino_t ino = 0;
+    if (__atomic_load_n( & chunk -> free_head, __ATOMIC_ACQUIRE) != 0) {
+      pthread_mutex_lock( & chunk -> free_lock);
+      if ((ino = chunk -> free_head) != 0) {
+        chunk -> free_head = inode_node(ino) -> hash_next;
+      }
+      pthread_mutex_unlock( & chunk -> free_lock);
+    }
+
+    if (ino == 0) {
+      unsigned bump = __atomic_load_n( & chunk -> bump, __ATOMIC_RELAXED);
+      while (bump < INODE_CHUNK_SIZE && !__atomic_compare_exchange_n( & chunk -> bump,
+          & bump, bump + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+
+      if (bump >= INODE_CHUNK_SIZE) {
+        continue;
+      }
+      ino = (i << INODE_CHUNK_SHIFT) | bump;
+    }
+
+    __atomic_add_fetch( & chunk -> live, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch( & inodes.live, 1, __ATOMIC_RELAXED);
+    __atomic_store_n( & inodes.alloc_hint, i, __ATOMIC_RELAXED);
+
+    struct file_node * node = inode_node(ino);
+    memset(node, 0, sizeof( * node));
+    node -> name = NAME_NONE;
+    struct file_meta * meta = inode_meta(ino);
+    memset(meta, 0, sizeof( * meta));
+    meta -> generation = __atomic_add_fetch( & inodes.generation, 1, __ATOMIC_RELAXED);
+
+    memset(inode_data(ino), 0, sizeof(struct file_data));
+    inode_data(ino) -> ino = ino;
+    inode_data(ino) -> map_loaded = true;
+
+    stat_write_begin(ino);
+    memset(inode_stat(ino), 0, sizeof(struct stat));
+    __atomic_store_n( & inode_stat(ino) -> st_ino, ino, __ATOMIC_RELEASE);
+    stat_write_end(ino);
+
+    inode_dirty(ino);
+    return ino;
+  }
+
+  return 0;
+}
+
+/**
+ * Return an inode number to its chunk's free list. Called with the inode's
+ * write lock held.
+ */
+static void inode_free(fuse_ino_t ino) {
+  size_t index = ino >> INODE_CHUNK_SHIFT;
+  struct inode_chunk * chunk = inodes.chunks[index];
+
+  data_discard(inode_data(ino));
+  xattr_release(ino);
+  name_release(inode_node(ino) -> name);
+  inode_node(ino) -> name = NAME_NONE;
+
+  stat_write_begin(ino);
+  __atomic_store_n( & inode_stat(ino) -> st_ino, 0, __ATOMIC_RELEASE);
+  stat_write_end(ino);
+  inode_dirty(ino);
+
+  pthread_mutex_lock( & chunk -> free_lock);
+  inode_node(ino) -> hash_next = chunk -> free_head;
+  __atomic_store_n( & chunk -> free_head, ino, __ATOMIC_RELEASE);
+  pthread_mutex_unlock( & chunk -> free_lock);
+
+  __atomic_sub_fetch( & chunk -> live, 1, __ATOMIC_RELAXED);
+  __atomic_sub_fetch( & inodes.live, 1, __ATOMIC_RELAXED);
+
+  size_t hint = __atomic_load_n( & inodes.alloc_hint, __ATOMIC_RELAXED);
+  while (index < hint && !__atomic_compare_exchange_n( & inodes.alloc_hint,
+      & hint, index, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+/**
+ * Release chunks that hold no live inodes. Other threads may still be
+ * looking at a chunk after its last inode is freed, so this only runs while
+ * every operation is excluded.
+ */
+static void inode_reclaim(void) {
+  for (size_t i = 1; i < inodes.chunk_count; i++) {
+    struct inode_chunk * chunk = inodes.chunks[i];
+    if (chunk != NULL && chunk -> live == 0) {
+      inodes.chunks[i] = NULL;
+      chunk_free(chunk);
+    }
+  }
+}
+
+static uint32_t name_hash(fuse_ino_t parent, const char * name) {
+  // FNV-1a over the name, seeded with the parent inode
+  uint32_t hash = 2166136261u ^ (uint32_t)(parent * 0x9e3779b97f4a7c15ull >> 32);
+
+  for (const unsigned char * p = (const unsigned char * ) name; * p; p++) {
+    hash ^= * p;
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+static fuse_ino_t * index_bucket(uint32_t hash) {
+  return & dir_index.buckets[hash & (dir_index.bucket_count - 1)];
+}
+
+static void index_grow(void) {
+  size_t old_count = dir_index.bucket_count;
+  fuse_ino_t * old_buckets = dir_index.buckets;
+
+  fuse_ino_t * buckets = calloc(old_count * 2, sizeof( * buckets));
+  if (buckets == NULL) {
+    // Keep the current table: chains just get longer
+    return;
+  }
+
+  dir_index.buckets = buckets;
+  dir_index.bucket_count = old_count * 2;
+
+  for (size_t i = 0; i < old_count; i++) {
+    fuse_ino_t ino = old_buckets[i];
+    while (ino != 0) {
+      fuse_ino_t next = inode_node(ino) -> hash_next;
+      fuse_ino_t * head = index_bucket(inode_node(ino) -> name_hash);
+
+      inode_node(ino) -> hash_next = * head;
+      * head = ino;
+      ino = next;
+    }
+  }
+
+  free(old_buckets);
+}
+
+/**
+ * Look up `name` in `parent`. Called with dir_index.lock held.
+ */
+static fuse_ino_t index_find(fuse_ino_t parent, const char * name) {
+  uint32_t hash = name_hash(parent, name);
+  size_t len = strlen(name);
+
+  for (fuse_ino_t ino = * index_bucket(hash); ino != 0;
+    ino = inode_node(ino) -> hash_next) {
+    struct file_node * node = inode_node(ino);
+    if (node -> name_hash == hash && node -> parent_inode == parent &&
+      name_length(node -> name) == len &&
+      memcmp(node -> name, name, len) == 0) {
+      return ino;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Add `ino` under its current parent and name. Called with dir_index.lock
+ * held for writing.
+ */
+static void index_hash(fuse_ino_t ino) {
+  struct file_node * node = inode_node(ino);
+
+  if (dir_index.entries >= dir_index.bucket_count) {
+    index_grow();
+  }
+
+  node -> name_hash = name_hash(node -> parent_inode, node -> name);
+
+  fuse_ino_t * head = index_bucket(node -> name_hash);
+  node -> hash_next = * head;
+  * head = ino;
+  dir_index.entries++;
+}
+
+/**
+ * Take `ino` out of the index, if it is there. Called with dir_index.lock
+ * held for writing.
+ */
+static void index_unhash(fuse_ino_t ino) {
+  struct file_node * node = inode_node(ino);
+
+  for (fuse_ino_t * link = index_bucket(node -> name_hash); * link != 0;
+    link = & inode_node( * link) -> hash_next) {
+    if ( * link == ino) {
+      * link = node -> hash_next;
+      node -> hash_next = 0;
+      dir_index.entries--;
+      break;
+    }
+  }
+}
+
+static void index_insert(fuse_ino_t ino) {
+  pthread_rwlock_wrlock( & dir_index.lock);
+  index_hash(ino);
+  pthread_rwlock_unlock( & dir_index.lock);
+}
+
+/**
+ * Append `ino` to its parent's child list, keeping its existing cookie.
+ */
+static void child_append(fuse_ino_t ino) {
+  struct file_node * node = inode_node(ino);
+  struct file_meta * dir = inode_meta(node -> parent_inode);
+
+  inode_meta(ino) -> prev_sibling = dir -> last_child;
+  node -> next_sibling = 0;
+
+  if (dir -> last_child != 0) {
+    inode_node(dir -> last_child) -> next_sibling = ino;
+  } else {
+    inode_node(node -> parent_inode) -> first_child = ino;
+  }
+  dir -> last_child = ino;
+}
+
+/**
+ * Give `ino` the next cookie in its parent and append it to the child list.
+ */
+static void child_link(fuse_ino_t ino) {
+  struct file_node * node = inode_node(ino);
+  struct file_meta * dir = inode_meta(node -> parent_inode);
+
+  if (dir -> next_cookie < DIR_COOKIE_FIRST) {
+    dir -> next_cookie = DIR_COOKIE_FIRST;
+  }
+
+  node -> dir_cookie = dir -> next_cookie++;
+  child_append(ino);
+
+  inode_dirty(node -> parent_inode);
+  inode_dirty(ino);
+}
+
+static void child_unlink(fuse_ino_t ino) {
+  struct file_node * node = inode_node(ino);
+  struct file_meta * meta = inode_meta(ino);
+
+  if (meta -> prev_sibling != 0) {
+    inode_node(meta -> prev_sibling) -> next_sibling = node -> next_sibling;
+  } else {
+    inode_node(node -> parent_inode) -> first_child = node -> next_sibling;
+  }
+
+  if (node -> next_sibling != 0) {
+    inode_meta(node -> next_sibling) -> prev_sibling = meta -> prev_sibling;
+  } else {
+    inode_meta(node -> parent_inode) -> last_child = meta -> prev_sibling;
+  }
+
+  meta -> prev_sibling = 0;
+  node -> next_sibling = 0;
+}
+
+static void index_remove(fuse_ino_t ino) {
+  pthread_rwlock_wrlock( & dir_index.lock);
+  index_unhash(ino);
+  pthread_rwlock_unlock( & dir_index.lock);
+}
+
+static void inode_to_disk(fuse_ino_t ino, struct disk_inode * rec) {
+  struct stat * stat = inode_stat(ino);
+  struct file_node * node = inode_node(ino);
+  struct file_meta * meta = inode_meta(ino);
+  struct file_data * data = inode_data(ino);
+
+  rec -> mode = stat -> st_mode;
+  rec -> nlink = stat -> st_nlink;
+  rec -> uid = stat -> st_uid;
+  rec -> gid = stat -> st_gid;
+  rec -> rdev = stat -> st_rdev;
+  rec -> size = data -> size;
+  rec -> atime = stat -> st_atim.tv_sec;
+  rec -> atime_nsec = stat -> st_atim.tv_nsec;
+  rec -> mtime = stat -> st_mtim.tv_sec;
+  rec -> mtime_nsec = stat -> st_mtim.tv_nsec;
+  rec -> ctime = stat -> st_ctim.tv_sec;
+  rec -> ctime_nsec = stat -> st_ctim.tv_nsec;
+
+  rec -> generation = meta -> generation;
+  rec -> parent = node -> parent_inode;
+  rec -> dir_cookie = node -> dir_cookie;
+  rec -> next_cookie = meta -> next_cookie;
+  rec -> link_target = node -> link_target;
+  // Longer names are written to the name table by names_store()
+  rec -> name_len = name_length(node -> name);
+  if (rec -> name_len <= DISK_NAME_INLINE) {
+    memcpy(rec -> name, node -> name, rec -> name_len);
+  }
+  rec -> xattr_inline_len = meta -> xattr_inline_len;
+  memcpy(rec -> xattr_inline, meta -> xattr_inline, meta -> xattr_inline_len);
+  rec -> xattr_spill_len = meta -> xattr_spill_len;
+  rec -> xattr_block = meta -> xattr_block;
+
+  rec -> map = data -> map;
+}
+
+/**
+ * Load inode `ino` from its record, and its name from `long_name` if it was
+ * too long for the record.
+ *
+ * @returns    0 or an errno value
+ */
+static int inode_from_disk(fuse_ino_t ino, const struct disk_inode * rec,
+  const char * long_name) {
+  struct stat * stat = inode_stat(ino);
+  struct file_node * node = inode_node(ino);
+  struct file_meta * meta = inode_meta(ino);
+  struct file_data * data = inode_data(ino);
+
+  stat -> st_ino = ino;
+  stat -> st_mode = rec -> mode;
+  stat -> st_nlink = rec -> nlink;
+  stat -> st_uid = rec -> uid;
+  stat -> st_gid = rec -> gid;
+  stat -> st_rdev = rec -> rdev;
+  stat -> st_size = rec -> size;
+  stat -> st_atim.tv_sec = rec -> atime;
+  stat -> st_atim.tv_nsec = rec -> atime_nsec;
+  stat -> st_mtim.tv_sec = rec -> mtime;
+  stat -> st_mtim.tv_nsec = rec -> mtime_nsec;
+  stat -> st_ctim.tv_sec = rec -> ctime;
+  stat -> st_ctim.tv_nsec = rec -> ctime_nsec;
+
+  node -> type = rec -> mode & S_IFMT;
+  node -> is_directory = S_ISDIR(rec -> mode);
+  meta -> generation = rec -> generation;
+  node -> parent_inode = rec -> parent;
+  node -> dir_cookie = rec -> dir_cookie;
+  meta -> next_cookie = rec -> next_cookie;
+  node -> link_target = rec -> link_target;
+  node -> name = name_intern(long_name ? long_name : rec -> name, rec -> name_len);
+  meta -> xattr_inline_len = rec -> xattr_inline_len;
+  memcpy(meta -> xattr_inline, rec -> xattr_inline, rec -> xattr_inline_len);
+  meta -> xattr_spill_len = rec -> xattr_spill_len;
+  meta -> xattr_block = rec -> xattr_block;
+
+  // Only the map root is read now; pages and indirect blocks load lazily
+  data -> size = rec -> size;
+  data -> map = rec -> map;
+  data -> map_loaded = false;
+  data -> ino = ino;
+
+  return node -> name != NULL ? 0 : ENOMEM;
+}
+
+/**
+ * Mark a specific inode number as allocated (used when mounting).
+ */
+static int inode_claim(fuse_ino_t ino) {
+  size_t index = ino >> INODE_CHUNK_SHIFT;
+  if (index >= INODE_CHUNK_MAX) {
+    return EFBIG;
+  }
+
+  if (chunk_get(index) == NULL) {
+    return ENOMEM;
+  }
+
+  inode_stat(ino) -> st_ino = ino;
+  inodes.chunks[index] -> live++;
+  inodes.live++;
+
+  return 0;
+}
+
+/**
+ * Rebuild each chunk's bump pointer and free list after inodes were claimed
+ * directly, and drop chunks that ended up empty.
+ */
+static void inode_table_rebuild(void) {
+  for (size_t i = 0; i < inodes.chunk_count; i++) {
+    struct inode_chunk * chunk = inodes.chunks[i];
+    if (chunk == NULL) {
+      continue;
+    }
+
+    if (chunk -> live == 0 && i != 0) {
+      chunk_free(chunk);
+      inodes.chunks[i] = NULL;
+      continue;
+    }
+
+    fuse_ino_t base = i << INODE_CHUNK_SHIFT;
+    chunk -> bump = (i == 0) ? 1 : 0;
+    for (unsigned j = chunk -> bump; j < INODE_CHUNK_SIZE; j++) {
+      if (inode_exists(base + j)) {
+        chunk -> bump = j + 1;
+      }
+    }
+
+    // Push in descending order so the lowest free number is reused first
+    chunk -> free_head = 0;
+    for (unsigned j = chunk -> bump; j-- > ((i == 0) ? 1 : 0);) {
+      if (!inode_exists(base + j)) {
+        inode_node(base + j) -> hash_next = chunk -> free_head;
+        chunk -> free_head = base + j;
+      }
+    }
+  }
+
+  inodes.alloc_hint = 0;
+}
+
+static int child_order(const void * a, const void * b) {
+  const struct file_node * x = inode_node( * (const fuse_ino_t * ) a);
+  const struct file_node * y = inode_node( * (const fuse_ino_t * ) b);
+
+  if (x -> parent_inode != y -> parent_inode) {
+    return x -> parent_inode < y -> parent_inode ? -1 : 1;
+  }
+
+  return (x -> dir_cookie > y -> dir_cookie) - (x -> dir_cookie < y -> dir_cookie);
+}
+
+/**
+ * Rebuild the name index and child lists from the loaded parent pointers,
+ * keeping every directory's children in cookie order.
+ */
+static int link_loaded_inodes(void) {
+  fuse_ino_t * named = malloc(inodes.live * sizeof( * named));
+  size_t count = 0;
+
+  if (named == NULL) {
+    return ENOMEM;
+  }
+
+  for (fuse_ino_t ino = ROOT_DIR; ino < (inodes.chunk_count << INODE_CHUNK_SHIFT); ino++) {
+    // Inodes that lost their own name to an unlink are only reachable
+    // through their other links
+    if (inode_exists(ino) && inode_node(ino) -> parent_inode != 0) {
+      index_insert(ino);
+      if (ino != ROOT_DIR) {
+        named[count++] = ino;
+      }
+    }
+  }
+
+  qsort(named, count, sizeof( * named), child_order);
+  for (size_t i = 0; i < count; i++) {
+    if (inode_exists(inode_node(named[i]) -> parent_inode)) {
+      child_append(named[i]);
+    }
+  }
+
+  free(named);
+  return 0;
+}
+
+/**
+ * Free every orphan, whatever references were counted: at unmount the
+ * kernel lets go of everything, and at mount it holds nothing yet. Runs
+ * while no operation can.
+ */
+static void orphans_free(void) {
+  for (fuse_ino_t ino = ROOT_DIR; ino < (inodes.chunk_count << INODE_CHUNK_SHIFT); ino++) {
+    // Extra names have no link count of their own
+    if (inode_exists(ino) && inode_stat(ino) -> st_nlink == 0 &&
+      inode_node(ino) -> link_target == 0) {
+      inode_free(ino);
+    }
+  }
+
+  inodes.orphans = 0;
+}
+
+static uint64_t journal_sum(uint64_t hash, const void * buf, size_t len) {
+  const unsigned char * p = buf;
+
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ p[i]) * 0x100000001b3ull;
+  }
+
+  return hash;
+}
+
+#define JOURNAL_SUM_SEED 0xcbf29ce484222325ull
+
+/**
+ * Write all committed metadata to its home location, then record in the
+ * superblock that the journal is empty so it can be reused from the start.
+ */
+static int journal_checkpoint(void) {
+  int err = cache_flush();
+  if (err == 0 && fdatasync(disk.fd) != 0) {
+    err = EIO;
+  }
+  if (err != 0) {
+    return err;
+  }
+
+  char * block = calloc(1, DISK_BLOCK_SIZE);
+  if (block == NULL) {
+    return ENOMEM;
+  }
+
+  journal.committed.journal_seq = journal.seq;
+  disk.sb.journal_seq = journal.seq;
+  memcpy(block, & journal.committed, sizeof(journal.committed));
+  err = disk_io(true, 0, block);
+  free(block);
+
+  if (err == 0 && fdatasync(disk.fd) != 0) {
+    err = EIO;
+  }
+
+  if (err == 0) {
+    journal.head = 0;
+    pthread_mutex_lock( & block_lock);
+    memset(disk.reuse_fence, 0, disk.sb.bitmap_blocks * DISK_BLOCK_SIZE);
+    pthread_mutex_unlock( & block_lock);
+    journal.checkpoints++;
+  }
+
+  return err;
+}
+
+/**
+ * Append the assembled transaction to the journal and make it durable. A
+ * transaction that fails to write leaves the head where it was, so that
+ * retrying it overwrites whatever part of it did reach the journal.
+ *
+ * @returns    0 on success, EFBIG if it can never fit, or another errno
+ */
+static int journal_write(void) {
+  size_t count = journal.txn_count;
+  size_t needed = count + (count + JOURNAL_DESC_MAX - 1) / JOURNAL_DESC_MAX;
+
+  if (needed > disk.sb.journal_blocks) {
+    return EFBIG;
+  }
+
+  int err = 0;
+  if (journal.head + needed > disk.sb.journal_blocks &&
+    (err = journal_checkpoint()) != 0) {
+    return err;
+  }
+
+  uint64_t start = journal.head;
+
+  struct journal_header * header = malloc(sizeof( * header));
+  if (header == NULL) {
+    return ENOMEM;
+  }
+
+  struct iovec iov[JOURNAL_DESC_MAX + 1];
+
+  for (size_t first = 0; first < count && err == 0;) {
+    size_t n = count - first < JOURNAL_DESC_MAX ? count - first : JOURNAL_DESC_MAX;
+
+    memset(header, 0, sizeof( * header));
+    header -> magic = JOURNAL_MAGIC;
+    header -> flags = (first + n == count) ? JOURNAL_COMMIT : 0;
+    header -> seq = journal.seq;
+    header -> count = n;
+    memcpy(header -> blocks, journal.txn_blocks + first, n * sizeof(uint64_t));
+
+    uint64_t sum = journal_sum(JOURNAL_SUM_SEED, header, sizeof( * header));
+    iov[0].iov_base = header;
+    iov[0].iov_len = DISK_BLOCK_SIZE;
+    for (size_t i = 0; i < n; i++) {
+      iov[i + 1].iov_base = journal.txn_images + (first + i) * DISK_BLOCK_SIZE;
+      iov[i + 1].iov_len = DISK_BLOCK_SIZE;
+      sum = journal_sum(sum, iov[i + 1].iov_base, DISK_BLOCK_SIZE);
+    }
+    header -> checksum = sum;
+
+    off_t pos = (off_t)(disk.sb.journal_start + journal.head) * DISK_BLOCK_SIZE;
+    ssize_t len = (ssize_t)(n + 1) * DISK_BLOCK_SIZE;
+    if (pwritev(disk.fd, iov, n + 1, pos) != len) {
+      err = EIO;
+    }
+
+    journal.head += n + 1;
+    first += n;
+  }
+
+  free(header);
+
+  // The one flush that every operation in the group shares
+  if (err == 0 && fdatasync(disk.fd) != 0) {
+    err = EIO;
+  }
+  if (err != 0) {
+    journal.head = start;
+  }
+
+  return err;
+}
+
+/**
+ * Send the blocks of a committed transaction to their home locations.
+ */
+static int journal_install(void) {
+  int err = 0;
+
+  for (size_t i = 0; i < journal.txn_count && err == 0; i++) {
+    char * image = journal.txn_images + i * DISK_BLOCK_SIZE;
+
+    // The superblock bypasses the cache, so a checkpoint can write it last
+    err = (journal.txn_blocks[i] == 0) ?
+      disk_io(true, 0, image) :
+      disk_write(journal.txn_blocks[i], image);
+  }
+
+  return err;
+}
+
+/**
+ * Write the long names of the records in inode table block `b` to the
+ * same block of the name table. Called while capturing a transaction.
+ */
+static int names_store(size_t b) {
+  char * page;
+  int err = data_page( & disk.names_file, b, true, & page);
+  if (err != 0) {
+    return err;
+  }
+
+  memset(page, 0, DISK_BLOCK_SIZE);
+  for (size_t r = 0; r < DISK_INODES_PER_BLOCK; r++) {
+    fuse_ino_t ino = b * DISK_INODES_PER_BLOCK + r;
+    if (!inode_exists(ino)) {
+      continue;
+    }
+
+    const char * name = inode_node(ino) -> name;
+    if (name_length(name) > DISK_NAME_INLINE) {
+      memcpy(page + r * DISK_NAME_SLOT, name, name_length(name));
+    }
+  }
+
+  page_dirty( & disk.names_file, b);
+  return 0;
+}
+
+/**
+ * Write the changed blocks of the block share table, stored like the inode
+ * table. Called while capturing a transaction.
+ */
+static int refs_store(void) {
+  if (disk.refs == NULL) {
+    return 0;
+  }
+
+  int err = 0;
+  disk.refs_file.size = refs_blocks() * DISK_BLOCK_SIZE;
+
+  for (size_t b = 0; b < refs_blocks(); b++) {
+    if (!disk.refs_dirty[b]) {
+      continue;
+    }
+
+    char * page;
+    if ((err = data_page( & disk.refs_file, b, true, & page)) != 0) {
+      return err;
+    }
+
+    memcpy(page, disk.refs + b * DISK_BLOCK_SIZE, DISK_BLOCK_SIZE);
+    page_dirty( & disk.refs_file, b);
+    disk.refs_dirty[b] = false;
+  }
+
+  err = data_flush( & disk.refs_file);
+  disk.sb.refs_map = disk.refs_file.map;
+  disk.sb.version = DISK_VERSION;
+  data_drop_clean( & disk.refs_file);
+  return err;
+}
+
+/**
+ * Read the block share table, if the filesystem has one.
+ */
+static int refs_load(void) {
+  static const struct disk_map none;
+
+  memset( & disk.refs_file, 0, sizeof(disk.refs_file));
+  disk.refs_file.map = disk.sb.refs_map;
+  disk.refs_file.size = refs_blocks() * DISK_BLOCK_SIZE;
+  if (memcmp( & disk.sb.refs_map, & none, sizeof(none)) == 0) {
+    disk.refs_file.map_loaded = true;
+    return 0;
+  }
+
+  disk.refs = calloc(refs_blocks(), DISK_BLOCK_SIZE);
+  disk.refs_dirty = calloc(refs_blocks(), sizeof( * disk.refs_dirty));
+  if (disk.refs == NULL || disk.refs_dirty == NULL) {
+    return ENOMEM;
+  }
+
+  for (size_t b = 0; b < refs_blocks(); b++) {
+    char * page;
+    int err = data_page( & disk.refs_file, b, false, & page);
+    if (err != 0) {
+      return err;
+    }
+    if (page != NULL) {
+      memcpy(disk.refs + b * DISK_BLOCK_SIZE, page, DISK_BLOCK_SIZE);
+    }
+  }
+
+  data_drop_clean( & disk.refs_file);
+  return 0;
+}
+
+/**
+ * First half of a commit, run while every operation is excluded: write the
+ * dirty file contents to the cache and capture the metadata blocks that
+ * changed (block maps, inode table, share table, bitmap, superblock) into a
+ * transaction. A transaction that failed to commit is still there, and
+ * goes out with this one.
+ */
+static int journal_capture(bool * wrote_data) {
+  journal.capturing = true;
+  * wrote_data = false;
+
+  // Everything reserved so far is in this transaction
+  pthread_mutex_lock( & journal.lock);
+  journal.reserved = 0;
+  journal.captures++;
+  pthread_cond_broadcast( & journal.captured);
+  pthread_mutex_unlock( & journal.lock);
+
+  // Nothing can be looking at an empty chunk now
+  inode_reclaim();
+
+  int err = 0;
+
+  for (size_t i = 0; i < disk.dirty_count && err == 0; i++) {
+    fuse_ino_t ino = disk.dirty_files[i];
+    if (!inode_exists(ino) || !inode_data(ino) -> on_dirty_list) {
+      continue;
+    }
+
+    inode_data(ino) -> on_dirty_list = false;
+    err = data_flush(inode_data(ino));
+    if (err == 0 && inode_meta(ino) -> xattr_dirty) {
+      err = xattr_store(ino);
+    }
+    * wrote_data = true;
+
+    // The record holds the root of the block map
+    inode_dirty(ino);
+  }
+  disk.dirty_count = 0;
+
+  size_t records = inodes.chunk_count << INODE_CHUNK_SHIFT;
+  size_t itable_blocks = records / DISK_INODES_PER_BLOCK;
+
+  for (size_t b = 0; err == 0 && b < itable_blocks && b < disk.itable_dirty_size; b++) {
+    if (!disk.itable_dirty[b]) {
+      continue;
+    }
+
+    char * page;
+    if ((err = data_page( & disk.itable, b, true, & page)) != 0) {
+      break;
+    }
+
+    bool long_names = false;
+    memset(page, 0, DISK_BLOCK_SIZE);
+    for (size_t r = 0; r < DISK_INODES_PER_BLOCK; r++) {
+      fuse_ino_t ino = b * DISK_INODES_PER_BLOCK + r;
+      if (inode_exists(ino)) {
+        struct disk_inode * rec = (struct disk_inode * )(page + r * DISK_INODE_SIZE);
+        inode_to_disk(ino, rec);
+        long_names |= rec -> name_len > DISK_NAME_INLINE;
+      }
+    }
+
+    page_dirty( & disk.itable, b);
+    disk.itable_dirty[b] = false;
+
+    // A name table block nobody points at any more is left as it is
+    if (long_names) {
+      err = names_store(b);
+    }
+  }
+
+  if (err == 0) {
+    if (records > disk.sb.inode_count) {
+      disk.sb.inode_count = records;
+    }
+    disk.itable.size = disk.sb.inode_count * DISK_INODE_SIZE;
+
+    err = data_flush( & disk.itable);
+    disk.sb.itable_map = disk.itable.map;
+    data_drop_clean( & disk.itable);
+  }
+
+  if (err == 0) {
+    disk.names_file.size = disk.itable.size;
+    err = data_flush( & disk.names_file);
+    disk.sb.names_map = disk.names_file.map;
+    data_drop_clean( & disk.names_file);
+  }
+
+  if (err == 0) {
+    err = refs_store();
+  }
+
+  for (size_t b = 0; err == 0 && b < disk.sb.bitmap_blocks; b++) {
+    if (disk.bitmap_dirty[b]) {
+      err = disk_write_meta(disk.sb.bitmap_start + b,
+        (char * ) disk.bitmap + b * DISK_BLOCK_SIZE);
+      disk.bitmap_dirty[b] = false;
+    }
+  }
+
+  char * block = NULL;
+  if (err == 0 && journal.txn_count > 0) {
+    disk.sb.generation = inodes.generation;
+
+    if ((block = calloc(1, DISK_BLOCK_SIZE)) == NULL) {
+      err = ENOMEM;
+    } else {
+      memcpy(block, & disk.sb, sizeof(disk.sb));
+      err = disk_write_meta(0, block);
+      free(block);
+    }
+  }
+
+  journal.capturing = false;
+  return err;
+}
+
+/**
+ * Second half of a commit, run concurrently with new operations: write the
+ * captured transaction to the journal, then its blocks to their homes.
+ *
+ * File contents go out before the transaction (ordered mode), so that no
+ * committed block map points at stale data.
+ */
+static int journal_finish(bool wrote_data) {
+  int err = 0;
+
+  if (journal.txn_count == 0) {
+    // Only file contents changed, if anything did
+    if (wrote_data && (err = cache_flush()) == 0 && fdatasync(disk.fd) != 0) {
+      err = EIO;
+    }
+    return err;
+  }
+
+  err = cache_flush();
+  // Ordered mode needs the data on stable storage before the commit record:
+  // the device may reorder writes that no flush separates
+  if (err == 0 && wrote_data && fdatasync(disk.fd) != 0) {
+    err = EIO;
+  }
+  if (err == 0 && (err = journal_write()) == 0) {
+    // The superblock as captured: disk.sb may already be ahead of it
+    memcpy( & journal.committed, journal_image(0), sizeof(journal.committed));
+    journal.seq++;
+    journal.commits++;
+
+    err = journal_install();
+  }
+
+  // Whatever failed, the transaction is never written in place (not even
+  // one too big for the journal, which journal_reserve() keeps from
+  // happening): it is kept, to go out with the next one
+  if (err == 0) {
+    journal.txn_count = 0;
+  } else if (err == EFBIG) {
+    fprintf(stderr, "%s: %zu-block transaction exceeds the journal\n",
+      __func__, journal.txn_count);
+  }
+
+  return err;
+}
+
+/**
+ * Make every change since the last commit durable, with nothing else
+ * running (the committer thread splits this around fs_lock instead).
+ */
+static int journal_commit(void) {
+  if (disk.fd < 0) {
+    return 0;
+  }
+
+  bool wrote_data;
+  int err = journal_capture( & wrote_data);
+
+  return err ? err : journal_finish(wrote_data);
+}
+
+/**
+ * Commit everything that changed and checkpoint it, leaving the journal
+ * empty.
+ */
+static int disk_sync(void) {
+  int err = journal_commit();
+  if (err == 0 && disk.fd >= 0) {
+    err = journal_checkpoint();
+  }
+
+  return err;
+}
+
+/**
+ * Apply the complete transactions that a crash left in the journal, then
+ * checkpoint them. Runs before the block cache exists, with raw I/O.
+ *
+ * @returns    the number of transactions replayed, or a negative errno
+ */
+static int journal_replay(void) {
+  struct journal_header * header = malloc(sizeof( * header));
+  char * image = malloc(DISK_BLOCK_SIZE);
+  if (header == NULL || image == NULL) {
+    free(header);
+    free(image);
+    return -ENOMEM;
+  }
+
+  uint64_t seq = disk.sb.journal_seq;
+  uint64_t pos = 0;
+  int replayed = 0;
+  int err = 0;
+
+  while (err == 0) {
+    // Check the whole transaction before applying any of it
+    uint64_t start = pos;
+    bool complete = false;
+
+    while (!complete && err == 0 && pos < disk.sb.journal_blocks) {
+      if ((err = disk_io(false, disk.sb.journal_start + pos, header)) != 0) {
+        break;
+      }
+
+      if (header -> magic != JOURNAL_MAGIC || header -> seq != seq ||
+        header -> count == 0 || header -> count > JOURNAL_DESC_MAX ||
+        pos + 1 + header -> count > disk.sb.journal_blocks) {
+        break;
+      }
+
+      uint64_t expected = header -> checksum;
+      header -> checksum = 0;
+      uint64_t sum = journal_sum(JOURNAL_SUM_SEED, header, sizeof( * header));
+
+      for (uint32_t i = 0; i < header -> count && err == 0; i++) {
+        err = disk_io(false, disk.sb.journal_start + pos + 1 + i, image);
+        sum = journal_sum(sum, image, DISK_BLOCK_SIZE);
+      }
+
+      if (sum != expected) {
+        break;
+      }
+
+      pos += 1 + header -> count;
+      complete = header -> flags & JOURNAL_COMMIT;
+    }
+
+    if (err != 0 || !complete) {
+      break;
+    }
+
+    for (uint64_t p = start; p < pos && err == 0; p += 1 + header -> count) {
+      err = disk_io(false, disk.sb.journal_start + p, header);
+
+      for (uint32_t i = 0; i < header -> count && err == 0; i++) {
+        err = disk_io(false, disk.sb.journal_start + p + 1 + i, image);
+        if (err == 0 && header -> blocks[i] < disk.sb.total_blocks) {
+          err = disk_io(true, header -> blocks[i], image);
+        }
+      }
+    }
+
+    seq++;
+    replayed++;
+  }
+
+  if (err == 0 && replayed > 0) {
+    // The last replayed superblock is current except for the journal
+    // position, which moves past everything just applied
+    if (fdatasync(disk.fd) != 0 || (err = disk_io(false, 0, image)) != 0) {
+      err = err ? err : EIO;
+    } else {
+      memcpy( & disk.sb, image, sizeof(disk.sb));
+      disk.sb.journal_seq = seq;
+
+      memset(image, 0, DISK_BLOCK_SIZE);
+      memcpy(image, & disk.sb, sizeof(disk.sb));
+      err = disk_io(true, 0, image);
+      if (err == 0 && fdatasync(disk.fd) != 0) {
+        err = EIO;
+      }
+    }
+  }
+
+  journal.seq = seq;
+  journal.head = 0;
+
+  free(header);
+  free(image);
+  return err ? -err : replayed;
+}
+
+static void journal_report(FILE * out) {
+  fprintf(out, "journal: %lu commits for %lu operations (%.1f per commit),"
+    " %lu checkpoints\n",
+    (unsigned long) journal.commits, (unsigned long) journal.commit_ops,
+    journal.commits ? (double) journal.commit_ops / journal.commits : 0.0,
+    (unsigned long) journal.checkpoints);
+}
+
+static void journal_release(void) {
+  free(journal.txn_blocks);
+  free(journal.txn_images);
+  free(journal.pending);
+  journal.txn_blocks = NULL;
+  journal.txn_images = NULL;
+  journal.txn_count = 0;
+  journal.txn_capacity = 0;
+  journal.pending = NULL;
+  journal.pending_count = 0;
+  journal.pending_capacity = 0;
+  journal.head = 0;
+  journal.seq = 0;
+  journal.commits = 0;
+  journal.commit_ops = 0;
+  journal.checkpoints = 0;
+}
+
+/**
+ * Answer the request behind `reply`, or fail it with `err`. Called with
+ * fs_lock held.
+ */
+static void reply_send(const struct pending_reply * reply, int err) {
+  int result = 0;
+
+  if (err != 0) {
+    result = fuse_reply_err(reply -> req, err);
+  } else {
+    switch (reply -> kind) {
+    case PENDING_ERR:
+      result = fuse_reply_err(reply -> req, 0);
+      break;
+    case PENDING_ENTRY:
+      result = fuse_reply_entry(reply -> req, & reply -> entry);
+      break;
+    case PENDING_CREATE:
+      result = fuse_reply_create(reply -> req, & reply -> entry, & reply -> fi);
+      break;
+    case PENDING_ATTR:
+      result = fuse_reply_attr(reply -> req, & reply -> entry.attr,
+        reply -> entry.attr_timeout);
+      break;
+    case PENDING_OPEN:
+      result = fuse_reply_open(reply -> req, & reply -> fi);
+      break;
+    case PENDING_WRITE:
+      result = fuse_reply_write(reply -> req, reply -> count);
+      break;
+    }
+  }
+
+  // The kernel only holds a reference (and a handle) for an entry it
+  // actually received, and an inode orphaned in the meantime goes with
+  // the one it didn't. An open that wasn't received never gets released.
+  if (err != 0 || result != 0) {
+    if (reply -> kind == PENDING_CREATE || reply -> kind == PENDING_OPEN) {
+      free((struct open_file * )(uintptr_t) reply -> fi.fh);
+    }
+    if (reply -> kind == PENDING_ENTRY || reply -> kind == PENDING_CREATE) {
+      inode_forget(reply -> entry.ino, 1);
+    }
+  }
+
+  if (result != 0) {
+    fprintf(stderr, "Failed to send reply\n");
+  }
+}
+
+/**
+ * Send `reply` once the metadata change it reports is durable.
+ *
+ * The reply is queued for the committer thread, which commits everything
+ * queued within a short window as one transaction (or, with sync_commit,
+ * one operation at a time). Without a committer the reply goes out at once
+ * and the change is only durable after the next sync.
+ */
+static void journal_reply(const struct pending_reply * reply) {
+  if (disk.fd < 0) {
+    reply_send(reply, 0);
+    return;
+  }
+
+  bool queued = false;
+  pthread_mutex_lock( & journal.lock);
+
+  if (journal.running && journal.pending_count == journal.pending_capacity) {
+    size_t capacity = journal.pending_capacity ? journal.pending_capacity * 2 : 64;
+    struct pending_reply * pending =
+      realloc(journal.pending, capacity * sizeof( * pending));
+    if (pending != NULL) {
+      journal.pending = pending;
+      journal.pending_capacity = capacity;
+    }
+  }
+
+  if (journal.running && journal.pending_count < journal.pending_capacity) {
+    if (journal.pending_count == 0) {
+      clock_gettime(CLOCK_REALTIME, & journal.first_pending);
+    }
+    journal.pending[journal.pending_count++] = * reply;
+    // The caller is still counted as running
+    if (__atomic_load_n( & journal.active, __ATOMIC_RELAXED) <= 1) {
+      journal.group_closed = true;
+    }
+    pthread_cond_signal( & journal.wake);
+    queued = true;
+  }
+
+  pthread_mutex_unlock( & journal.lock);
+
+  if (!queued) {
+    reply_send(reply, 0);
+  }
+}
+
+static void journal_reply_ok(fuse_req_t req) {
+  struct pending_reply reply = {
+    .req = req,
+    .kind = PENDING_ERR
+  };
+  journal_reply( & reply);
+}
+
+/**
+ * Reply to a create (`fi` set) or another entry-creating operation.
+ */
+static void journal_reply_entry(fuse_req_t req,
+  const struct fuse_entry_param * entry, const struct fuse_file_info * fi) {
+  struct pending_reply reply = {
+    .req = req,
+    .kind = fi ? PENDING_CREATE : PENDING_ENTRY,
+    .entry = * entry
+  };
+  if (fi != NULL) {
+    reply.fi = * fi;
+  }
+  journal_reply( & reply);
+}
+
+static void journal_reply_open(fuse_req_t req, const struct fuse_file_info * fi) {
+  struct pending_reply reply = {
+    .req = req,
+    .kind = PENDING_OPEN,
+    .fi = * fi
+  };
+  journal_reply( & reply);
+}
+
+static void journal_reply_attr(fuse_req_t req, const struct stat * attr,
+  double timeout) {
+  struct pending_reply reply = {
+    .req = req,
+    .kind = PENDING_ATTR,
+    .entry = {
+      .attr = * attr,
+      .attr_timeout = timeout
+    }
+  };
+  journal_reply( & reply);
+}
+
+static void journal_reply_write(fuse_req_t req, size_t count) {
+  struct pending_reply reply = {
+    .req = req,
+    .kind = PENDING_WRITE,
+    .count = count
+  };
+  journal_reply( & reply);
+}
+
+/**
+ * Group commit loop: wait for queued replies, give operations that are still
+ * running up to window_us to join, then commit the whole group and reply to
+ * all of it.
+ */
+static void * journal_committer(void * arg) {
+  pthread_mutex_lock( & journal.lock);
+
+  for (;;) {
+    while (journal.running && journal.pending_count == 0 &&
+      journal.reserve_waiting == 0) {
+      pthread_cond_wait( & journal.wake, & journal.lock);
+    }
+    if (journal.pending_count == 0 &&
+      (!journal.running || journal.reserve_waiting == 0)) {
+      break;
+    }
+
+    struct timespec deadline = journal.first_pending;
+    deadline.tv_nsec += journal.window_us * 1000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    while (journal.running && !journal.group_closed &&
+      journal.pending_count < JOURNAL_BATCH_MAX &&
+      pthread_cond_timedwait( & journal.wake, & journal.lock, & deadline) != ETIMEDOUT) {}
+
+    // Nothing may be queued yet when an operation waits for room
+    size_t count = journal.sync_commit && journal.pending_count > 0 ? 1 :
+      journal.pending_count;
+    struct pending_reply * batch = count ? malloc(count * sizeof( * batch)) : NULL;
+    if (count > 0 && batch == NULL) {
+      // Commit everything queued rather than nothing
+      batch = journal.pending;
+      count = journal.pending_count;
+      journal.pending = NULL;
+      journal.pending_capacity = 0;
+    } else if (count > 0) {
+      memcpy(batch, journal.pending, count * sizeof( * batch));
+      memmove(journal.pending, journal.pending + count,
+        (journal.pending_count - count) * sizeof( * batch));
+    }
+    journal.pending_count -= count;
+    if (journal.pending_count > 0) {
+      clock_gettime(CLOCK_REALTIME, & journal.first_pending);
+    } else {
+      journal.group_closed = false;
+    }
+    pthread_mutex_unlock( & journal.lock);
+
+    // Operations only wait for the capture; the journal write and its
+    // fdatasync() overlap with whatever comes next
+    bool wrote_data;
+    pthread_rwlock_wrlock( & fs_lock);
+    int err = journal_capture( & wrote_data);
+    pthread_rwlock_unlock( & fs_lock);
+
+    if (err == 0) {
+      err = journal_finish(wrote_data);
+    }
+    journal.commit_ops += count;
+
+    // Shared, for the references that replies the kernel never gets drop
+    pthread_rwlock_rdlock( & fs_lock);
+    for (size_t i = 0; i < count; i++) {
+      reply_send( & batch[i], err);
+    }
+    pthread_rwlock_unlock( & fs_lock);
+    free(batch);
+
+    pthread_mutex_lock( & journal.lock);
+  }
+
+  pthread_mutex_unlock( & journal.lock);
+  return NULL;
+}
+
+static void journal_start(const struct assign5_options * options) {
+  journal.sync_commit = options -> ao_commit_sync;
+  journal.window_us = journal.sync_commit ? 0 : options -> ao_commit_window_us ?
+    options -> ao_commit_window_us : JOURNAL_WINDOW_US;
+
+  if (disk.fd < 0) {
+    return;
+  }
+
+  journal.running = true;
+  if (pthread_create( & journal.committer, NULL, journal_committer, NULL) != 0) {
+    fprintf(stderr, "%s: no committer thread, changes are only durable"
+      " at unmount\n", __func__);
+    journal.running = false;
+  }
+}
+
+/**
+ * Stop the committer thread once it has committed everything queued.
+ */
+static void journal_stop(void) {
+  pthread_mutex_lock( & journal.lock);
+  bool running = journal.running;
+  journal.running = false;
+  pthread_cond_broadcast( & journal.wake);
+  pthread_cond_broadcast( & journal.captured);
+  pthread_mutex_unlock( & journal.lock);
+
+  if (running) {
+    pthread_join(journal.committer, NULL);
+  }
+}
+
+/**
+ * Journal blocks that giving a file `pages` more data blocks (or sharing
+ * that many) can dirty: its block map, the bitmap and the share counts.
+ */
+static size_t journal_data_cost(size_t pages) {
+  return pages / DISK_PTRS_PER_BLOCK + 2 + pages / DISK_BITS_PER_BLOCK + 1 +
+    pages / DISK_BLOCK_SIZE + 1;
+}
+
+/**
+ * Reserve room in the next transaction for an operation that can dirty
+ * about `blocks` metadata blocks, far more than a write or a name change
+ * ever does. Reservations share half the journal, leaving the rest to
+ * everything else in the group, so the transaction always fits.
+ *
+ * With `wait`, an operation that finds the room taken gives up fs_lock
+ * until the committer has captured what is already reserved, so it must
+ * hold no other lock.
+ *
+ * @returns    0, or EFBIG if the operation is too big for one transaction
+ *             (or finds no room and cannot wait)
+ */
+static int journal_reserve(size_t blocks, bool wait) {
+  size_t budget = disk.sb.journal_blocks / 2;
+  if (disk.fd < 0) {
+    return 0;
+  }
+  if (blocks > budget) {
+    return EFBIG;
+  }
+
+  int err = 0;
+  pthread_mutex_lock( & journal.lock);
+
+  while (journal.reserved + blocks > budget) {
+    if (!wait || !journal.running) {
+      err = EFBIG;
+      break;
+    }
+
+    uint64_t captures = journal.captures;
+    journal.reserve_waiting++;
+    journal.group_closed = true;
+    pthread_cond_signal( & journal.wake);
+    pthread_mutex_unlock( & journal.lock);
+    pthread_rwlock_unlock( & fs_lock);
+
+    pthread_mutex_lock( & journal.lock);
+    while (journal.running && journal.captures == captures) {
+      pthread_cond_wait( & journal.captured, & journal.lock);
+    }
+    journal.reserve_waiting--;
+    pthread_mutex_unlock( & journal.lock);
+
+    pthread_rwlock_rdlock( & fs_lock);
+    pthread_mutex_lock( & journal.lock);
+  }
+
+  if (err == 0) {
+    journal.reserved += blocks;
+  }
+
+  pthread_mutex_unlock( & journal.lock);
+  return err;
+}
+
+static int disk_alloc_bitmap(void) {
+  disk.bitmap = calloc(disk.sb.bitmap_blocks, DISK_BLOCK_SIZE);
+  disk.bitmap_dirty = calloc(disk.sb.bitmap_blocks, sizeof( * disk.bitmap_dirty));
+  disk.reuse_fence = calloc(disk.sb.bitmap_blocks, DISK_BLOCK_SIZE);
+
+  return (disk.bitmap && disk.bitmap_dirty && disk.reuse_fence) ? 0 : ENOMEM;
+}
+
+/**
+ * Lay out an empty filesystem in a new (zero-length) backing file.
+ *
+ * The caller creates the initial inodes and then syncs them out.
+ */
+static int disk_format(const struct assign5_options * options) {
+  uint64_t total = DISK_DEFAULT_BLOCKS;
+
+  if (ftruncate(disk.fd, (off_t) total * DISK_BLOCK_SIZE) != 0) {
+    return errno;
+  }
+
+  memset( & disk.sb, 0, sizeof(disk.sb));
+  disk.sb.magic = DISK_MAGIC;
+  disk.sb.version = DISK_VERSION;
+  disk.sb.block_size = DISK_BLOCK_SIZE;
+  disk.sb.total_blocks = total;
+  disk.sb.free_blocks = total;
+  disk.sb.bitmap_start = 1;
+  disk.sb.bitmap_blocks = (total + DISK_BITS_PER_BLOCK - 1) / DISK_BITS_PER_BLOCK;
+  disk.sb.journal_start = disk.sb.bitmap_start + disk.sb.bitmap_blocks;
+  disk.sb.journal_blocks = JOURNAL_BLOCKS;
+  // Zeroed journal blocks can never look like transaction 0
+  disk.sb.journal_seq = 1;
+
+  journal.seq = disk.sb.journal_seq;
+  journal.head = 0;
+  journal.committed = disk.sb;
+
+  int err = disk_alloc_bitmap();
+  if (err == 0) {
+    err = cache_init(options);
+  }
+  if (err != 0) {
+    return err;
+  }
+
+  // The superblock, the bitmap itself and the journal are never handed out
+  for (uint64_t b = 0; b < disk.sb.journal_start + disk.sb.journal_blocks; b++) {
+    bitmap_set(b, true);
+  }
+
+  // Bits past the end of the device are permanently "used"
+  for (uint64_t b = total; b < disk.sb.bitmap_blocks * DISK_BITS_PER_BLOCK; b++) {
+    disk.bitmap[b / 64] |= 1ull << (b % 64);
+  }
+
+  memset( & disk.itable, 0, sizeof(disk.itable));
+  disk.itable.map_loaded = true;
+  memset( & disk.refs_file, 0, sizeof(disk.refs_file));
+  disk.refs_file.map_loaded = true;
+  memset( & disk.names_file, 0, sizeof(disk.names_file));
+  disk.names_file.map_loaded = true;
+
+  return 0;
+}
+
+/**
+ * Load the filesystem in the backing file: the superblock, the bitmap and
+ * the inode table. File data is left on disk until it is first accessed.
+ *
+ * @returns    0 on success, ENODATA if the backing file is empty (and needs
+ *             formatting) or another errno value
+ */
+static int disk_mount(const struct assign5_options * options) {
+  struct stat st;
+  if (fstat(disk.fd, & st) != 0) {
+    return errno;
+  }
+
+  if (st.st_size == 0) {
+    return ENODATA;
+  }
+
+  char * block = malloc(DISK_BLOCK_SIZE);
+  if (block == NULL) {
+    return ENOMEM;
+  }
+
+  // The superblock says how big the cache has to be, so read it directly
+  int err = disk_io(false, 0, block);
+  memcpy( & disk.sb, block, sizeof(disk.sb));
+  free(block);
+
+  if (err != 0) {
+    return err;
+  }
+
+  // Version 2 predates snapshots and version 3 long names: their
+  // superblocks were written without a refs_map or names_map, which read
+  // as zeroes (no shared blocks, no long names)
+  if (disk.sb.magic != DISK_MAGIC || disk.sb.version < 2 ||
+    disk.sb.version > DISK_VERSION ||
+    disk.sb.block_size != DISK_BLOCK_SIZE ||
+    disk.sb.inode_count > ((uint64_t) INODE_CHUNK_MAX << INODE_CHUNK_SHIFT) ||
+    disk.sb.journal_blocks == 0 ||
+    disk.sb.journal_start + disk.sb.journal_blocks > disk.sb.total_blocks) {
+    return EINVAL;
+  }
+
+  int replayed = journal_replay();
+  if (replayed < 0) {
+    return -replayed;
+  }
+  if (replayed > 0) {
+    fprintf(stderr, "%s: replayed %d journal transaction(s)\n", __func__, replayed);
+  }
+  journal.committed = disk.sb;
+
+  // mmap mode faults on any block past the end of the file
+  uint64_t size = disk.sb.total_blocks * DISK_BLOCK_SIZE;
+  if ((uint64_t) st.st_size < size && ftruncate(disk.fd, (off_t) size) != 0) {
+    return errno;
+  }
+
+  if ((err = disk_alloc_bitmap()) != 0 || (err = cache_init(options)) != 0) {
+    return err;
+  }
+
+  for (uint64_t b = 0; b < disk.sb.bitmap_blocks; b++) {
+    err = disk_read(disk.sb.bitmap_start + b,
+      (char * ) disk.bitmap + b * DISK_BLOCK_SIZE);
+    if (err != 0) {
+      return err;
+    }
+  }
+
+  memset( & disk.itable, 0, sizeof(disk.itable));
+  disk.itable.map = disk.sb.itable_map;
+  disk.itable.size = disk.sb.inode_count * DISK_INODE_SIZE;
+  memset( & disk.names_file, 0, sizeof(disk.names_file));
+  disk.names_file.map = disk.sb.names_map;
+  disk.names_file.size = disk.itable.size;
+
+  for (size_t b = 0; b * DISK_INODES_PER_BLOCK < disk.sb.inode_count; b++) {
+    char * page;
+    if ((err = data_page( & disk.itable, b, false, & page)) != 0) {
+      return err;
+    }
+
+    // This block's part of the name table, read for the first long name
+    char * long_names = NULL;
+
+    for (size_t r = 0; page != NULL && r < DISK_INODES_PER_BLOCK; r++) {
+      const struct disk_inode * rec =
+        (const struct disk_inode * )(page + r * DISK_INODE_SIZE);
+      fuse_ino_t ino = b * DISK_INODES_PER_BLOCK + r;
+
+      if (ino == 0 || rec -> mode == 0) {
+        continue;
+      }
+
+      if (rec -> name_len > DISK_NAME_INLINE && long_names == NULL) {
+        err = data_page( & disk.names_file, b, false, & long_names);
+        if (err == 0 && long_names == NULL) {
+          err = EINVAL;
+        }
+        if (err != 0) {
+          return err;
+        }
+      }
+
+      if ((err = inode_claim(ino)) != 0 ||
+        (err = inode_from_disk(ino, rec, rec -> name_len > DISK_NAME_INLINE ?
+          long_names + r * DISK_NAME_SLOT : NULL)) != 0) {
+        return err;
+      }
+    }
+  }
+
+  data_drop_clean( & disk.itable);
+  data_drop_clean( & disk.names_file);
+  inodes.generation = disk.sb.generation;
+  inode_table_rebuild();
+
+  if ((err = refs_load()) != 0) {
+    return err;
+  }
+
+  if (!inode_exists(ROOT_DIR)) {
+    return EINVAL;
+  }
+
+  // Left behind by a crash while the kernel held them
+  orphans_free();
+  return link_loaded_inodes();
+}
+
+static void disk_release(void) {
+  journal_release();
+  cache_release();
+  data_release( & disk.itable);
+  data_release( & disk.refs_file);
+  data_release( & disk.names_file);
+  free(disk.refs);
+  free(disk.refs_dirty);
+  free(disk.bitmap);
+  free(disk.bitmap_dirty);
+  free(disk.reuse_fence);
+  free(disk.itable_dirty);
+  free(disk.dirty_files);
+  memset( & disk, 0, sizeof(disk));
+  disk.fd = -1;
+}
+
+static void tables_init(void) {
+  inodes.chunks = calloc(INODE_CHUNK_MAX, sizeof( * inodes.chunks));
+  inodes.chunk_count = 0;
+  inodes.alloc_hint = 0;
+  inodes.live = 0;
+  inodes.orphans = 0;
+  inodes.pages = 0;
+  inodes.generation = 0;
+
+  dir_index.bucket_count = INDEX_MIN_BUCKETS;
+  dir_index.buckets = calloc(dir_index.bucket_count, sizeof( * dir_index.buckets));
+  dir_index.entries = 0;
+}
+
+static void tables_release(void) {
+  for (size_t i = 0; i < inodes.chunk_count; i++) {
+    struct inode_chunk * chunk = inodes.chunks[i];
+    if (chunk == NULL) {
+      continue;
+    }
+
+    for (size_t j = 0; j < INODE_CHUNK_SIZE; j++) {
+      data_release( & chunk -> data[j]);
+      free(chunk -> meta[j].xattr_spill);
+    }
+    chunk_free(chunk);
+  }
+
+  free(inodes.chunks);
+  inodes.chunks = NULL;
+  inodes.chunk_count = 0;
+  inodes.live = 0;
+  free(dir_index.buckets);
+  dir_index.buckets = NULL;
+  dir_index.bucket_count = 0;
+  dir_index.entries = 0;
+  names_release();
+
+  // Releasing every file's pages has emptied the dedup table
+  free(dedup.buckets);
+  dedup.buckets = NULL;
+  dedup.bucket_count = 0;
+  free(dedup.candidates);
+  dedup.candidates = NULL;
+}
+
+static uint64_t clock_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, & now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Account for an operation on `ino` (or in directory `ino`) that started at
+ * `start_ns`, and trace it if tracing is on.
+ */
+static void op_done(enum op_id op, fuse_ino_t ino, uint64_t start_ns) {
+  uint64_t latency = clock_ns() - start_ns;
+  struct op_stats * stats = & op_stats[op];
+
+  int bucket = 63 - __builtin_clzll(latency | 1);
+  if (bucket >= STATS_BUCKETS) {
+    bucket = STATS_BUCKETS - 1;
+  }
+
+  __atomic_add_fetch( & stats -> calls, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch( & stats -> total_ns, latency, __ATOMIC_RELAXED);
+  __atomic_add_fetch( & stats -> buckets[bucket], 1, __ATOMIC_RELAXED);
+
+  uint64_t max = __atomic_load_n( & stats -> max_ns, __ATOMIC_RELAXED);
+  while (latency > max && !__atomic_compare_exchange_n( & stats -> max_ns,
+      & max, latency, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+
+  if (trace.records == NULL) {
+    return;
+  }
+
+  uint64_t seq = __atomic_fetch_add( & trace.head, 1, __ATOMIC_RELAXED);
+  struct trace_record * record = & trace.records[seq & trace.mask];
+
+  __atomic_store_n( & record -> seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  record -> start_ns = start_ns;
+  record -> latency_ns = latency;
+  record -> ino = ino;
+  record -> op = op;
+  __atomic_store_n( & record -> seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Keep the last `entries` operations (rounded up to a power of two) for
+ * /.trace; 0 leaves tracing off.
+ */
+static void trace_start(unsigned entries) {
+  if (entries == 0) {
+    return;
+  }
+
+  size_t size = 1;
+  while (size < entries) {
+    size *= 2;
+  }
+
+  trace.records = calloc(size, sizeof( * trace.records));
+  if (trace.records == NULL) {
+    fprintf(stderr, "%s: no memory for %zu trace records\n", __func__, size);
+    return;
+  }
+  trace.mask = size - 1;
+  trace.head = 0;
+}
+
+static void trace_stop(void) {
+  free(trace.records);
+  trace.records = NULL;
+  trace.mask = 0;
+  trace.head = 0;
+}
+
+static void stats_report(FILE * out) {
+  fprintf(out, "%-12s %12s %12s %12s\n", "operation", "calls", "avg_ns",
+    "max_ns");
+
+  for (int op = 0; op < OP_COUNT; op++) {
+    uint64_t calls = __atomic_load_n( & op_stats[op].calls, __ATOMIC_RELAXED);
+    if (calls > 0) {
+      fprintf(out, "%-12s %12lu %12lu %12lu\n", op_names[op],
+        (unsigned long) calls,
+        (unsigned long)(__atomic_load_n( & op_stats[op].total_ns,
+          __ATOMIC_RELAXED) / calls),
+        (unsigned long) __atomic_load_n( & op_stats[op].max_ns,
+          __ATOMIC_RELAXED));
+    }
+  }
+
+  for (int op = 0; op < OP_COUNT; op++) {
+    if (__atomic_load_n( & op_stats[op].calls, __ATOMIC_RELAXED) == 0) {
+      continue;
+    }
+
+    fprintf(out, "\n%s latency (ns):\n", op_names[op]);
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+      uint64_t count = __atomic_load_n( & op_stats[op].buckets[b],
+        __ATOMIC_RELAXED);
+      if (count > 0) {
+        fprintf(out, "  >= %-14lu %12lu\n",
+          b ? (unsigned long) 1 << b : 0ul, (unsigned long) count);
+      }
+    }
+  }
+
+  fprintf(out, "\ninodes: %zu live, %zu orphaned\n",
+    __atomic_load_n( & inodes.live, __ATOMIC_RELAXED),
+    __atomic_load_n( & inodes.orphans, __ATOMIC_RELAXED));
+  names_report(out);
+
+  if (dedup.enabled) {
+    fprintf(out, "\n");
+    dedup_report(out);
+  }
+
+  if (compress.idle != 0) {
+    fprintf(out, "\n");
+    compress_report(out);
+  }
+
+  if (disk.fd >= 0) {
+    fprintf(out, "\n");
+    pthread_mutex_lock( & cache_lock);
+    cache_report(out);
+    pthread_mutex_unlock( & cache_lock);
+    journal_report(out);
+  }
+}
+
+/**
+ * Write out the trace ring, oldest record first, as
+ * "start_ns operation inode latency_ns" lines.
+ */
+static void trace_report(FILE * out) {
+  if (trace.records == NULL) {
+    fprintf(out, "tracing is off (mount with -o trace=N)\n");
+    return;
+  }
+
+  uint64_t head = __atomic_load_n( & trace.head, __ATOMIC_ACQUIRE);
+  uint64_t first = head > trace.mask + 1 ? head - trace.mask - 1 : 0;
+
+  for (uint64_t seq = first; seq < head; seq++) {
+    struct trace_record * slot = & trace.records[seq & trace.mask];
+    if (__atomic_load_n( & slot -> seq, __ATOMIC_ACQUIRE) != seq + 1) {
+      continue;
+    }
+
+    struct trace_record record = * slot;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    // Skip records that were overwritten while we copied them
+    if (__atomic_load_n( & slot -> seq, __ATOMIC_RELAXED) != seq + 1) {
+      continue;
+    }
+
+    fprintf(out, "%lu %s %lu %lu\n", (unsigned long) record.start_ns,
+      op_names[record.op], (unsigned long) record.ino,
+      (unsigned long) record.latency_ns);
+  }
+}
+
+static void snapshot_report(FILE * out) {
+  fprintf(out, "snapshots: %lu taken, %lu files and %lu directories cloned\n"
+    "shared: %lu blocks, %lu pages; copied: %lu pages\n"
+    "usage: echo SOURCE DEST > /.snapshot (paths from the mount point)\n",
+    (unsigned long) __atomic_load_n( & snapshot.taken, __ATOMIC_RELAXED),
+    (unsigned long) __atomic_load_n( & snapshot.files, __ATOMIC_RELAXED),
+    (unsigned long) __atomic_load_n( & snapshot.directories, __ATOMIC_RELAXED),
+    (unsigned long) __atomic_load_n( & snapshot.shared_blocks, __ATOMIC_RELAXED),
+    (unsigned long) __atomic_load_n( & snapshot.shared_pages, __ATOMIC_RELAXED),
+    (unsigned long) __atomic_load_n( & snapshot.copied_pages, __ATOMIC_RELAXED));
+}
+
+static const struct synthetic_file synthetic_files[] = {
+  { ".snapshot", snapshot_report, snapshot_command },
+  { ".stats", stats_report, NULL },
+  { ".trace", trace_report, NULL },
+};
+
+#define SYNTHETIC_COUNT (sizeof(synthetic_files) / sizeof(synthetic_files[0]))
+
+/**
+ * Look up the synthetic file called `name` in `parent`, storing its inode
+ * number in `ino` (if not NULL).
+ *
+ * @returns    the file, or NULL if there is none
+ */
+static const struct synthetic_file * synthetic_find(fuse_ino_t parent,
+  const char * name, fuse_ino_t * ino) {
+  if (parent != ROOT_DIR) {
+    return NULL;
+  }
+
+  for (size_t i = 0; i < SYNTHETIC_COUNT; i++) {
+    if (strcmp(synthetic_files[i].name, name) == 0) {
+      if (ino != NULL) {
+        * ino = SYNTHETIC_INO_BASE + i;
+      }
+      return & synthetic_files[i];
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * @returns    the synthetic file with inode number `ino`, or NULL
+ */
+static const struct synthetic_file * synthetic_get(fuse_ino_t ino) {
+  if (ino < SYNTHETIC_INO_BASE || ino >= SYNTHETIC_INO_BASE + SYNTHETIC_COUNT) {
+    return NULL;
+  }
+
+  return & synthetic_files[ino - SYNTHETIC_INO_BASE];
+}
+
+/**
+ * Synthetic files have no size: they are opened with direct_io, so the
+ * kernel reads until end-of-file rather than trusting st_size.
+ */
+static void synthetic_stat(fuse_ino_t ino, struct stat * attr) {
+  memset(attr, 0, sizeof( * attr));
+  attr -> st_ino = ino;
+  attr -> st_mode = S_IFREG | AllRead |
+    (synthetic_get(ino) -> command ? S_IWUSR : 0);
+  attr -> st_nlink = 1;
+}
+
+/**
+ * Open a synthetic file by generating its contents.
+ */
+static void synthetic_open(fuse_req_t req, const struct synthetic_file * file,
+  struct fuse_file_info * fi) {
+  if ((fi -> flags & 3) != O_RDONLY && file -> command == NULL) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+
+  struct synthetic_handle * handle = calloc(1, sizeof( * handle));
+  FILE * out = handle ? open_memstream( & handle -> data, & handle -> size) : NULL;
+  if (out == NULL) {
+    free(handle);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  file -> generate(out);
+  fclose(out);
+
+  fi -> fh = (uintptr_t) handle;
+  fi -> direct_io = 1;
+  if (fuse_reply_open(req, fi) != 0) {
+    free(handle -> data);
+    free(handle);
+  }
+}
+
+static void synthetic_read(fuse_req_t req, size_t size, off_t off,
+  struct fuse_file_info * fi) {
+  struct synthetic_handle * handle = (struct synthetic_handle * )(uintptr_t) fi -> fh;
+
+  if (off < 0 || (size_t) off >= handle -> size) {
+    size = 0;
+  } else if (size > handle -> size - off) {
+    size = handle -> size - off;
+  }
+
+  fuse_reply_buf(req, size ? handle -> data + off : NULL, size);
+}
+
+/**
+ * Run a write to a command file as one command, replying once its changes
+ * are durable.
+ */
+static void synthetic_write(fuse_req_t req, const struct synthetic_file * file,
+  const char * buf, size_t size, struct fuse_file_info * fi) {
+  if ((fi -> flags & 3) == O_RDONLY || file -> command == NULL) {
+    fuse_reply_err(req, EBADF);
+    return;
+  }
+
+  char * args = malloc(size + 1);
+  if (args == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  memcpy(args, buf, size);
+  args[size] = '\0';
+
+  int err = file -> command(args);
+  free(args);
+
+  if (err != 0) {
+    fuse_reply_err(req, err);
+  } else {
+    journal_reply_write(req, size);
+  }
+}
+
+/**
+ * Create the root directory and the read-only assignment files.
+ */
+static void create_initial_files(void) {
+  struct {
+    fuse_ino_t ino;
+    mode_t mode;
+    int is_directory;
+    fuse_ino_t parent_inode;
+    const char * name;
+  }
+  init_files[] = {
+    {
+      ROOT_DIR,
+      S_IFDIR | AllPermissions | AllPermissions,
+      1,
+      -1,
+      "root"
+    },
+    {
+      ASSIGN_DIR,
+      S_IFDIR | AllRead | AllExec,
+      0,
+      ROOT_DIR,
+      "assignment"
+    },
+    {
+      USERNAME_FILE,
+      S_IFREG | AllRead,
+      0,
+      ASSIGN_DIR,
+      "username"
+    },
+    {
+      FEATURE_FILE,
+      S_IFREG | AllRead,
+      0,
+      ASSIGN_DIR,
+      "feature"
+    },
+  };
+
+  for (int i = 0; i < 4; ++i) {
+    fuse_ino_t ino = inode_alloc();
+    assert(ino == init_files[i].ino);
+
+    struct file_node * node = inode_node(ino);
+    struct stat * stat = inode_stat(ino);
+
+    stat -> st_mode = init_files[i].mode;
+    stat -> st_nlink = 1;
+    node -> type = init_files[i].mode & S_IFMT;
+    node -> is_directory = init_files[i].is_directory;
+    node -> parent_inode = init_files[i].parent_inode;
+    node -> name = name_intern(init_files[i].name, strlen(init_files[i].name));
+    assert(node -> name != NULL);
+    index_insert(init_files[i].ino);
+    if (init_files[i].ino != ROOT_DIR) {
+      child_link(init_files[i].ino);
+    }
+
+    // The built-in files are served from ordinary pages like any other file
+    if (init_files[i].ino == USERNAME_FILE) {
+      data_write(inode_data(ino), UsernameContent, strlen(UsernameContent), 0);
+    } else if (init_files[i].ino == FEATURE_FILE) {
+      data_write(inode_data(ino), FeaturesContents, strlen(FeaturesContents), 0);
+    }
+    stat -> st_size = inode_data(ino) -> size;
+    file_dirty(ino);
+  }
+}
+
+static void assign5_init(void * userdata, struct fuse_conn_info * conn) {
+  struct backing_file * backing = userdata;
+  fprintf(stderr, "*** %s '%s'\n", __func__, backing -> bf_path);
+
+  // Truncate in open() rather than in a separate setattr round trip
+  if (conn -> capable & FUSE_CAP_ATOMIC_O_TRUNC) {
+    conn -> want |= FUSE_CAP_ATOMIC_O_TRUNC;
+  }
+
+  // Take writes in as few requests as the kernel allows and let reads
+  // overlap
+  if (conn -> capable & FUSE_CAP_ASYNC_READ) {
+    conn -> want |= FUSE_CAP_ASYNC_READ;
+  }
+  conn -> max_write = WRITE_MAX;
+  conn -> max_readahead = WRITE_MAX;
+
+  // On request, let the kernel gather small writes in its page cache and
+  // send them back in large batches (large writes get slower, though)
+  writeback_cache = backing -> bf_options.ao_writeback_cache &&
+    (conn -> capable & FUSE_CAP_WRITEBACK_CACHE);
+  if (writeback_cache) {
+    conn -> want |= FUSE_CAP_WRITEBACK_CACHE;
+  }
+
+  // Return attributes with directory entries, so that `ls -l` doesn't need
+  // a lookup for every name
+  if (conn -> capable & FUSE_CAP_READDIRPLUS) {
+    conn -> want |= FUSE_CAP_READDIRPLUS;
+  }
+
+  // A steady stream of readers must not keep the committer out forever
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init( & attr);
+  pthread_rwlockattr_setkind_np( & attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init( & fs_lock, & attr);
+  pthread_rwlockattr_destroy( & attr);
+
+  memset(op_stats, 0, sizeof(op_stats));
+  memset( & snapshot, 0, sizeof(snapshot));
+  dedup.enabled = backing -> bf_options.ao_dedup;
+  dedup.hashed = dedup.collisions = dedup.copies = 0;
+  trace_start(backing -> bf_options.ao_trace_entries);
+  notify_start(backing -> bf_session);
+  tables_init();
+
+  disk.fd = backing -> bf_fd;
+  if (disk.fd >= 0) {
+    int err = disk_mount( & backing -> bf_options);
+    if (err == 0) {
+      journal_start( & backing -> bf_options);
+      compress_start( & backing -> bf_options);
+      return;
+    }
+
+    if (err == ENODATA) {
+      err = disk_format( & backing -> bf_options);
+    }
+
+    if (err != 0) {
+      // Never overwrite a backing file we don't understand
+      fprintf(stderr, "%s: cannot use '%s' (%s), running from memory\n",
+        __func__, backing -> bf_path, strerror(err));
+      disk_release();
+      tables_release();
+      tables_init();
+    }
+  }
+
+  create_initial_files();
+
+  int err = disk_sync();
+  if (err != 0) {
+    fprintf(stderr, "%s: failed to format '%s': %s\n", __func__,
+      backing -> bf_path, strerror(err));
+  }
+
+  journal_start( & backing -> bf_options);
+  compress_start( & backing -> bf_options);
+}
+
+static void assign5_destroy(void * userdata) {
+  struct backing_file * backing = userdata;
+  fprintf(stderr, "*** %s %d\n", __func__, backing -> bf_fd);
+
+  notify_stop();
+  compress_stop();
+  journal_stop();
+
+  // The kernel has forgotten everything, so no orphan needs keeping
+  orphans_free();
+  int err = disk_sync();
+  if (err != 0) {
+    fprintf(stderr, "%s: failed to sync '%s': %s\n", __func__,
+      backing -> bf_path, strerror(err));
+  }
+
+  if (disk.fd >= 0) {
+    cache_report(stderr);
+    journal_report(stderr);
+  }
+
+  tables_release();
+  disk_release();
+  trace_stop();
+  pthread_rwlock_destroy( & fs_lock);
+}
+
+/**
+ * Give an open of regular file `ino` (write-locked) its handle, allocated
+ * before anything was changed so that the open can't fail half-way, and
+ * decide how the kernel may cache the file's pages: O_DIRECT bypasses the
+ * page cache, and otherwise what the kernel already has stays valid unless
+ * the file has changed since it was last opened.
+ */
+static void open_file_init(struct open_file * handle, fuse_ino_t ino,
+  struct fuse_file_info * fi) {
+  handle -> ino = ino;
+  handle -> generation = inode_meta(ino) -> generation;
+  handle -> data = inode_data(ino);
+  handle -> writable = (fi -> flags & O_ACCMODE) != O_RDONLY;
+  // With the writeback cache, the kernel works out where appends go
+  handle -> append = !writeback_cache && (fi -> flags & O_APPEND) != 0;
+
+  fi -> fh = (uintptr_t) handle;
+  fi -> direct_io = (fi -> flags & O_DIRECT) != 0;
+  fi -> keep_cache = handle -> data -> version == handle -> data -> open_version;
+  handle -> data -> open_version = handle -> data -> version;
+}
+
+/**
+ * Lock the file behind an open handle (exclusively if `write`), checking
+ * that its inode hasn't been freed and handed out again since the open.
+ *
+ * @returns    the handle, or NULL (with nothing locked) if the file is gone
+ */
+static struct open_file * open_file_lock(fuse_ino_t ino,
+  struct fuse_file_info * fi, bool write) {
+  struct open_file * handle = (struct open_file * )(uintptr_t) fi -> fh;
+  if (handle == NULL || handle -> ino != ino || !inode_lock_live(ino, write)) {
+    return NULL;
+  }
+
+  if (inode_meta(ino) -> generation != handle -> generation) {
+    inode_unlock(ino);
+    return NULL;
+  }
+
+  return handle;
+}
+
+/**
+ * Check that `name` can be added to `parent`.
+ *
+ * @returns    0 if the entry can be created (with `parent` write-locked), or
+ *             an errno value
+ */
+static int lock_new_entry(fuse_ino_t parent, const char * name) {
+  int err = 0;
+
+  if (!inode_lock_live(parent, true)) {
+    err = ENOENT;
+  } else {
+    if (!S_ISDIR(inode_stat(parent) -> st_mode)) {
+      err = ENOTDIR;
+    } else if (inode_stat(parent) -> st_nlink == 0) {
+      // Removed, but still held by the kernel
+      err = ENOENT;
+    } else if (strlen(name) > FILE_NAME_MAX) {
+      err = ENAMETOOLONG;
+    } else if (synthetic_find(parent, name, NULL) != NULL) {
+      err = EEXIST;
+    } else {
+      pthread_rwlock_rdlock( & dir_index.lock);
+      if (index_find(parent, name) != 0) {
+        err = EEXIST;
+      }
+      pthread_rwlock_unlock( & dir_index.lock);
+    }
+
+    if (err != 0) {
+      inode_unlock(parent);
+    }
+  }
+
+  return err;
+}
+
+/**
+ * Like lock_new_entry(), but reply with the error if there is one.
+ */
+static int check_new_entry(fuse_req_t req, fuse_ino_t parent, const char * name) {
+  int err = lock_new_entry(parent, name);
+  if (err != 0) {
+    fuse_reply_err(req, err);
+  }
+
+  return err;
+}
+
+/**
+ * Allocate the inode for new entry `name` in a parent locked by
+ * lock_new_entry(), and give it the name. Unlocks the parent if that fails.
+ *
+ * @returns    0 with the new inode (write-locked) in `ino`, or an errno value
+ */
+static int alloc_entry_inode(fuse_ino_t parent, const char * name, fuse_ino_t * ino) {
+  const char * interned = name_intern(name, strlen(name));
+  if (interned == NULL) {
+    inode_unlock(parent);
+    return ENOMEM;
+  }
+
+  if (( * ino = inode_alloc()) == 0) {
+    name_release(interned);
+    inode_unlock(parent);
+    return ENOSPC;
+  }
+
+  pthread_rwlock_wrlock(inode_lock( * ino));
+  inode_node( * ino) -> name = interned;
+  return 0;
+}
+
+/**
+ * Like alloc_entry_inode(), but reply with the error if there is one.
+ *
+ * @returns    the new inode (write-locked), or 0
+ */
+static fuse_ino_t new_entry_inode(fuse_req_t req, fuse_ino_t parent,
+  const char * name) {
+  fuse_ino_t ino;
+  int err = alloc_entry_inode(parent, name, & ino);
+  if (err != 0) {
+    fuse_reply_err(req, err);
+    return 0;
+  }
+
+  return ino;
+}
+
+/**
+ * Publish a freshly-initialized inode, named by alloc_entry_inode(), in the
+ * directory index.
+ */
+static void add_file_entry(fuse_ino_t ino, fuse_ino_t parent, bool is_directory) {
+  inode_node(ino) -> type = inode_stat(ino) -> st_mode & S_IFMT;
+  inode_node(ino) -> is_directory = is_directory;
+  inode_node(ino) -> parent_inode = parent;
+  inode_node(ino) -> first_child = 0;
+  inode_meta(ino) -> last_child = 0;
+  inode_meta(ino) -> next_cookie = DIR_COOKIE_FIRST;
+  index_insert(ino);
+  child_link(ino);
+  inode_changed(parent);
+}
+
+static void assign5_create(fuse_req_t req, fuse_ino_t parent, const char * name, mode_t mode, struct fuse_file_info * fi) {
+  if (parent == ASSIGN_DIR) {
+    // Files cannot be created in the assignment directory
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+
+  // Nothing may fail once the entry exists
+  struct open_file * handle = malloc(sizeof( * handle));
+  if (handle == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  if (check_new_entry(req, parent, name) != 0) {
+    free(handle);
+    return;
+  }
+
+  struct fuse_entry_param dirent;
+  fuse_ino_t ino = new_entry_inode(req, parent, name);
+  if (ino == 0) {
+    free(handle);
+    return;
+  }
+
+  stat_write_begin(ino);
+  inode_stat(ino) -> st_mode = S_IFREG | mode;
+  inode_stat(ino) -> st_size = 0;
+  inode_stat(ino) -> st_nlink = 1;
+  stat_write_end(ino);
+
+  add_file_entry(ino, parent, false);
+  open_file_init(handle, ino, fi);
+
+  dirent.generation = inode_meta(ino) -> generation;
+  dirent.attr_timeout = inode_timeout(ino);
+  dirent.entry_timeout = inode_timeout(ino);
+  dirent.ino = ino;
+  dirent.attr = * inode_stat(ino);
+  lookup_get(ino);
+
+  inode_unlock(ino);
+  inode_unlock(parent);
+  journal_reply_entry(req, & dirent, fi);
+}
+
+/**
+ * Drop `count` kernel references to `ino`, freeing it if it was an orphan
+ * and these were the last. Called with fs_lock held.
+ */
+static void inode_forget(fuse_ino_t ino, uint64_t count) {
+  if (synthetic_get(ino) != NULL || !inode_exists(ino) ||
+    !lookup_put(ino, count)) {
+    return;
+  }
+
+  // The flag (unlike the count) is only set with the inode locked, and a
+  // recycled number starts with it clear
+  if (inode_lock_live(ino, true)) {
+    struct file_meta * meta = inode_meta(ino);
+    if (meta -> orphaned && __atomic_load_n( & meta -> nlookup, __ATOMIC_RELAXED) == 0) {
+      inode_free(ino);
+      __atomic_sub_fetch( & inodes.orphans, 1, __ATOMIC_RELAXED);
+    }
+    inode_unlock(ino);
+  }
+}
+
+/**
+ * The kernel has dropped `nlookup` references to `ino`.
+ */
+static void
+assign5_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+  inode_forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+/**
+ * A batch of forgets, as the kernel sends when it evicts many inodes at
+ * once: one request (and one trip through fs_lock) for all of them, with
+ * the orphans whose last reference goes freed as part of the batch.
+ */
+static void
+assign5_forget_multi(fuse_req_t req, size_t count,
+  struct fuse_forget_data * forgets) {
+  for (size_t i = 0; i < count; i++) {
+    inode_forget(forgets[i].ino, forgets[i].nlookup);
+  }
+  fuse_reply_none(req);
+}
+
+static void
+assign5_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fip) {
+  // No locks: a consistent copy is all getattr needs
+  struct stat attr;
+  if (synthetic_get(ino) != NULL) {
+    synthetic_stat(ino, & attr);
+  } else if (!inode_stat_copy(ino, & attr)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  int result = fuse_reply_attr(req, & attr, inode_timeout(ino));
+  if (result != 0) {
+    fprintf(stderr, "Failed to send attr reply\n");
+  }
+}
+
+static void
+assign5_lookup(fuse_req_t req, fuse_ino_t parent, const char * name) {
+  struct fuse_entry_param dirent;
+  fuse_ino_t ino;
+
+  if (synthetic_find(parent, name, & ino) != NULL) {
+    synthetic_stat(ino, & dirent.attr);
+    dirent.generation = 0;
+  } else {
+    // The index lock keeps the entry from being removed (and its inode
+    // reused) until the reply has been filled in
+    pthread_rwlock_rdlock( & dir_index.lock);
+    ino = index_find(parent, name);
+    if (ino != 0) {
+      ino = entry_inode(ino);
+    }
+    if (ino != 0 && inode_stat_copy(ino, & dirent.attr)) {
+      dirent.generation = inode_meta(ino) -> generation;
+      lookup_get(ino);
+    } else {
+      ino = 0;
+    }
+    pthread_rwlock_unlock( & dir_index.lock);
+  }
+
+  if (ino == 0) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  dirent.attr_timeout = inode_timeout(ino);
+  dirent.entry_timeout = inode_timeout(ino);
+  dirent.ino = ino;
+
+  int result = fuse_reply_entry(req, & dirent);
+  if (result != 0) {
+    fprintf(stderr, "Failed to send dirent reply\n");
+    inode_forget(ino, 1);
+  }
+}
+
+static void assign5_mkdir(fuse_req_t req, fuse_ino_t parent, const char * name, mode_t mode) {
+  if (parent == ASSIGN_DIR) {
+    // Directories cannot be created in the assignment directory
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+
+  if (check_new_entry(req, parent, name) != 0) {
+    return;
+  }
+
+  struct fuse_entry_param dirent;
+  fuse_ino_t ino = new_entry_inode(req, parent, name);
+  if (ino == 0) {
+    return;
+  }
+
+  stat_write_begin(ino);
+  inode_stat(ino) -> st_mode = S_IFDIR | AllPermissions | AllPermissions;
+  inode_stat(ino) -> st_nlink = 1;
+  stat_write_end(ino);
+
+  add_file_entry(ino, parent, true);
+
+  dirent.generation = inode_meta(ino) -> generation;
+  dirent.attr_timeout = inode_timeout(ino);
+  dirent.entry_timeout = inode_timeout(ino);
+  dirent.ino = ino;
+  dirent.attr = * inode_stat(ino);
+  lookup_get(ino);
+
+  inode_unlock(ino);
+  inode_unlock(parent);
+  journal_reply_entry(req, & dirent, NULL);
+}
+
+static void
+assign5_mknod(fuse_req_t req, fuse_ino_t parent,
+  const char * name,
+    mode_t mode, dev_t rdev) {
+  if (parent == ASSIGN_DIR) {
+    // Nodes cannot be created in the assignment directory
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+
+  if (check_new_entry(req, parent, name) != 0) {
+    return;
+  }
+
+  struct fuse_entry_param dirent;
+  fuse_ino_t ino = new_entry_inode(req, parent, name);
+  if (ino == 0) {
+    return;
+  }
+
+  stat_write_begin(ino);
+  inode_stat(ino) -> st_mode = mode;
+  inode_stat(ino) -> st_nlink = 1;
+  stat_write_end(ino);
+  add_file_entry(ino, parent, S_ISDIR(mode));
+
+  dirent.generation = inode_meta(ino) -> generation;
+  dirent.attr_timeout = inode_timeout(ino);
+  dirent.entry_timeout = inode_timeout(ino);
+  dirent.ino = ino;
+  dirent.attr = * inode_stat(ino);
+  lookup_get(ino);
+
+  inode_unlock(ino);
+  inode_unlock(parent);
+  journal_reply_entry(req, & dirent, NULL);
+}
+
+/**
+ * Give `ino` another name: an entry in `newparent` that refers to it.
+ */
+static void
+assign5_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+  const char * newname) {
+  if (newparent == ASSIGN_DIR || inode_immutable(ino) || synthetic_get(ino) != NULL) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+
+  if (check_new_entry(req, newparent, newname) != 0) {
+    return;
+  }
+
+  // Like unlink, lock the entry before the inode it names
+  fuse_ino_t entry = new_entry_inode(req, newparent, newname);
+  if (entry == 0) {
+    return;
+  }
+
+  int err = 0;
+  bool locked = inode_lock_live(ino, true);
+  if (!locked) {
+    err = ENOENT;
+  } else if (S_ISDIR(inode_stat(ino) -> st_mode)) {
+    err = EPERM;
+  } else if (inode_stat(ino) -> st_nlink == 0) {
+    // An orphan can't be given a name again
+    err = ENOENT;
+  } else if (inode_stat(ino) -> st_nlink >= FILE_LINK_MAX) {
+    err = EMLINK;
+  }
+
+  if (err != 0) {
+    if (locked) {
+      inode_unlock(ino);
+    }
+    inode_free(entry);
+    inode_unlock(entry);
+    inode_unlock(newparent);
+    fuse_reply_err(req, err);
+    return;
+  }
+
+  stat_write_begin(entry);
+  inode_stat(entry) -> st_mode = inode_stat(ino) -> st_mode & S_IFMT;
+  stat_write_end(entry);
+  inode_node(entry) -> link_target = ino;
+  add_file_entry(entry, newparent, false);
+  inode_unlock(entry);
+
+  stat_write_begin(ino);
+  inode_stat(ino) -> st_nlink++;
+  stat_write_end(ino);
+  inode_dirty(ino);
+
+  struct fuse_entry_param dirent;
+  dirent.generation = inode_meta(ino) -> generation;
+  dirent.attr_timeout = inode_timeout(ino);
+  dirent.entry_timeout = inode_timeout(ino);
+  dirent.ino = ino;
+  dirent.attr = * inode_stat(ino);
+  lookup_get(ino);
+
+  inode_unlock(ino);
+  inode_unlock(newparent);
+  journal_reply_entry(req, & dirent, NULL);
+}
+
+static void
+assign5_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi) {
+  const struct synthetic_file * synthetic = synthetic_get(ino);
+  if (synthetic != NULL) {
+    synthetic_open(req, synthetic, fi);
+    return;
+  }
+
+  // Allocated first, so that an O_TRUNC open can't fail after truncating
+  struct open_file * handle = malloc(sizeof( * handle));
+  if (handle == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  if (!inode_lock_live(ino, true)) {
+    free(handle);
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  bool writable = (fi -> flags & O_ACCMODE) != O_RDONLY;
+  bool truncate = writable && (fi -> flags & O_TRUNC);
+  int err = 0;
+
+  if (!S_ISREG(inode_stat(ino) -> st_mode)) {
+    err = EISDIR;
+  } else if (writable && inode_immutable(ino)) {
+    err = EACCES;
+  } else if (truncate && (err = data_truncate(inode_data(ino), 0)) == 0) {
+    stat_write_begin(ino);
+    inode_stat(ino) -> st_size = 0;
+    stat_write_end(ino);
+    inode_dirty(ino);
+    file_dirty(ino);
+  }
+
+  if (err == 0) {
+    open_file_init(handle, ino, fi);
+  }
+  inode_unlock(ino);
+
+  if (err != 0) {
+    free(handle);
+    fuse_reply_err(req, err);
+  } else if (truncate) {
+    journal_reply_open(req, fi);
+  } else if (fuse_reply_open(req, fi) != 0) {
+    free((struct open_file * )(uintptr_t) fi -> fh);
+  }
+}
+
+static void
+assign5_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi) {
+  struct stat attr;
+  if (!inode_stat_copy(ino, & attr) || !S_ISDIR(attr.st_mode)) {
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+
+  struct dir_handle * handle = calloc(1, sizeof( * handle));
+  if (handle == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  fi -> fh = (uintptr_t) handle;
+  fuse_reply_open(req, fi);
+}
+
+static void
+assign5_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi) {
+  if (synthetic_get(ino) != NULL) {
+    struct synthetic_handle * handle =
+      (struct synthetic_handle * )(uintptr_t) fi -> fh;
+    free(handle -> data);
+    free(handle);
+  } else {
+    free((struct open_file * )(uintptr_t) fi -> fh);
+  }
+
+  fi -> fh = 0;
+  fuse_reply_err(req, 0);
+}
+
+static void
+assign5_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi) {
+  free((struct dir_handle * )(uintptr_t) fi -> fh);
+  fi -> fh = 0;
+  fuse_reply_err(req, 0);
+}
+
+/**
+ * Find the first child of `dir` whose cookie is greater than `off`.
+ *
+ * Sequential readdir resumes from the opendir handle in O(1); only a seekdir
+ * or the removal of the resume entry falls back to walking the child list.
+ */
+static fuse_ino_t readdir_resume(fuse_ino_t dir, off_t off,
+  struct dir_handle * handle) {
+  if (handle != NULL && inode_exists(handle -> resume_ino) &&
+    handle -> resume_cookie > off) {
+    struct file_node * node = inode_node(handle -> resume_ino);
+    fuse_ino_t prev_ino = inode_meta(handle -> resume_ino) -> prev_sibling;
+    struct file_node * prev = prev_ino ? inode_node(prev_ino) : NULL;
+
+    if (node -> parent_inode == dir &&
+      node -> dir_cookie == handle -> resume_cookie &&
+      (prev == NULL || prev -> dir_cookie <= off)) {
+      return handle -> resume_ino;
+    }
+  }
+
+  fuse_ino_t child = inode_node(dir) -> first_child;
+  while (child != 0 && inode_node(child) -> dir_cookie <= off) {
+    child = inode_node(child) -> next_sibling;
+  }
+
+  return child;
+}
+
+/**
+ * Add an entry for `name`, which refers to `ino`, to a readdirplus reply,
+ * with everything a lookup would have returned. The kernel takes a
+ * reference for every entry but "." and "..", which is counted here and
+ * reported through `referenced`.
+ *
+ * @returns    the space the entry needs, which is more than `size` if it
+ *             was not added
+ */
+static size_t readdirplus_add(fuse_req_t req, char * buf, size_t size,
+  const char * name, fuse_ino_t ino, mode_t type, off_t cookie,
+  bool * referenced) {
+  struct fuse_entry_param entry = {
+    .ino = ino
+  };
+
+  if (inode_stat_copy(ino, & entry.attr)) {
+    entry.generation = inode_meta(ino) -> generation;
+    entry.attr_timeout = inode_timeout(ino);
+    entry.entry_timeout = inode_timeout(ino);
+  } else {
+    // Still listed, but with no entry for the kernel to cache
+    entry.ino = 0;
+    entry.attr.st_ino = ino;
+    entry.attr.st_mode = type;
+  }
+
+  size_t entry_size = fuse_add_direntry_plus(req, buf, size, name, & entry,
+    cookie);
+
+  * referenced = entry_size <= size && entry.ino != 0 &&
+    cookie >= DIR_COOKIE_FIRST;
+  if ( * referenced) {
+    lookup_get(ino);
+  }
+  return entry_size;
+}
+
+/**
+ * Fill a readdir reply or, with `plus`, a readdirplus reply (whose entries
+ * also carry attributes), in one pass over the directory's child list.
+ */
+static void readdir_fill(fuse_req_t req, fuse_ino_t ino, size_t size,
+  off_t off, struct fuse_file_info * fi, bool plus) {
+  // Children can't come or go while the directory is read-locked
+  if (!inode_lock_live(ino, false)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  struct stat * self = inode_stat(ino);
+  if (!S_ISDIR(self -> st_mode)) {
+    inode_unlock(ino);
+    fuse_reply_err(req, ENOTDIR);
+    return;
+  }
+
+  struct dir_handle * handle = (struct dir_handle * )(uintptr_t) fi -> fh;
+  struct stat parent_stat;
+  fuse_ino_t parent = inode_node(ino) -> parent_inode;
+  if (ino == ROOT_DIR || !inode_stat_copy(parent, & parent_stat)) {
+    parent_stat = * self;
+  }
+
+  char * buffer = malloc(size);
+  if (buffer == NULL) {
+    inode_unlock(ino);
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+
+  size_t bytes_accumulated = 0;
+  size_t entry_size;
+  bool referenced;
+
+  // Inodes that readdirplus entries gave the kernel a reference to, which
+  // are dropped again if the reply can't be sent
+  fuse_ino_t * refs = NULL;
+  size_t ref_count = 0;
+  size_t ref_capacity = 0;
+
+  struct {
+    const char * name;
+    struct stat * stbuf;
+    off_t cookie;
+  }
+  entries[] = {
+    {
+      ".",
+      self,
+      DIR_COOKIE_DOT
+    },
+    {
+      "..",
+      & parent_stat,
+      DIR_COOKIE_DOTDOT
+    },
+  };
+
+  for (size_t i = 0; i < sizeof(entries) / sizeof(entries[0]); ++i) {
+    if (entries[i].cookie <= off) {
+      continue;
+    }
+
+    if (plus) {
+      entry_size = readdirplus_add(req, buffer + bytes_accumulated,
+        size - bytes_accumulated, entries[i].name, entries[i].stbuf -> st_ino,
+        entries[i].stbuf -> st_mode, entries[i].cookie, & referenced);
+    } else {
+      entry_size = fuse_add_direntry(req, buffer + bytes_accumulated,
+        size - bytes_accumulated,
+        entries[i].name, entries[i].stbuf, entries[i].cookie);
+    }
+    if (entry_size > size - bytes_accumulated) {
+      goto reply;
+    }
+    bytes_accumulated += entry_size;
+  }
+
+  fuse_ino_t child = readdir_resume(ino, off, handle);
+  while (child != 0) {
+    // A plain entry only needs its inode number and type, both in the node
+    struct file_node * node = inode_node(child);
+    struct stat child_stat = {
+      .st_ino = entry_inode(child),
+      .st_mode = node -> type,
+    };
+
+    if (plus) {
+      // Make room to record the reference first; without it, stop here
+      if (ref_count == ref_capacity) {
+        size_t capacity = ref_capacity ? ref_capacity * 2 : 64;
+        fuse_ino_t * grown = realloc(refs, capacity * sizeof( * refs));
+        if (grown == NULL) {
+          break;
+        }
+        refs = grown;
+        ref_capacity = capacity;
+      }
+
+      entry_size = readdirplus_add(req, buffer + bytes_accumulated,
+        size - bytes_accumulated, node -> name, child_stat.st_ino,
+        child_stat.st_mode, node -> dir_cookie, & referenced);
+      if (referenced) {
+        refs[ref_count++] = child_stat.st_ino;
+      }
+    } else {
+      entry_size = fuse_add_direntry(req, buffer + bytes_accumulated,
+        size - bytes_accumulated,
+        node -> name, & child_stat, node -> dir_cookie);
+    }
+    if (entry_size > size - bytes_accumulated) {
+      break;
+    }
+    bytes_accumulated += entry_size;
+    child = node -> next_sibling;
+  }
+
+  if (handle != NULL) {
+    handle -> resume_ino = child;
+    handle -> resume_cookie = child ? inode_node(child) -> dir_cookie : 0;
+  }
+
+reply:
+  inode_unlock(ino);
+
+  int result = fuse_reply_buf(req, buffer, bytes_accumulated);
+  if (result != 0) {
+    fprintf(stderr, "Failed to send readdir reply\n");
+    for (size_t i = 0; i < ref_count; i++) {
+      inode_forget(refs[i], 1);
+    }
+  }
+  free(refs);
+  free(buffer);
+}
+
+static void assign5_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+  off_t off, struct fuse_file_info * fi) {
+  readdir_fill(req, ino, size, off, fi, false);
+}
+
+static void assign5_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+  off_t off, struct fuse_file_info * fi) {
+  readdir_fill(req, ino, size, off, fi, true);
+}
+
+static void assign5_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+  off_t off, struct fuse_file_info * fi) {
+  if (synthetic_get(ino) != NULL) {
+    synthetic_read(req, size, off, fi);
+    return;
+  }
+
+  // Shared, so that readers of a file run in parallel while its pages are
+  // resident; faulting pages in changes the page table, so that is done
+  // under an exclusive lock
+  struct open_file * handle = open_file_lock(ino, fi, false);
+  if (handle == NULL) {
+    fuse_reply_err(req, EBADF);
+    return;
+  }
+
+  // Reply straight from the file's pages: no intermediate buffer, no copy
+  struct iovec stack_iov[32];
+  struct iovec * iov = stack_iov;
+  size_t max_iov = data_map_count(off, size);
+
+  if (max_iov > sizeof(stack_iov) / sizeof(stack_iov[0])) {
+    iov = malloc(max_iov * sizeof( * iov));
+    if (iov == NULL) {
+      inode_unlock(ino);
+      fuse_reply_err(req, ENOMEM);
+      return;
+    }
+  }
+
+  int count = data_map(handle -> data, off, size, iov, false);
+  if (count == -EAGAIN) {
+    inode_unlock(ino);
+    if ((handle = open_file_lock(ino, fi, true)) == NULL) {
+      if (iov != stack_iov) {
+        free(iov);
+      }
+      fuse_reply_err(req, EBADF);
+      return;
+    }
+    count = data_map(handle -> data, off, size, iov, true);
+  }
+
+  int result = (count < 0) ?
+    fuse_reply_err(req, -count) :
+    fuse_reply_iov(req, iov, count);
+  if (result != 0) {
+    fprintf(stderr, "Failed to send read reply\n");
+  }
+
+  // The iovecs point into the file's pages until the reply is sent
+  inode_unlock(ino);
+
+  if (iov != stack_iov) {
+    free(iov);
+  }
+}
+
+/**
+ * Find `name` in `parent` for removal, write-locking both the parent and the
+ * entry (in that order).
+ *
+ * @returns    the entry's inode, or 0 (and no locks) if there is none
+ */
+static fuse_ino_t remove_entry_lock(fuse_ino_t parent, const char * name) {
+  if (!inode_lock_live(parent, true)) {
+    return 0;
+  }
+
+  // With the parent locked, nobody else can remove this entry
+  pthread_rwlock_rdlock( & dir_index.lock);
+  fuse_ino_t ino = index_find(parent, name);
+  pthread_rwlock_unlock( & dir_index.lock);
+
+  if (ino == 0 || !inode_lock_live(ino, true)) {
+    inode_unlock(parent);
+    return 0;
+  }
+
+  return ino;
+}
+
+static void
+assign5_rmdir(fuse_req_t req, fuse_ino_t parent,
+  const char * name) {
+  fuse_ino_t ino = remove_entry_lock(parent, name);
+  if (ino == 0) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  int err = 0;
+  if (!S_ISDIR(inode_stat(ino) -> st_mode)) {
+    err = ENOTDIR;
+  } else if (inode_node(ino) -> first_child != 0) {
+    err = ENOTEMPTY;
+  } else {
+    clear_file_entry(ino);
+  }
+
+  inode_unlock(ino);
+  inode_unlock(parent);
+
+  if (err != 0) {
+    fuse_reply_err(req, err);
+  } else {
+    journal_reply_ok(req);
+  }
+}
+
+/**
+ * Is `dir` the same as `ino` or one of its ancestors? Called with
+ * rename_lock held, so that no directory moves in the meantime.
+ */
+static bool dir_contains(fuse_ino_t dir, fuse_ino_t ino) {
+  while (ino != dir) {
+    if (ino == ROOT_DIR || !inode_exists(ino)) {
+      return false;
+    }
+    ino = __atomic_load_n( & inode_node(ino) -> parent_inode, __ATOMIC_RELAXED);
+  }
+
+  return true;
+}
+
+/**
+ * Write-lock the directories a rename works in: an ancestor before its
+ * descendant (every other operation locks parents before children), and
+ * otherwise in inode order.
+ *
+ * @returns    0 with both locked, or an errno value with neither
+ */
+static int rename_lock_dirs(fuse_ino_t parent, fuse_ino_t newparent) {
+  fuse_ino_t first = parent;
+  fuse_ino_t second = newparent;
+  if (dir_contains(newparent, parent) ||
+    (!dir_contains(parent, newparent) && newparent < parent)) {
+    first = newparent;
+    second = parent;
+  }
+
+  if (!inode_lock_live(first, true)) {
+    return ENOENT;
+  }
+
+  if (second != first && !inode_lock_live(second, true)) {
+    inode_unlock(first);
+    return ENOENT;
+  }
+
+  if (!S_ISDIR(inode_stat(first) -> st_mode) ||
+    !S_ISDIR(inode_stat(second) -> st_mode)) {
+    if (second != first) {
+      inode_unlock(second);
+    }
+    inode_unlock(first);
+    return ENOTDIR;
+  }
+
+  if (inode_stat(newparent) -> st_nlink == 0) {
+    if (second != first) {
+      inode_unlock(second);
+    }
+    inode_unlock(first);
+    return ENOENT;
+  }
+
+  return 0;
+}
+
+/**
+ * Check that entry `from` can take the place of `to` (if any) and lock
+ * both, with their directories already locked.
+ *
+ * @returns    0 with the entries write-locked, or an errno value
+ */
+static int rename_lock_entries(fuse_ino_t from, fuse_ino_t parent,
+  fuse_ino_t to, fuse_ino_t newparent, unsigned flags) {
+  if (to != 0 && (flags & RENAME_NOREPLACE)) {
+    return EEXIST;
+  }
+  if (to == 0 && (flags & RENAME_EXCHANGE)) {
+    return ENOENT;
+  }
+
+  if (inode_immutable(entry_inode(from)) ||
+    (to != 0 && inode_immutable(entry_inode(to)))) {
+    return EPERM;
+  }
+
+  // A directory can't move into itself, and the target can't be something
+  // the source is inside of; both checks come before the entry locks, which
+  // could otherwise be taken twice
+  bool from_dir = inode_node(from) -> is_directory;
+  if (dir_contains(from, newparent)) {
+    return EINVAL;
+  }
+
+  if (to != 0) {
+    bool to_dir = inode_node(to) -> is_directory;
+    if ((flags & RENAME_EXCHANGE) && dir_contains(to, parent)) {
+      return EINVAL;
+    }
+    if (!(flags & RENAME_EXCHANGE)) {
+      if (from_dir && !to_dir) {
+        return ENOTDIR;
+      }
+      if (!from_dir && to_dir) {
+        return EISDIR;
+      }
+      if (dir_contains(to, parent)) {
+        return ENOTEMPTY;
+      }
+    }
+  }
+
+  fuse_ino_t first = (to != 0 && to < from) ? to : from;
+  fuse_ino_t second = (first == from) ? to : from;
+  pthread_rwlock_wrlock(inode_lock(first));
+  if (second != 0) {
+    pthread_rwlock_wrlock(inode_lock(second));
+  }
+
+  if (!(flags & RENAME_EXCHANGE) && to != 0 && inode_node(to) -> first_child != 0) {
+    if (second != 0) {
+      inode_unlock(second);
+    }
+    inode_unlock(first);
+    return ENOTEMPTY;
+  }
+
+  return 0;
+}
+
+/**
+ * Rename (or with RENAME_EXCHANGE, swap) directory entries. Lookups see
+ * the old names until they see the new ones, with no moment in between
+ * where either name is missing; readdir sees a moved entry as the newest
+ * one in its directory.
+ *
+ * @returns    0 or an errno value
+ */
+static int rename_entry(fuse_ino_t parent, const char * name,
+  fuse_ino_t newparent, const char * newname, unsigned flags) {
+  if ((flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) ||
+    ((flags & RENAME_NOREPLACE) && (flags & RENAME_EXCHANGE))) {
+    return EINVAL;
+  }
+
+  if (parent == ASSIGN_DIR || newparent == ASSIGN_DIR ||
+    synthetic_find(parent, name, NULL) != NULL ||
+    synthetic_find(newparent, newname, NULL) != NULL) {
+    return EPERM;
+  }
+
+  if (strlen(newname) > FILE_NAME_MAX) {
+    return ENAMETOOLONG;
+  }
+
+  // An exchange swaps the two names it already has
+  const char * interned = NULL;
+  if (!(flags & RENAME_EXCHANGE) &&
+    (interned = name_intern(newname, strlen(newname))) == NULL) {
+    return ENOMEM;
+  }
+
+  pthread_mutex_lock( & rename_lock);
+  int err = rename_lock_dirs(parent, newparent);
+  if (err != 0) {
+    pthread_mutex_unlock( & rename_lock);
+    name_release(interned);
+    return err;
+  }
+
+  pthread_rwlock_rdlock( & dir_index.lock);
+  fuse_ino_t from = index_find(parent, name);
+  fuse_ino_t to = index_find(newparent, newname);
+  pthread_rwlock_unlock( & dir_index.lock);
+
+  if (from == 0) {
+    err = ENOENT;
+  } else if (to != 0 && entry_inode(from) == entry_inode(to) &&
+    !(flags & RENAME_NOREPLACE)) {
+    // Two names for the same file: rename(2) leaves both alone
+    from = 0;
+  } else {
+    err = rename_lock_entries(from, parent, to, newparent, flags);
+  }
+
+  if (err == 0 && from != 0) {
+    bool exchange = (flags & RENAME_EXCHANGE) != 0;
+
+    // Child lists are found through the parent pointers, so unlink first
+    child_unlink(from);
+    if (exchange) {
+      child_unlink(to);
+    }
+
+    pthread_rwlock_wrlock( & dir_index.lock);
+    index_unhash(from);
+    if (to != 0) {
+      index_unhash(to);
+    }
+    const char * old_name = inode_node(from) -> name;
+    inode_node(from) -> parent_inode = newparent;
+    inode_node(from) -> name = exchange ? inode_node(to) -> name : interned;
+    index_hash(from);
+    if (exchange) {
+      inode_node(to) -> parent_inode = parent;
+      inode_node(to) -> name = old_name;
+      index_hash(to);
+    }
+    pthread_rwlock_unlock( & dir_index.lock);
+
+    // Readers of the old name hold the parent's lock or the index's
+    if (!exchange) {
+      name_release(old_name);
+      interned = NULL;
+    }
+
+    child_link(from);
+    if (exchange) {
+      child_link(to);
+    } else if (to != 0) {
+      clear_file_entry(to);
+    }
+
+    inode_changed(parent);
+    inode_changed(newparent);
+
+    if (to != 0) {
+      inode_unlock(to);
+    }
+    inode_unlock(from);
+  }
+
+  if (newparent != parent) {
+    inode_unlock(newparent);
+  }
+  inode_unlock(parent);
+  pthread_mutex_unlock( & rename_lock);
+
+  name_release(interned);
+  return err;
+}
+
+/**
+ * Rename, with renameat2()'s RENAME_NOREPLACE and RENAME_EXCHANGE flags.
+ */
+static void
+assign5_rename(fuse_req_t req, fuse_ino_t parent, const char * name,
+  fuse_ino_t newparent, const char * newname, unsigned int flags) {
+  int err = rename_entry(parent, name, newparent, newname, flags);
+  if (err != 0) {
+    fuse_reply_err(req, err);
+  } else {
+    journal_reply_ok(req);
+  }
+}
+
+/**
+ * An entry still to be cloned by a snapshot, and where its copy goes.
+ */
+struct snapshot_item {
+  fuse_ino_t entry;
+  // The entry's generation when it was queued (0: don't check)
+  uint64_t generation;
+  // Directory to create the copy in (set once that has been created)
+  fuse_ino_t parent;
+  char name[FILE_NAME_MAX + 1];
+};
+
+/**
+ * Everything a snapshot copies from one inode, taken under its lock and
+ * installed in the new inode under the destination's.
+ */
+struct snapshot_copy {
+  struct stat attr;
+  bool is_directory;
+  struct file_data data;
+  uint8_t xattr_inline_len;
+  uint8_t xattr_inline[XATTR_INLINE_SIZE];
+  uint16_t xattr_spill_len;
+  uint8_t * xattr_spill;
+};
+
+/**
+ * Find the entry for `path` (from the root, with or without a leading
+ * slash). With `leaf`, find its parent directory instead and copy the last
+ * component to `leaf`. Called with rename_lock held.
+ *
+ * @returns    0 with the entry in `ino`, or an errno value
+ */
+static int snapshot_path(char * path, fuse_ino_t * ino, char * leaf) {
+  fuse_ino_t dir = ROOT_DIR;
+  char * save;
+  char * name = strtok_r(path, "/", & save);
+
+  if (leaf != NULL && name == NULL) {
+    return EEXIST;
+  }
+
+  while (name != NULL) {
+    char * next = strtok_r(NULL, "/", & save);
+    if (strlen(name) > FILE_NAME_MAX) {
+      return ENAMETOOLONG;
+    }
+    if (leaf != NULL && next == NULL) {
+      strcpy(leaf, name);
+      break;
+    }
+
+    pthread_rwlock_rdlock( & dir_index.lock);
+    dir = index_find(dir, name);
+    pthread_rwlock_unlock( & dir_index.lock);
+    if (dir == 0) {
+      return ENOENT;
+    }
+    name = next;
+  }
+
+  * ino = dir;
+  return 0;
+}
+
+/**
+ * Copy the inode `item` names into `copy`, queueing the entries of a
+ * directory (with no destination yet) on `queue`.
+ *
+ * @returns    0 or an errno value (ENOENT if the entry has gone)
+ */
+static int snapshot_read(const struct snapshot_item * item,
+  struct snapshot_copy * copy, struct snapshot_item ** queue, size_t * count,
+  size_t * capacity) {
+  if (!inode_lock_live(item -> entry, true)) {
+    return ENOENT;
+  }
+  if (item -> generation != 0 &&
+    inode_meta(item -> entry) -> generation != item -> generation) {
+    inode_unlock(item -> entry);
+    return ENOENT;
+  }
+
+  // Like unlink, lock the entry before the inode it names
+  fuse_ino_t ino = entry_inode(item -> entry);
+  if (ino != item -> entry) {
+    pthread_rwlock_wrlock(inode_lock(ino));
+  }
+
+  struct file_node * node = inode_node(ino);
+  struct file_meta * meta = inode_meta(ino);
+  memset(copy, 0, sizeof( * copy));
+  copy -> attr = * inode_stat(ino);
+  copy -> is_directory = node -> is_directory;
+
+  int err = (disk.fd >= 0) ? xattr_load(ino) : 0;
+  if (err == 0 && meta -> xattr_spill_len > 0) {
+    copy -> xattr_spill = malloc(meta -> xattr_spill_len);
+    if (copy -> xattr_spill == NULL) {
+      err = ENOMEM;
+    } else {
+      memcpy(copy -> xattr_spill, meta -> xattr_spill, meta -> xattr_spill_len);
+      copy -> xattr_spill_len = meta -> xattr_spill_len;
+    }
+  }
+  copy -> xattr_inline_len = meta -> xattr_inline_len;
+  memcpy(copy -> xattr_inline, meta -> xattr_inline, meta -> xattr_inline_len);
+
+  if (err == 0 && S_ISREG(copy -> attr.st_mode)) {
+    err = data_clone(inode_data(ino), & copy -> data);
+  }
+
+  for (fuse_ino_t child = node -> first_child; err == 0 && child != 0;
+    child = inode_node(child) -> next_sibling) {
+    if ( * count == * capacity) {
+      struct snapshot_item * items = realloc( * queue,
+        2 * * capacity * sizeof( * items));
+      if (items == NULL) {
+        err = ENOMEM;
+        break;
+      }
+      * queue = items;
+      * capacity *= 2;
+    }
+
+    struct snapshot_item * next = & ( * queue)[( * count)++];
+    next -> entry = child;
+    next -> generation = inode_meta(child) -> generation;
+    next -> parent = 0;
+    strcpy(next -> name, inode_node(child) -> name);
   }
-  init_files[] = {
-    {
-      ROOT_DIR,
-      S_IFDIR | AllPermissions | AllPermissions,
-      1,
-      -1,
-      "root"
-    },
-    {
-      ASSIGN_DIR,
-      S_IFDIR | AllRead | AllExec,
-      0,
-      ROOT_DIR,
-      "assignment"
-    },
-    {
-      USERNAME_FILE,
-      S_IFREG | AllRead,
-      0,
-      ASSIGN_DIR,
-      "username"
-    },
-    {
-      FEATURE_FILE,
-      S_IFREG | AllRead,
-      0,
-      ASSIGN_DIR,
-      "feature"
-    },
-  };
 
-  for (int i = 0; i < 4; ++i) {
-    struct file_node * node = & helper_array[init_files[i].ino];
-    struct stat * stat = & file_stats[init_files[i].ino];
+  if (ino != item -> entry) {
+    inode_unlock(ino);
+  }
+  inode_unlock(item -> entry);
 
-    stat -> st_ino = init_files[i].ino;
-    stat -> st_mode = init_files[i].mode;
-    stat -> st_nlink = 1;
-    node -> is_directory = init_files[i].is_directory;
-    node -> parent_inode = init_files[i].parent_inode;
-    strcpy(node -> name, init_files[i].name);
+  if (err != 0) {
+    data_discard( & copy -> data);
+    free(copy -> xattr_spill);
+  }
 
-    if (init_files[i].ino == USERNAME_FILE) {
-      stat -> st_size = sizeof(UsernameContent);
-    } else if (init_files[i].ino == FEATURE_FILE) {
-      stat -> st_size = sizeof(FeaturesContents);
-    }
+  return err;
+}
+
+/**
+ * Create `name` in `parent` from `copy`, which it takes over (or discards,
+ * if that fails).
+ *
+ * @returns    0 with the new inode in `ino`, or an errno value
+ */
+static int snapshot_write(struct snapshot_copy * copy, fuse_ino_t parent,
+  const char * name, fuse_ino_t * ino) {
+  int err = lock_new_entry(parent, name);
+  if (err == 0) {
+    err = alloc_entry_inode(parent, name, ino);
+  }
+  if (err != 0) {
+    data_discard( & copy -> data);
+    free(copy -> xattr_spill);
+    return err;
   }
 
-  current_file_count = 4;
+  stat_write_begin( * ino);
+  struct stat * attr = inode_stat( * ino);
+  attr -> st_mode = copy -> attr.st_mode;
+  attr -> st_nlink = 1;
+  attr -> st_uid = copy -> attr.st_uid;
+  attr -> st_gid = copy -> attr.st_gid;
+  attr -> st_rdev = copy -> attr.st_rdev;
+  attr -> st_size = copy -> attr.st_size;
+  attr -> st_atim = copy -> attr.st_atim;
+  attr -> st_mtim = copy -> attr.st_mtim;
+  attr -> st_ctim = copy -> attr.st_ctim;
+  stat_write_end( * ino);
+
+  copy -> data.ino = * ino;
+  * inode_data( * ino) = copy -> data;
+
+  struct file_meta * meta = inode_meta( * ino);
+  meta -> xattr_inline_len = copy -> xattr_inline_len;
+  memcpy(meta -> xattr_inline, copy -> xattr_inline, copy -> xattr_inline_len);
+  meta -> xattr_spill_len = copy -> xattr_spill_len;
+  meta -> xattr_spill = copy -> xattr_spill;
+  meta -> xattr_dirty = copy -> xattr_spill_len > 0;
+
+  add_file_entry( * ino, parent, copy -> is_directory);
+  file_dirty( * ino);
+
+  inode_unlock( * ino);
+  inode_unlock(parent);
+
+  __atomic_add_fetch(copy -> is_directory ? & snapshot.directories :
+    & snapshot.files, 1, __ATOMIC_RELAXED);
+  return 0;
 }
 
-static void assign5_destroy(void * userdata) {
-  struct backing_file * backing = userdata;
-  fprintf(stderr, "*** %s %d\n", __func__, backing -> bf_fd);
+/**
+ * Reserve journal room for `copy`, the `n`th inode of the clone, or discard
+ * it. The whole clone goes into one transaction, and with rename_lock held
+ * it cannot wait for room.
+ *
+ * @returns    0, or EFBIG with `copy` discarded
+ */
+static int snapshot_reserve(struct snapshot_copy * copy, size_t n) {
+  // A new inode table block (and name table block) every so often, plus
+  // the copy's own block map and spilled xattrs
+  size_t blocks = (n % DISK_INODES_PER_BLOCK == 0) ? 2 : 0;
+  if (copy -> data.page_count > DISK_DIRECT) {
+    blocks += journal_data_cost(copy -> data.page_count);
+  }
+  blocks += copy -> xattr_spill_len > 0;
 
-  free(file_stats);
-  file_stats = NULL;
-  free(helper_array);
-  helper_array = NULL;
-  free(file_contents);
-  file_contents = NULL;
+  int err = journal_reserve(blocks, false);
+  if (err != 0) {
+    data_discard( & copy -> data);
+    free(copy -> xattr_spill);
+  }
+
+  return err;
 }
 
-static void assign5_create(fuse_req_t req, fuse_ino_t parent, const char * name, mode_t mode, struct fuse_file_info * fi) {
-  if (parent == ASSIGN_DIR) {
-    // Files cannot be created in the assignment directory
-    fuse_reply_err(req, EPERM);
-    return;
+/**
+ * Clone the tree at `from` as `name` in `parent`, one inode at a time:
+ * nothing is held locked across inodes, so each file is copied consistently
+ * but the tree as a whole is not frozen. Hard links are cloned as separate
+ * files. Called with rename_lock held.
+ *
+ * @returns    0 or an errno value (with whatever was cloned left in place)
+ */
+static int snapshot_tree(fuse_ino_t from, fuse_ino_t parent, const char * name) {
+  size_t capacity = 64;
+  size_t count = 1;
+  struct snapshot_item * queue = malloc(capacity * sizeof( * queue));
+  if (queue == NULL) {
+    return ENOMEM;
   }
 
-  struct fuse_entry_param dirent;
-  current_file_count++;
+  queue[0].entry = from;
+  queue[0].generation = 0;
+  queue[0].parent = parent;
+  strcpy(queue[0].name, name);
 
-  file_stats[current_file_count].st_ino = current_file_count;
-  file_stats[current_file_count].st_mode = S_IFREG | mode;
-  file_stats[current_file_count].st_size = 0;
-  file_stats[current_file_count].st_nlink = 1;
+  int err = 0;
+  for (size_t i = 0; err == 0 && i < count; i++) {
+    struct snapshot_item item = queue[i];
+    struct snapshot_copy copy;
+    size_t children = count;
 
-  helper_array[current_file_count].is_directory = 0;
-  helper_array[current_file_count].parent_inode = parent;
-  strcpy(helper_array[current_file_count].name, name);
+    err = snapshot_read( & item, & copy, & queue, & count, & capacity);
+    if (err == ENOENT && i > 0) {
+      // Removed since its directory was read
+      err = 0;
+      continue;
+    }
 
-  dirent.generation = 1;
-  dirent.attr_timeout = 1;
-  dirent.entry_timeout = 1;
-  dirent.ino = current_file_count;
-  dirent.attr = file_stats[current_file_count];
+    if (err == 0) {
+      err = snapshot_reserve( & copy, i);
+    }
 
-  int result = fuse_reply_create(req, & dirent, fi);
-  if (result != 0) {
-    fprintf(stderr, "Failed to send dirent reply\n");
+    fuse_ino_t ino;
+    if (err == 0 && (err = snapshot_write( & copy, item.parent, item.name, & ino)) == 0) {
+      for (size_t j = children; j < count; j++) {
+        queue[j].parent = ino;
+      }
+    }
+  }
+
+  free(queue);
+  return err;
+}
+
+/**
+ * Run "SOURCE DEST" written to /.snapshot: clone the file or directory
+ * tree SOURCE as DEST, which must not exist yet. File data is shared until
+ * either copy writes to it. A tree too big to commit at once fails with
+ * EFBIG, part way through.
+ *
+ * @returns    0 or an errno value
+ */
+static int snapshot_command(char * args) {
+  char * save;
+  char * source = strtok_r(args, " \t\n", & save);
+  char * dest = source ? strtok_r(NULL, " \t\n", & save) : NULL;
+  if (dest == NULL || strtok_r(NULL, " \t\n", & save) != NULL) {
+    return EINVAL;
+  }
+
+  fuse_ino_t from;
+  fuse_ino_t parent;
+  char name[FILE_NAME_MAX + 1];
+
+  pthread_mutex_lock( & rename_lock);
+  int err = snapshot_path(source, & from, NULL);
+  if (err == 0) {
+    err = snapshot_path(dest, & parent, name);
   }
+
+  if (err == 0 && parent == ASSIGN_DIR) {
+    err = EPERM;
+  } else if (err == 0 && dir_contains(from, parent)) {
+    // Cloning a tree into itself would never finish
+    err = EINVAL;
+  } else if (err == 0 && (err = snapshot_tree(from, parent, name)) == 0) {
+    __atomic_add_fetch( & snapshot.taken, 1, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_unlock( & rename_lock);
+  return err;
 }
 
 static void
-assign5_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fip) {
-  if (ino > current_file_count) {
+assign5_setattr(fuse_req_t req, fuse_ino_t ino, struct stat * attr, int to_set, struct fuse_file_info * fi) {
+  // Writing a command with "echo cmd > file" truncates the file first,
+  // which for a command file changes nothing
+  const struct synthetic_file * synthetic = synthetic_get(ino);
+  if (synthetic != NULL && synthetic -> command != NULL &&
+    !(to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+    struct stat result;
+    synthetic_stat(ino, & result);
+    fuse_reply_attr(req, & result, inode_timeout(ino));
+    return;
+  }
+
+  // The kernel caches the assignment files as if they never change, and
+  // synthetic files have nothing to set
+  if (inode_immutable(ino) || synthetic != NULL) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+
+  if (!inode_lock_live(ino, true)) {
     fuse_reply_err(req, ENOENT);
     return;
   }
 
-  int result = fuse_reply_attr(req, file_stats + ino, 1);
-  if (result != 0) {
-    fprintf(stderr, "Failed to send attr reply\n");
+  // Truncate first: if that fails, nothing else changes either
+  int err = 0;
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    if (S_ISDIR(inode_stat(ino) -> st_mode)) {
+      err = EISDIR;
+    } else if (!S_ISREG(inode_stat(ino) -> st_mode) || attr -> st_size < 0) {
+      err = EINVAL;
+    } else {
+      err = data_truncate(inode_data(ino), attr -> st_size);
+      file_dirty(ino);
+    }
   }
-}
 
-static void
-assign5_lookup(fuse_req_t req, fuse_ino_t parent, const char * name) {
-  struct fuse_entry_param dirent;
+  if (err != 0) {
+    inode_unlock(ino);
+    fuse_reply_err(req, err);
+    return;
+  }
+
+  stat_write_begin(ino);
+  if (to_set & FUSE_SET_ATTR_MODE) {
+    inode_stat(ino) -> st_mode = (inode_stat(ino) -> st_mode & S_IFMT) | (attr -> st_mode & 07777);
+  }
+  if (to_set & FUSE_SET_ATTR_SIZE) {
+    inode_stat(ino) -> st_size = inode_data(ino) -> size;
+  }
+  stat_write_end(ino);
+  inode_dirty(ino);
 
-  for (int i = 0; i <= current_file_count; i++) {
-    if (helper_array[i].parent_inode == parent &&
-      strcmp(helper_array[i].name, name) == 0) {
+  struct stat result = * inode_stat(ino);
+  inode_unlock(ino);
 
-      dirent.generation = 1;
-      dirent.attr_timeout = 1;
-      dirent.entry_timeout = 1;
-      dirent.ino = i;
-      dirent.attr = file_stats[i];
+  journal_reply_attr(req, & result, inode_timeout(ino));
+}
 
-      int result = fuse_reply_entry(req, & dirent);
-      if (result != 0) {
-        fprintf(stderr, "Failed to send dirent reply\n");
-      }
-      return;
+static size_t xattr_entry_size(const uint8_t * entry) {
+  return XATTR_HEADER + entry[0] + (entry[1] | entry[2] << 8);
+}
+
+/**
+ * Find the entry called `name` among `len` bytes of packed entries.
+ */
+static uint8_t * xattr_scan(uint8_t * entries, size_t len, const char * name,
+  size_t name_len) {
+  for (size_t pos = 0; pos < len; pos += xattr_entry_size(entries + pos)) {
+    if (entries[pos] == name_len &&
+      memcmp(entries + pos + XATTR_HEADER, name, name_len) == 0) {
+      return entries + pos;
     }
   }
 
-  fuse_reply_err(req, ENOENT);
+  return NULL;
 }
 
-static void assign5_mkdir(fuse_req_t req, fuse_ino_t parent, const char * name, mode_t mode) {
-  if (parent == ASSIGN_DIR) {
-    // Directories cannot be created in the assignment directory
-    fuse_reply_err(req, EPERM);
-    return;
+/**
+ * Find attribute `name` of a node, inline first and then among the spilled
+ * entries (which must have been loaded).
+ *
+ * @param   spilled    set if the entry is in the spill area
+ */
+static uint8_t * xattr_find(struct file_meta * meta, const char * name,
+  bool * spilled) {
+  size_t name_len = strlen(name);
+  uint8_t * entry = xattr_scan(meta -> xattr_inline, meta -> xattr_inline_len,
+    name, name_len);
+  * spilled = (entry == NULL);
+
+  if (entry == NULL && meta -> xattr_spill != NULL) {
+    entry = xattr_scan(meta -> xattr_spill, meta -> xattr_spill_len, name,
+      name_len);
   }
 
-  struct fuse_entry_param dirent;
-  current_file_count++;
+  return entry;
+}
 
-  file_stats[current_file_count].st_ino = current_file_count;
-  file_stats[current_file_count].st_mode = S_IFDIR | AllPermissions | AllPermissions;
-  file_stats[current_file_count].st_nlink = 1;
+/**
+ * Remove an entry from a packed area of `len` bytes.
+ *
+ * @returns    the new length of the area
+ */
+static size_t xattr_cut(uint8_t * entries, size_t len, uint8_t * entry) {
+  size_t size = xattr_entry_size(entry);
+  memmove(entry, entry + size, entries + len - entry - size);
+  return len - size;
+}
 
-  helper_array[current_file_count].is_directory = 1;
-  helper_array[current_file_count].parent_inode = parent;
-  strcpy(helper_array[current_file_count].name, name);
+/**
+ * Lock `ino` for reading its attributes, write-locked (and with the spill
+ * block loaded) if `write` or if an attribute may be in the spill block.
+ *
+ * @returns    0 with the lock held, or an errno value
+ */
+static int xattr_lock(fuse_ino_t ino, const char * name, bool write) {
+  if (!write) {
+    if (!inode_lock_live(ino, false)) {
+      return ENOENT;
+    }
 
-  dirent.generation = 1;
-  dirent.attr_timeout = 1;
-  dirent.entry_timeout = 1;
-  dirent.ino = current_file_count;
-  dirent.attr = file_stats[current_file_count];
+    // Inline entries, the common case, need no more than the shared lock
+    struct file_meta * meta = inode_meta(ino);
+    bool spilled;
+    if (meta -> xattr_spill_len == 0 || meta -> xattr_spill != NULL ||
+      (name != NULL && xattr_find(meta, name, & spilled) != NULL)) {
+      return 0;
+    }
+    inode_unlock(ino);
+  }
 
-  int result = fuse_reply_entry(req, & dirent);
-  if (result != 0) {
-    fprintf(stderr, "Failed to send dirent reply\n");
+  if (!inode_lock_live(ino, true)) {
+    return ENOENT;
+  }
+
+  int err = xattr_load(ino);
+  if (err != 0) {
+    inode_unlock(ino);
   }
+
+  return err;
 }
 
 static void
-assign5_mknod(fuse_req_t req, fuse_ino_t parent,
-  const char * name,
-    mode_t mode, dev_t rdev) {
-  if (parent == ASSIGN_DIR) {
-    // Nodes cannot be created in the assignment directory
+assign5_setxattr(fuse_req_t req, fuse_ino_t ino, const char * name,
+  const char * value, size_t size, int flags) {
+  if (inode_immutable(ino) || synthetic_get(ino) != NULL) {
     fuse_reply_err(req, EPERM);
     return;
   }
 
-  struct fuse_entry_param dirent;
-  current_file_count++;
-  file_stats[current_file_count].st_ino = current_file_count;
-  file_stats[current_file_count].st_mode = mode;
-  file_stats[current_file_count].st_nlink = 1;
-  helper_array[current_file_count].is_directory = 1;
-  helper_array[current_file_count].parent_inode = parent;
-  strcpy(helper_array[current_file_count].name, name);
-
-  dirent.generation = 1;
-  dirent.attr_timeout = 1;
-  dirent.entry_timeout = 1;
-  dirent.ino = current_file_count;
-  dirent.attr = file_stats[current_file_count];
+  size_t name_len = strlen(name);
+  size_t needed = XATTR_HEADER + name_len + size;
+  if (name_len == 0 || name_len > UINT8_MAX) {
+    fuse_reply_err(req, name_len ? ERANGE : EINVAL);
+    return;
+  }
+  if (needed > XATTR_SPILL_MAX) {
+    fuse_reply_err(req, ENOSPC);
+    return;
+  }
 
-  int result = fuse_reply_entry(req, & dirent);
-  if (result != 0) {
-    fprintf(stderr, "Failed to send dirent reply\n");
+  int err = xattr_lock(ino, name, true);
+  if (err != 0) {
+    fuse_reply_err(req, err);
+    return;
   }
-}
 
-static void
-assign5_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi) {
-  fprintf(stderr, "%s ino=%zu\n", __func__, ino);
+  struct file_meta * meta = inode_meta(ino);
+  bool spilled;
+  uint8_t * old = xattr_find(meta, name, & spilled);
+  size_t old_size = old ? xattr_entry_size(old) : 0;
 
-  if (ino > current_file_count || ino < USERNAME_FILE) {
-    fuse_reply_err(req, ENOENT);
-    return;
+  // Small values go inline while there is room, anything else spills
+  size_t inline_room = XATTR_INLINE_SIZE - meta -> xattr_inline_len +
+    (old && !spilled ? old_size : 0);
+  size_t spill_room = XATTR_SPILL_MAX - meta -> xattr_spill_len +
+    (old && spilled ? old_size : 0);
+
+  if ((flags & XATTR_CREATE) && old != NULL) {
+    err = EEXIST;
+  } else if ((flags & XATTR_REPLACE) && old == NULL) {
+    err = ENODATA;
+  } else if (needed > inline_room && needed > spill_room) {
+    err = ENOSPC;
   }
 
-  if (!S_ISREG(file_stats[ino].st_mode)) {
-    fuse_reply_err(req, EISDIR);
-    return;
+  // Make room for the new entry before the old one is cut out
+  uint8_t * spill = NULL;
+  if (err == 0 && needed > inline_room) {
+    size_t old_pos = (old && spilled) ? old - meta -> xattr_spill : 0;
+    spill = realloc(meta -> xattr_spill, meta -> xattr_spill_len + needed);
+    if (spill == NULL) {
+      err = ENOMEM;
+    } else {
+      meta -> xattr_spill = spill;
+      old = (old && spilled) ? spill + old_pos : old;
+    }
   }
 
-  if ((fi -> flags & 3) != O_RDONLY) {
-    fuse_reply_err(req, EACCES);
+  if (err != 0) {
+    inode_unlock(ino);
+    fuse_reply_err(req, err);
     return;
   }
 
-  fuse_reply_open(req, fi);
+  if (old != NULL && spilled) {
+    meta -> xattr_spill_len = xattr_cut(meta -> xattr_spill,
+      meta -> xattr_spill_len, old);
+    meta -> xattr_dirty = true;
+  } else if (old != NULL) {
+    meta -> xattr_inline_len = xattr_cut(meta -> xattr_inline,
+      meta -> xattr_inline_len, old);
+  }
+
+  uint8_t * entry;
+  if (spill != NULL) {
+    entry = meta -> xattr_spill + meta -> xattr_spill_len;
+    meta -> xattr_spill_len += needed;
+    meta -> xattr_dirty = true;
+  } else {
+    entry = meta -> xattr_inline + meta -> xattr_inline_len;
+    meta -> xattr_inline_len += needed;
+  }
+
+  entry[0] = name_len;
+  entry[1] = size & 0xff;
+  entry[2] = size >> 8;
+  memcpy(entry + XATTR_HEADER, name, name_len);
+  memcpy(entry + XATTR_HEADER + name_len, value, size);
+
+  inode_dirty(ino);
+  if (meta -> xattr_dirty) {
+    file_dirty(ino);
+  }
+  inode_unlock(ino);
+
+  journal_reply_ok(req);
 }
 
-static void assign5_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
-  off_t off, struct fuse_file_info * fi) {
-  if (off > 2) {
-    fuse_reply_buf(req, NULL, 0);
+static void
+assign5_getxattr(fuse_req_t req, fuse_ino_t ino, const char * name,
+  size_t size) {
+  int err = xattr_lock(ino, name, false);
+  if (err != 0) {
+    fuse_reply_err(req, err);
     return;
   }
 
-  struct stat * self = & file_stats[ino];
-  if (!S_ISDIR(self -> st_mode)) {
-    fuse_reply_err(req, ENOTDIR);
+  bool spilled;
+  uint8_t * entry = xattr_find(inode_meta(ino), name, & spilled);
+  if (entry == NULL) {
+    inode_unlock(ino);
+    fuse_reply_err(req, ENODATA);
     return;
   }
 
-  char buffer[size];
-  off_t bytes_accumulated = 0;
-  int next_entry = 0;
-
-  struct {
-    const char * name;
-    struct stat * stbuf;
+  size_t value_size = entry[1] | entry[2] << 8;
+  if (size == 0) {
+    fuse_reply_xattr(req, value_size);
+  } else if (size < value_size) {
+    fuse_reply_err(req, ERANGE);
+  } else {
+    fuse_reply_buf(req, (const char * ) entry + XATTR_HEADER + entry[0],
+      value_size);
   }
-  entries[] = {
-    {
-      ".",
-      self
-    },
-    {
-      "..",
-      & file_stats[ROOT_DIR]
-    },
-  };
 
-  for (size_t i = off; i < sizeof(entries) / sizeof(entries[0]); ++i) {
-    bytes_accumulated += fuse_add_direntry(req, buffer + bytes_accumulated,
-      size - bytes_accumulated,
-      entries[i].name, entries[i].stbuf, ++next_entry);
+  inode_unlock(ino);
+}
+
+static void
+assign5_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+  int err = xattr_lock(ino, NULL, false);
+  if (err != 0) {
+    fuse_reply_err(req, err);
+    return;
   }
 
-  for (int j = 1; j <= current_file_count; j++) {
-    if (helper_array[j].parent_inode == ino) {
-      bytes_accumulated += fuse_add_direntry(req, buffer + bytes_accumulated,
-        size - bytes_accumulated,
-        helper_array[j].name, &
-        file_stats[file_stats[j].st_ino],
-        ++next_entry);
+  // Names, each with its terminating NUL, inline entries first
+  struct file_meta * meta = inode_meta(ino);
+  char list[XATTR_INLINE_SIZE + XATTR_SPILL_MAX];
+  size_t total = 0;
+
+  const uint8_t * areas[2] = { meta -> xattr_inline, meta -> xattr_spill };
+  size_t lengths[2] = { meta -> xattr_inline_len, meta -> xattr_spill_len };
+  for (int a = 0; a < 2; a++) {
+    for (size_t pos = 0; pos < lengths[a]; pos += xattr_entry_size(areas[a] + pos)) {
+      memcpy(list + total, areas[a] + pos + XATTR_HEADER, areas[a][pos]);
+      total += areas[a][pos];
+      list[total++] = '\0';
     }
   }
+  inode_unlock(ino);
 
-  int result = fuse_reply_buf(req, buffer, bytes_accumulated);
-  if (result != 0) {
-    fprintf(stderr, "Failed to send readdir reply\n");
+  if (size == 0) {
+    fuse_reply_xattr(req, total);
+  } else if (size < total) {
+    fuse_reply_err(req, ERANGE);
+  } else {
+    fuse_reply_buf(req, list, total);
   }
 }
 
-static void assign5_read(fuse_req_t req, fuse_ino_t ino, size_t size,
-  off_t off, struct fuse_file_info * fi) {
-  const char * response_data = NULL;
-  size_t response_len;
-  int err = 0;
+static void
+assign5_removexattr(fuse_req_t req, fuse_ino_t ino, const char * name) {
+  if (inode_immutable(ino) || synthetic_get(ino) != NULL) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
 
-  switch (ino) {
-  case ROOT_DIR:
-  case ASSIGN_DIR:
-    err = EISDIR;
-    break;
+  int err = xattr_lock(ino, name, true);
+  if (err != 0) {
+    fuse_reply_err(req, err);
+    return;
+  }
 
-  case USERNAME_FILE:
-    response_data = get_response_data(UsernameContent, off, size, & response_len);
-    break;
+  struct file_meta * meta = inode_meta(ino);
+  bool spilled;
+  uint8_t * entry = xattr_find(meta, name, & spilled);
 
-  case FEATURE_FILE:
-    response_data = get_response_data(FeaturesContents, off, size, & response_len);
-    break;
+  if (entry == NULL) {
+    err = ENODATA;
+  } else if (spilled) {
+    meta -> xattr_spill_len = xattr_cut(meta -> xattr_spill,
+      meta -> xattr_spill_len, entry);
+    meta -> xattr_dirty = true;
+    file_dirty(ino);
+  } else {
+    meta -> xattr_inline_len = xattr_cut(meta -> xattr_inline,
+      meta -> xattr_inline_len, entry);
+  }
 
-  default:
-    if (ino > FEATURE_FILE) {
-      if (file_contents[ino].content) {
-        response_data = get_response_data(file_contents[ino].content, off, size, & response_len);
-      } else {
-        err = EBADF;
-      }
-    } else {
-      err = EBADF;
-    }
-    break;
+  if (entry != NULL) {
+    inode_dirty(ino);
   }
+  inode_unlock(ino);
 
   if (err != 0) {
     fuse_reply_err(req, err);
+  } else {
+    journal_reply_ok(req);
+  }
+}
+
+/**
+ * Preallocate space (mode 0 or FALLOC_FL_KEEP_SIZE), so that a large
+ * sequential writer gets contiguous blocks and never extends the file
+ * page by page.
+ */
+static void
+assign5_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+  off_t length, struct fuse_file_info * fi) {
+  if (mode & ~FALLOC_FL_KEEP_SIZE) {
+    fuse_reply_err(req, EOPNOTSUPP);
     return;
   }
 
-  int result = fuse_reply_buf(req, response_data, response_len);
-  if (result != 0) {
-    fprintf(stderr, "Failed to send read reply\n");
+  if (offset < 0 || length <= 0) {
+    fuse_reply_err(req, EINVAL);
+    return;
   }
-}
 
-const char * get_response_data(const char * content, off_t off, size_t size, size_t * response_len) {
-  if (off >= strlen(content)) {
-    * response_len = 0;
-    return NULL;
+  if (inode_immutable(ino) || synthetic_get(ino) != NULL) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+
+  // Before any lock, as this may wait for a commit
+  size_t pages = (size_t)(length / FILE_PAGE_SIZE) + 1;
+  int err = journal_reserve(journal_data_cost(pages), true);
+  if (err != 0) {
+    fuse_reply_err(req, err);
+    return;
   }
 
-  * response_len = strlen(content) - off;
-  if ( * response_len > size) {
-    * response_len = size;
+  if (!inode_lock_live(ino, true)) {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  if (!S_ISREG(inode_stat(ino) -> st_mode)) {
+    err = ENODEV;
+  } else {
+    struct file_data * data = inode_data(ino);
+    err = data_allocate(data, offset, length);
+    file_dirty(ino);
+
+    if (err == 0 && !(mode & FALLOC_FL_KEEP_SIZE) &&
+      (size_t)(offset + length) > data -> size) {
+      data -> size = offset + length;
+      stat_write_begin(ino);
+      inode_stat(ino) -> st_size = data -> size;
+      stat_write_end(ino);
+      inode_dirty(ino);
+    }
   }
 
-  return content + off;
+  inode_unlock(ino);
+
+  if (err != 0) {
+    fuse_reply_err(req, err);
+  } else {
+    journal_reply_ok(req);
+  }
 }
 
 static void
-assign5_rmdir(fuse_req_t req, fuse_ino_t parent,
-  const char * name) {
-  for (int i = 1; i < current_file_count + 1; i++) {
-    if (helper_array[i].parent_inode == parent && strcmp(name, helper_array[i].name) == 0) {
-      file_stats[i].st_ino = NULL;
-      strcpy(helper_array[i].name, "");
-      helper_array[i].parent_inode = -1;
-      fuse_reply_err(req, 0);
+assign5_statfs(fuse_req_t req, fuse_ino_t ino) {
+  // Every figure is a running total, so this takes constant time
+  size_t live = __atomic_load_n( & inodes.live, __ATOMIC_RELAXED);
+  struct statvfs st = {
+    .f_bsize = FILE_PAGE_SIZE,
+    .f_frsize = FILE_PAGE_SIZE,
+    .f_files = (fsfilcnt_t) INODE_CHUNK_MAX * INODE_CHUNK_SIZE - 1,
+    .f_namemax = FILE_NAME_MAX,
+  };
+
+  if (disk.fd >= 0) {
+    pthread_mutex_lock( & block_lock);
+    st.f_blocks = disk.sb.total_blocks;
+    st.f_bfree = disk.sb.free_blocks;
+    pthread_mutex_unlock( & block_lock);
+
+    // New inodes also need room in the inode table
+    fsfilcnt_t room = (fsfilcnt_t) st.f_bfree * DISK_INODES_PER_BLOCK;
+    if (st.f_files - live > room) {
+      st.f_files = live + room;
     }
+  } else {
+    // Without a backing file, data lives in (and is limited by) memory
+    long free_pages = sysconf(_SC_AVPHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    st.f_bfree = (free_pages > 0 && page_size > 0) ?
+      (fsblkcnt_t) free_pages * page_size / FILE_PAGE_SIZE : 0;
+    uint64_t compressed = __atomic_load_n( & compress.bytes, __ATOMIC_RELAXED);
+    st.f_blocks = st.f_bfree + __atomic_load_n( & inodes.pages, __ATOMIC_RELAXED) +
+      (compressed + FILE_PAGE_SIZE - 1) / FILE_PAGE_SIZE;
   }
+
+  st.f_bavail = st.f_bfree;
+  st.f_ffree = st.f_files - live;
+  st.f_favail = st.f_ffree;
+
+  fuse_reply_statfs(req, & st);
 }
 
-static void
-assign5_setattr(fuse_req_t req, fuse_ino_t ino, struct stat * attr, int to_set, struct fuse_file_info * fi) {
-  if (ino > current_file_count) {
+static void assign5_unlink(fuse_req_t req, fuse_ino_t parent,
+  const char * name) {
+  fuse_ino_t ino = remove_entry_lock(parent, name);
+  if (ino == 0) {
     fuse_reply_err(req, ENOENT);
     return;
   }
 
-  if (to_set & FUSE_SET_ATTR_MODE) {
-    file_stats[ino].st_mode = (file_stats[ino].st_mode & S_IFMT) | (attr -> st_mode & 07777);
+  bool is_directory = S_ISDIR(inode_stat(ino) -> st_mode);
+  if (!is_directory) {
+    clear_file_entry(ino);
   }
 
-  int result = fuse_reply_attr(req, file_stats + ino, 1);
-  if (result != 0) {
-    fprintf(stderr, "Failed to send attr reply\n");
+  inode_unlock(ino);
+  inode_unlock(parent);
+
+  if (is_directory) {
+    fuse_reply_err(req, EISDIR);
+  } else {
+    journal_reply_ok(req);
   }
 }
 
-static void
-assign5_statfs(fuse_req_t req, fuse_ino_t ino) {
-  fprintf(stderr, "%s ino=%zu\n", __func__, ino);
-  fuse_reply_err(req, ENOSYS);
-}
+/**
+ * Remove directory entry `entry`, write-locked like its parent. The inode
+ * it names goes with its last link; until then it stays allocated, even if
+ * this was its own name. If the kernel still holds references to it, it
+ * stays allocated as an orphan until inode_forget() drops the last one.
+ */
+void clear_file_entry(fuse_ino_t entry) {
+  struct file_node * node = inode_node(entry);
+  fuse_ino_t ino = entry_inode(entry);
 
-static void assign5_unlink(fuse_req_t req, fuse_ino_t parent,
-  const char * name) {
-  fprintf(stderr, "%s parent=%zu name='%s'\n", __func__, parent, name);
+  inode_changed(node -> parent_inode);
+  index_remove(entry);
+  child_unlink(entry);
+  name_release(node -> name);
+  node -> name = NAME_NONE;
+  // Renames walk parent pointers without holding this entry's locks
+  __atomic_store_n( & node -> parent_inode, 0, __ATOMIC_RELAXED);
 
-  for (int i = 1; i <= current_file_count; i++) {
-    if (helper_array[i].parent_inode == parent && strcmp(name, helper_array[i].name) == 0) {
-      clear_file_entry(i);
-      fuse_reply_err(req, 0);
+  if (ino != entry) {
+    inode_free(entry);
+    pthread_rwlock_wrlock(inode_lock(ino));
+  }
+
+  stat_write_begin(ino);
+  nlink_t nlink = --inode_stat(ino) -> st_nlink;
+  stat_write_end(ino);
+
+  // Directories only ever have the one name
+  bool last = nlink == 0 || inode_node(ino) -> is_directory;
+  if (last && __atomic_load_n( & inode_meta(ino) -> nlookup, __ATOMIC_RELAXED) == 0) {
+    inode_free(ino);
+  } else {
+    if (last) {
+      // Open handles and attribute requests keep working in the meantime
+      stat_write_begin(ino);
+      inode_stat(ino) -> st_nlink = 0;
+      stat_write_end(ino);
+      inode_meta(ino) -> orphaned = true;
+      __atomic_add_fetch( & inodes.orphans, 1, __ATOMIC_RELAXED);
     }
+    inode_dirty(ino);
+    inode_changed(ino);
   }
-}
 
-void clear_file_entry(int index) {
-  file_stats[index].st_ino = NULL;
-  strcpy(helper_array[index].name, "");
-  helper_array[index].parent_inode = -1;
+  if (ino != entry) {
+    inode_unlock(ino);
+  }
 }
 
 static void assign5_write(fuse_req_t req, fuse_ino_t ino,
   const char * buf, size_t size,
     off_t off, struct fuse_file_info * fi) {
-  fprintf(stderr, "%s ino=%zu size=%zu off=%zd\n", __func__,
-    ino, size, off);
-
-  if (ino > current_file_count || ino < USERNAME_FILE) {
-    fuse_reply_err(req, ENOENT);
+  const struct synthetic_file * synthetic = synthetic_get(ino);
+  if (synthetic != NULL) {
+    synthetic_write(req, synthetic, buf, size, fi);
     return;
   }
 
-  if (!S_ISREG(file_stats[ino].st_mode)) {
-    fuse_reply_err(req, EISDIR);
+  struct open_file * handle = open_file_lock(ino, fi, true);
+  if (handle == NULL) {
+    fuse_reply_err(req, EBADF);
     return;
   }
 
-  if (off + size > file_contents[ino].size) {
-    file_contents[ino].content = realloc(file_contents[ino].content, off + size);
-    file_contents[ino].size = off + size;
-    file_stats[ino].st_size = off + size;
+  int err = 0;
+  if (!handle -> writable) {
+    err = EBADF;
+  } else if (off < 0) {
+    err = EINVAL;
+  } else {
+    // The kernel's idea of the end of the file may be out of date
+    if (handle -> append) {
+      off = handle -> data -> size;
+    }
+    err = data_write(handle -> data, buf, size, off);
+
+    stat_write_begin(ino);
+    inode_stat(ino) -> st_size = handle -> data -> size;
+    stat_write_end(ino);
+    inode_dirty(ino);
+    file_dirty(ino);
   }
 
-  memcpy(file_contents[ino].content + off, buf, size);
+  inode_unlock(ino);
+  if (err != 0) {
+    fuse_reply_err(req, err);
+    return;
+  }
 
   fuse_reply_write(req, size);
 }
 
+/**
+ * Flush all dirty state to the backing file.
+ *
+ * The filesystem is small enough that syncing everything is simpler than
+ * tracking per-file durability, and it also covers fsyncdir. An fsync joins
+ * the next group commit like any metadata operation.
+ */
+static void assign5_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+  struct fuse_file_info * fi) {
+  journal_reply_ok(req);
+}
+
+static void assign5_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+  struct fuse_file_info * fi) {
+  journal_reply_ok(req);
+}
+
+/*
+ * Every operation holds fs_lock shared, so that the journal committer can
+ * briefly exclude them all; finer-grained locks inside the handlers do the
+ * rest. The wrappers also time each operation (lock wait included, but not
+ * the wait for a group commit) for /.stats and /.trace.
+ */
+#define OP_INODE(req, ino, ...) (ino)
+
+#define LOCKED_OP_AT(op, params, args, ino) \
+  static void locked_ ## op params { \
+    uint64_t start = clock_ns(); \
+    pthread_rwlock_rdlock( & fs_lock); \
+    __atomic_add_fetch( & journal.active, 1, __ATOMIC_RELAXED); \
+    assign5_ ## op args; \
+    __atomic_sub_fetch( & journal.active, 1, __ATOMIC_RELAXED); \
+    pthread_rwlock_unlock( & fs_lock); \
+    op_done(OP_ ## op, ino, start); \
+  }
+
+#define LOCKED_OP(op, params, args) LOCKED_OP_AT(op, params, args, OP_INODE args)
+
+LOCKED_OP(create, (fuse_req_t req, fuse_ino_t parent, const char * name,
+  mode_t mode, struct fuse_file_info * fi), (req, parent, name, mode, fi))
+LOCKED_OP(fallocate, (fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+  off_t length, struct fuse_file_info * fi), (req, ino, mode, offset, length, fi))
+LOCKED_OP(forget, (fuse_req_t req, fuse_ino_t ino, uint64_t nlookup),
+  (req, ino, nlookup))
+// A batch has no single inode to trace
+LOCKED_OP_AT(forget_multi, (fuse_req_t req, size_t count,
+  struct fuse_forget_data * forgets), (req, count, forgets), 0)
+LOCKED_OP(fsync, (fuse_req_t req, fuse_ino_t ino, int datasync,
+  struct fuse_file_info * fi), (req, ino, datasync, fi))
+LOCKED_OP(fsyncdir, (fuse_req_t req, fuse_ino_t ino, int datasync,
+  struct fuse_file_info * fi), (req, ino, datasync, fi))
+LOCKED_OP(getattr, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi),
+  (req, ino, fi))
+LOCKED_OP(getxattr, (fuse_req_t req, fuse_ino_t ino, const char * name,
+  size_t size), (req, ino, name, size))
+LOCKED_OP(link, (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+  const char * newname), (req, ino, newparent, newname))
+LOCKED_OP(listxattr, (fuse_req_t req, fuse_ino_t ino, size_t size),
+  (req, ino, size))
+LOCKED_OP(lookup, (fuse_req_t req, fuse_ino_t parent, const char * name),
+  (req, parent, name))
+LOCKED_OP(mkdir, (fuse_req_t req, fuse_ino_t parent, const char * name,
+  mode_t mode), (req, parent, name, mode))
+LOCKED_OP(mknod, (fuse_req_t req, fuse_ino_t parent, const char * name,
+  mode_t mode, dev_t rdev), (req, parent, name, mode, rdev))
+LOCKED_OP(open, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi),
+  (req, ino, fi))
+LOCKED_OP(opendir, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * fi),
+  (req, ino, fi))
+LOCKED_OP(read, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+  struct fuse_file_info * fi), (req, ino, size, off, fi))
+LOCKED_OP(readdir, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+  struct fuse_file_info * fi), (req, ino, size, off, fi))
+LOCKED_OP(readdirplus, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+  struct fuse_file_info * fi), (req, ino, size, off, fi))
+LOCKED_OP(release, (fuse_req_t req, fuse_ino_t ino,
+  struct fuse_file_info * fi), (req, ino, fi))
+LOCKED_OP(releasedir, (fuse_req_t req, fuse_ino_t ino,
+  struct fuse_file_info * fi), (req, ino, fi))
+LOCKED_OP(removexattr, (fuse_req_t req, fuse_ino_t ino, const char * name),
+  (req, ino, name))
+LOCKED_OP(rename, (fuse_req_t req, fuse_ino_t parent, const char * name,
+  fuse_ino_t newparent, const char * newname, unsigned int flags),
+  (req, parent, name, newparent, newname, flags))
+LOCKED_OP(rmdir, (fuse_req_t req, fuse_ino_t parent, const char * name),
+  (req, parent, name))
+LOCKED_OP(setattr, (fuse_req_t req, fuse_ino_t ino, struct stat * attr,
+  int to_set, struct fuse_file_info * fi), (req, ino, attr, to_set, fi))
+LOCKED_OP(setxattr, (fuse_req_t req, fuse_ino_t ino, const char * name,
+  const char * value, size_t size, int flags),
+  (req, ino, name, value, size, flags))
+LOCKED_OP(statfs, (fuse_req_t req, fuse_ino_t ino), (req, ino))
+LOCKED_OP(unlink, (fuse_req_t req, fuse_ino_t parent, const char * name),
+  (req, parent, name))
+LOCKED_OP(write, (fuse_req_t req, fuse_ino_t ino, const char * buf,
+  size_t size, off_t off, struct fuse_file_info * fi),
+  (req, ino, buf, size, off, fi))
+
 static struct fuse_lowlevel_ops assign5_ops = {
   .init = assign5_init,
   .destroy = assign5_destroy,
 
-  .create = assign5_create,
-  .getattr = assign5_getattr,
-  .lookup = assign5_lookup,
-  .mkdir = assign5_mkdir,
-  .mknod = assign5_mknod,
-  .open = assign5_open,
-  .read = assign5_read,
-  .readdir = assign5_readdir,
-  .rmdir = assign5_rmdir,
-  .setattr = assign5_setattr,
-  .statfs = assign5_statfs,
-  .unlink = assign5_unlink,
-  .write = assign5_write,
+  .create = locked_create,
+  .fallocate = locked_fallocate,
+  .forget = locked_forget,
+  .forget_multi = locked_forget_multi,
+  .fsync = locked_fsync,
+  .fsyncdir = locked_fsyncdir,
+  .getattr = locked_getattr,
+  .getxattr = locked_getxattr,
+  .link = locked_link,
+  .listxattr = locked_listxattr,
+  .lookup = locked_lookup,
+  .mkdir = locked_mkdir,
+  .mknod = locked_mknod,
+  .open = locked_open,
+  .opendir = locked_opendir,
+  .read = locked_read,
+  .readdir = locked_readdir,
+  .readdirplus = locked_readdirplus,
+  .release = locked_release,
+  .releasedir = locked_releasedir,
+  .removexattr = locked_removexattr,
+  .rename = locked_rename,
+  .rmdir = locked_rmdir,
+  .setattr = locked_setattr,
+  .setxattr = locked_setxattr,
+  .statfs = locked_statfs,
+  .unlink = locked_unlink,
+  .write = locked_write,
 };
 
 struct fuse_lowlevel_ops *
@@ -14,9 +14,49 @@
  * limitations under the License.
  */
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 31
 #include <fuse_lowlevel.h>
 
+/**
+ * Tunables, set with `-o name=value` on the command line
+ *
+ * A zeroed structure selects the defaults.
+ */
+struct assign5_options {
+	/// Block cache mode: 0 for the built-in CLOCK cache, 1 to mmap(2)
+	/// the backing file and let the kernel's page cache do the work
+	int		 ao_cache_mmap;
+
+	/// Memory budget of the CLOCK block cache, in MiB (0: default)
+	unsigned	 ao_cache_mb;
+
+	/// Commit each metadata operation with its own fdatasync(2) instead
+	/// of grouping concurrent operations into one journal commit
+	int		 ao_commit_sync;
+
+	/// How long a group commit waits for more operations, in
+	/// microseconds (0: default)
+	unsigned	 ao_commit_window_us;
+
+	/// Number of recent operations to keep in /.trace (0: tracing off)
+	unsigned	 ao_trace_entries;
+
+	/// Share the memory of file pages with identical contents
+	int		 ao_dedup;
+
+	/// Let the kernel cache writes and send them back in batches, which
+	/// speeds up small writes but slows down large ones
+	int		 ao_writeback_cache;
+
+	/// Seconds a file must go unused before its pages are compressed
+	/// (0: compression off)
+	unsigned	 ao_compress_idle;
+
+	/// Keep a compressed page only if it shrinks to this percentage of
+	/// its size or less (0: default)
+	unsigned	 ao_compress_ratio;
+};
+
 /**
  * Information about the file backing our filesystem
  */
@@ -26,6 +66,13 @@ struct backing_file {
 
 	/// File descriptor of the backing file (if opened)
 	int		 bf_fd;
+
+	/// Session for kernel cache invalidations (NULL: none, so the
+	/// kernel only caches attributes briefly)
+	struct fuse_session	*bf_session;
+
+	/// Command-line tunables
+	struct assign5_options	 bf_options;
 };
 
 struct fuse_lowlevel_ops*	assign5_fuse_ops(void);
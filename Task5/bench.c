@@ -0,0 +1,1660 @@
+/**
+ * @file  bench.c
+ * @brief Benchmark driver that calls a filesystem's fuse_lowlevel_ops
+ *        directly, without /dev/fuse or a mount, and reports operation
+ *        rates, latency percentiles and (where the hardware counts them)
+ *        cache misses for scripted workloads.
+ *
+ * The driver stands in for libfuse: it defines struct fuse_req and the
+ * fuse_reply_*() functions the filesystems call, so it is linked without
+ * libfuse. A request is finished when its reply arrives, which may be on
+ * another thread (assign5 answers metadata changes from its journal
+ * committer once they are durable).
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "assign5.h"
+
+
+#define	ROOT_DIR	1
+
+// Depth of the directory chain walked by the lookup workload
+#define	LOOKUP_DEPTH	16
+
+// Default number of entries in the directory listed by the readdir
+// workload (no more than the operations per workload, though)
+#define	READDIR_ENTRIES	10000
+
+// Buffer size of a readdir request, as the kernel sends them
+#define	READDIR_SIZE	4096
+
+// Largest file the other IO workloads work in; offsets wrap around past
+// it (append, below, grows its files without a limit)
+#define	IO_FILE_MAX	(64 << 20)
+
+// Default size the append workload grows each file to, and the first of
+// the sizes (each four times the last) it reports the throughput at
+#define	APPEND_SIZE	(1UL << 30)
+#define	APPEND_MARK	(1UL << 20)
+#define	APPEND_MARKS	24
+
+#define	MAX_THREADS	64
+
+
+/**
+ * One request and its reply. The reply functions below fill it in and
+ * wake whoever is waiting for it.
+ */
+struct fuse_req {
+	pthread_mutex_t		 lock;
+	pthread_cond_t		 cond;
+	bool			 done;
+
+	int			 err;
+	struct fuse_entry_param	 entry;
+	struct fuse_file_info	 fi;
+	struct stat		 attr;
+	// Bytes written, or the size of a buf/iov/xattr reply
+	size_t			 size;
+
+	// Where to copy the data of a buf or iov reply (NULL: discard it)
+	char			*buf;
+	size_t			 buf_size;
+};
+
+// Layout of a directory entry in a readdir reply (struct fuse_dirent)
+struct bench_dirent {
+	uint64_t	ino;
+	uint64_t	off;
+	uint32_t	namelen;
+	uint32_t	type;
+	char		name[];
+};
+
+// Layout of an entry in a readdirplus reply (struct fuse_direntplus): what
+// a lookup would have replied (struct fuse_entry_out), then the entry
+struct bench_direntplus {
+	uint64_t	nodeid;
+	uint64_t	generation;
+	uint64_t	entry_valid;
+	uint64_t	attr_valid;
+	uint32_t	entry_valid_nsec;
+	uint32_t	attr_valid_nsec;
+	// struct fuse_attr, which the driver doesn't look at
+	uint8_t		attr[88];
+	struct bench_dirent	dirent;
+};
+
+/**
+ * State shared by the threads running a workload.
+ */
+struct bench {
+	struct fuse_lowlevel_ops	*ops;
+	struct backing_file		 backing;
+
+	size_t		 ops_per_workload;
+	size_t		 dir_entries;
+	int		 threads;
+	size_t		 io_size;
+	size_t		 append_size;
+	unsigned	 seed;
+
+	// Directory the create workload fills
+	fuse_ino_t	 create_dir;
+	size_t		 create_count;
+
+	// Path walked by the lookup workload
+	fuse_ino_t	 lookup_parent[LOOKUP_DEPTH];
+	char		 lookup_name[LOOKUP_DEPTH][32];
+	int		 lookup_depth;
+
+	// Directory listed by the readdir workload, and the names the scan
+	// workload looks up in it
+	fuse_ino_t	 readdir_dir;
+	char		**scan_names;
+	size_t		 scan_count;
+
+	// Per-thread files for the IO workloads, and how much of each holds
+	// data; on a filesystem that can't create files, all threads read
+	// the one file that was found
+	fuse_ino_t	 io_file[MAX_THREADS];
+	struct fuse_file_info	io_fi[MAX_THREADS];
+	bool		 io_open;
+	size_t		 io_filled;
+	bool		 io_readonly;
+
+	// A regular file found by walking the tree, for read-only filesystems
+	fuse_ino_t	 found_parent[LOOKUP_DEPTH];
+	char		 found_name[LOOKUP_DEPTH][32];
+	int		 found_depth;
+	off_t		 found_size;
+
+	// Per-thread files the append workload grows (new ones every run)
+	fuse_ino_t	 append_file[MAX_THREADS];
+	struct fuse_file_info	append_fi[MAX_THREADS];
+	bool		 append_open;
+	size_t		 append_count;
+};
+
+/**
+ * One worker thread's share of a workload.
+ */
+struct bench_thread {
+	struct bench	*bench;
+	const struct workload	*workload;
+	int		 id;
+	size_t		 first;
+	size_t		 count;
+	unsigned	 rand;
+
+	uint64_t	*latency_ns;
+	size_t		 done;
+	uint64_t	 start_ns;
+	int		 err;
+
+	// Directory entries or bytes moved, for the throughput column
+	uint64_t	 units;
+
+	// When the append workload started, and when the file reached each
+	// of the first `append_marks` report sizes
+	uint64_t	 append_start_ns;
+	uint64_t	 append_mark_ns[APPEND_MARKS];
+	int		 append_marks;
+};
+
+struct workload {
+	const char	*name;
+	const char	*description;
+	// Prepare untimed state (an errno value skips the workload)
+	int		(*setup)(struct bench *);
+	// Run operation `i`, timing it with op_begin() and op_end()
+	int		(*run)(struct bench_thread *, size_t i);
+	// What `units` counts, if anything
+	const char	*units;
+	// Operations to run, if not ops_per_workload
+	size_t		(*ops)(struct bench *);
+	// Print more results after the workload's line
+	void		(*report)(struct bench *, const struct bench_thread *);
+};
+
+
+//
+// Reply shim: the parts of libfuse's lowlevel API the filesystems use
+//
+
+static void
+req_init(struct fuse_req *req, char *buf, size_t buf_size)
+{
+	memset(req, 0, sizeof(*req));
+	pthread_mutex_init(&req->lock, NULL);
+	pthread_cond_init(&req->cond, NULL);
+	req->buf = buf;
+	req->buf_size = buf_size;
+}
+
+static void
+req_done(struct fuse_req *req)
+{
+	pthread_mutex_lock(&req->lock);
+	req->done = true;
+	pthread_cond_signal(&req->cond);
+	pthread_mutex_unlock(&req->lock);
+}
+
+/**
+ * Wait for the reply to `req`.
+ *
+ * @returns    the errno value it carried (0 for success)
+ */
+static int
+req_wait(struct fuse_req *req)
+{
+	pthread_mutex_lock(&req->lock);
+	while (!req->done) {
+		pthread_cond_wait(&req->cond, &req->lock);
+	}
+	pthread_mutex_unlock(&req->lock);
+
+	pthread_cond_destroy(&req->cond);
+	pthread_mutex_destroy(&req->lock);
+	return req->err;
+}
+
+static void
+req_copy(struct fuse_req *req, const void *data, size_t size)
+{
+	if (req->buf != NULL && req->size < req->buf_size) {
+		size_t room = req->buf_size - req->size;
+		memcpy(req->buf + req->size, data, size < room ? size : room);
+	}
+	req->size += size;
+}
+
+int
+fuse_reply_err(fuse_req_t req, int err)
+{
+	req->err = err;
+	req_done(req);
+	return 0;
+}
+
+void
+fuse_reply_none(fuse_req_t req)
+{
+	req_done(req);
+}
+
+int
+fuse_reply_entry(fuse_req_t req, const struct fuse_entry_param *e)
+{
+	req->entry = *e;
+	req_done(req);
+	return 0;
+}
+
+int
+fuse_reply_create(fuse_req_t req, const struct fuse_entry_param *e,
+	const struct fuse_file_info *fi)
+{
+	req->entry = *e;
+	req->fi = *fi;
+	req_done(req);
+	return 0;
+}
+
+int
+fuse_reply_attr(fuse_req_t req, const struct stat *attr, double timeout)
+{
+	req->attr = *attr;
+	req_done(req);
+	return 0;
+}
+
+int
+fuse_reply_open(fuse_req_t req, const struct fuse_file_info *fi)
+{
+	req->fi = *fi;
+	req_done(req);
+	return 0;
+}
+
+int
+fuse_reply_write(fuse_req_t req, size_t count)
+{
+	req->size = count;
+	req_done(req);
+	return 0;
+}
+
+int
+fuse_reply_buf(fuse_req_t req, const char *buf, size_t size)
+{
+	req_copy(req, buf, size);
+	req_done(req);
+	return 0;
+}
+
+int
+fuse_reply_iov(fuse_req_t req, const struct iovec *iov, int count)
+{
+	for (int i = 0; i < count; i++) {
+		req_copy(req, iov[i].iov_base, iov[i].iov_len);
+	}
+	req_done(req);
+	return 0;
+}
+
+int
+fuse_reply_statfs(fuse_req_t req, const struct statvfs *stbuf)
+{
+	req_done(req);
+	return 0;
+}
+
+int
+fuse_reply_xattr(fuse_req_t req, size_t count)
+{
+	req->size = count;
+	req_done(req);
+	return 0;
+}
+
+size_t
+fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize,
+	const char *name, const struct stat *stbuf, off_t off)
+{
+	size_t namelen = strlen(name);
+	size_t entsize = (offsetof(struct bench_dirent, name) + namelen + 7)
+		& ~(size_t) 7;
+
+	if (buf == NULL || entsize > bufsize) {
+		return entsize;
+	}
+
+	struct bench_dirent *dirent = (struct bench_dirent *) buf;
+	dirent->ino = stbuf->st_ino;
+	dirent->off = off;
+	dirent->namelen = namelen;
+	dirent->type = (stbuf->st_mode & S_IFMT) >> 12;
+	memcpy(dirent->name, name, namelen);
+	memset(dirent->name + namelen, 0,
+		entsize - offsetof(struct bench_dirent, name) - namelen);
+
+	return entsize;
+}
+
+size_t
+fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
+	const char *name, const struct fuse_entry_param *e, off_t off)
+{
+	size_t namelen = strlen(name);
+	size_t entsize = (offsetof(struct bench_direntplus, dirent.name)
+		+ namelen + 7) & ~(size_t) 7;
+
+	if (buf == NULL || entsize > bufsize) {
+		return entsize;
+	}
+
+	struct bench_direntplus *dirent = (struct bench_direntplus *) buf;
+	memset(dirent, 0, entsize);
+	dirent->nodeid = e->ino;
+	dirent->generation = e->generation;
+	dirent->dirent.ino = e->attr.st_ino;
+	dirent->dirent.off = off;
+	dirent->dirent.namelen = namelen;
+	dirent->dirent.type = (e->attr.st_mode & S_IFMT) >> 12;
+	memcpy(dirent->dirent.name, name, namelen);
+
+	return entsize;
+}
+
+int
+fuse_lowlevel_notify_inval_inode(struct fuse_session *se, fuse_ino_t ino,
+	off_t off, off_t len)
+{
+	// There is no kernel cache to invalidate
+	return 0;
+}
+
+
+//
+// Operations, as the kernel would send them. An operation the filesystem
+// leaves out gets libfuse's default: ENOSYS, or success for open/release.
+//
+
+static int
+do_lookup(struct bench *b, fuse_ino_t parent, const char *name,
+	struct fuse_entry_param *entry)
+{
+	if (b->ops->lookup == NULL) {
+		return ENOSYS;
+	}
+
+	struct fuse_req req;
+	req_init(&req, NULL, 0);
+	b->ops->lookup(&req, parent, name);
+	int err = req_wait(&req);
+	if (err == 0 && entry != NULL) {
+		*entry = req.entry;
+	}
+	return err;
+}
+
+static int
+do_mkdir(struct bench *b, fuse_ino_t parent, const char *name,
+	fuse_ino_t *ino)
+{
+	if (b->ops->mkdir == NULL) {
+		return ENOSYS;
+	}
+
+	struct fuse_req req;
+	req_init(&req, NULL, 0);
+	b->ops->mkdir(&req, parent, name, S_IFDIR | 0755);
+	int err = req_wait(&req);
+	if (err == ENOSYS || err == EEXIST) {
+		return err;
+	}
+	*ino = req.entry.ino;
+	return err;
+}
+
+/**
+ * Create `name` in `parent`, leaving it open in `fi`.
+ */
+static int
+do_create(struct bench *b, fuse_ino_t parent, const char *name,
+	fuse_ino_t *ino, struct fuse_file_info *fi)
+{
+	if (b->ops->create == NULL) {
+		return ENOSYS;
+	}
+
+	struct fuse_req req;
+	req_init(&req, NULL, 0);
+	memset(fi, 0, sizeof(*fi));
+	fi->flags = O_RDWR | O_CREAT;
+	b->ops->create(&req, parent, name, S_IFREG | 0644, fi);
+	int err = req_wait(&req);
+	if (err == 0) {
+		*ino = req.entry.ino;
+		*fi = req.fi;
+	}
+	return err;
+}
+
+static int
+do_open(struct bench *b, fuse_ino_t ino, int flags, bool dir,
+	struct fuse_file_info *fi)
+{
+	memset(fi, 0, sizeof(*fi));
+	fi->flags = flags;
+
+	void (*op)(fuse_req_t, fuse_ino_t, struct fuse_file_info *) =
+		dir ? b->ops->opendir : b->ops->open;
+	if (op == NULL) {
+		return 0;
+	}
+
+	struct fuse_req req;
+	req_init(&req, NULL, 0);
+	op(&req, ino, fi);
+	return req_wait(&req);
+}
+
+static void
+do_release(struct bench *b, fuse_ino_t ino, bool dir,
+	struct fuse_file_info *fi)
+{
+	void (*op)(fuse_req_t, fuse_ino_t, struct fuse_file_info *) =
+		dir ? b->ops->releasedir : b->ops->release;
+	if (op == NULL) {
+		return;
+	}
+
+	struct fuse_req req;
+	req_init(&req, NULL, 0);
+	op(&req, ino, fi);
+	req_wait(&req);
+}
+
+static int
+do_write(struct bench *b, fuse_ino_t ino, const char *buf, size_t size,
+	off_t off, struct fuse_file_info *fi)
+{
+	if (b->ops->write == NULL) {
+		return ENOSYS;
+	}
+
+	struct fuse_req req;
+	req_init(&req, NULL, 0);
+	b->ops->write(&req, ino, buf, size, off, fi);
+	int err = req_wait(&req);
+	return (err == 0 && req.size != size) ? EIO : err;
+}
+
+/**
+ * Read up to `size` bytes into `buf`.
+ *
+ * @returns    0 or an errno value, with the length read in `got`
+ */
+static int
+do_read(struct bench *b, fuse_ino_t ino, char *buf, size_t size, off_t off,
+	struct fuse_file_info *fi, size_t *got)
+{
+	if (b->ops->read == NULL) {
+		return ENOSYS;
+	}
+
+	struct fuse_req req;
+	req_init(&req, buf, size);
+	b->ops->read(&req, ino, size, off, fi);
+	int err = req_wait(&req);
+	*got = req.size;
+	return err;
+}
+
+static int
+do_readdir(struct bench *b, fuse_ino_t ino, char *buf, off_t off,
+	struct fuse_file_info *fi, size_t *got)
+{
+	if (b->ops->readdir == NULL) {
+		return ENOSYS;
+	}
+
+	struct fuse_req req;
+	req_init(&req, buf, READDIR_SIZE);
+	b->ops->readdir(&req, ino, READDIR_SIZE, off, fi);
+	int err = req_wait(&req);
+	*got = req.size;
+	return err;
+}
+
+static int
+do_readdirplus(struct bench *b, fuse_ino_t ino, char *buf, off_t off,
+	struct fuse_file_info *fi, size_t *got)
+{
+	if (b->ops->readdirplus == NULL) {
+		return ENOSYS;
+	}
+
+	struct fuse_req req;
+	req_init(&req, buf, READDIR_SIZE);
+	b->ops->readdirplus(&req, ino, READDIR_SIZE, off, fi);
+	int err = req_wait(&req);
+	*got = req.size;
+	return err;
+}
+
+/**
+ * Drop `nlookup` references to `ino`, as the kernel does when it evicts an
+ * inode it got from a lookup or a readdirplus entry.
+ */
+static void
+do_forget(struct bench *b, fuse_ino_t ino, uint64_t nlookup)
+{
+	if (b->ops->forget == NULL) {
+		return;
+	}
+
+	struct fuse_req req;
+	req_init(&req, NULL, 0);
+	b->ops->forget(&req, ino, nlookup);
+	req_wait(&req);
+}
+
+
+//
+// Timing
+//
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void
+op_begin(struct bench_thread *t)
+{
+	t->start_ns = now_ns();
+}
+
+static void
+op_end(struct bench_thread *t)
+{
+	t->latency_ns[t->done++] = now_ns() - t->start_ns;
+}
+
+static unsigned
+next_rand(struct bench_thread *t)
+{
+	// xorshift32: cheap enough not to show up in the latencies
+	t->rand ^= t->rand << 13;
+	t->rand ^= t->rand >> 17;
+	t->rand ^= t->rand << 5;
+	return t->rand;
+}
+
+
+//
+// Finding a file on a filesystem the driver can't write to
+//
+
+/**
+ * Walk down from the root, taking the first entry of each directory, to
+ * the first regular file.
+ */
+static int
+find_file(struct bench *b)
+{
+	if (b->found_depth > 0) {
+		return 0;
+	}
+
+	char *buf = malloc(READDIR_SIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	fuse_ino_t dir = ROOT_DIR;
+	int err = ENOENT;
+
+	while (b->found_depth < LOOKUP_DEPTH) {
+		struct fuse_file_info fi;
+		size_t got = 0;
+		if ((err = do_open(b, dir, O_RDONLY, true, &fi)) != 0) {
+			break;
+		}
+		err = do_readdir(b, dir, buf, 0, &fi, &got);
+		do_release(b, dir, true, &fi);
+		if (err != 0) {
+			break;
+		}
+
+		// The first entry that isn't "." or ".."
+		struct bench_dirent *dirent = NULL;
+		for (size_t pos = 0; pos < got; ) {
+			struct bench_dirent *d = (struct bench_dirent *)(buf + pos);
+			pos += (offsetof(struct bench_dirent, name) + d->namelen
+				+ 7) & ~(size_t) 7;
+			if (!(d->namelen <= 2 && strncmp(d->name, "..",
+				d->namelen) == 0) && d->namelen < 32) {
+				dirent = d;
+				break;
+			}
+		}
+
+		struct fuse_entry_param entry;
+		if (dirent == NULL) {
+			err = ENOENT;
+			break;
+		}
+
+		int depth = b->found_depth++;
+		b->found_parent[depth] = dir;
+		memcpy(b->found_name[depth], dirent->name, dirent->namelen);
+		b->found_name[depth][dirent->namelen] = '\0';
+		if ((err = do_lookup(b, dir, b->found_name[depth], &entry)) != 0) {
+			break;
+		}
+
+		if (S_ISREG(entry.attr.st_mode)) {
+			b->io_file[0] = entry.ino;
+			b->found_size = entry.attr.st_size;
+			break;
+		}
+		dir = entry.ino;
+		err = ENOENT;
+	}
+
+	free(buf);
+	if (err != 0) {
+		b->found_depth = 0;
+	}
+	return err;
+}
+
+
+//
+// Workloads
+//
+
+static int
+create_setup(struct bench *b)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "bench-create.%zu", b->create_count++);
+	return do_mkdir(b, ROOT_DIR, name, &b->create_dir);
+}
+
+static int
+create_run(struct bench_thread *t, size_t i)
+{
+	struct bench *b = t->bench;
+	struct fuse_file_info fi;
+	fuse_ino_t ino;
+	char name[32];
+	snprintf(name, sizeof(name), "f%zu", i);
+
+	op_begin(t);
+	int err = do_create(b, b->create_dir, name, &ino, &fi);
+	op_end(t);
+
+	if (err == 0) {
+		do_release(b, ino, false, &fi);
+	}
+	return err;
+}
+
+static int
+lookup_setup(struct bench *b)
+{
+	if (b->lookup_depth > 0) {
+		return 0;
+	}
+
+	fuse_ino_t dir = ROOT_DIR;
+	int err = 0;
+	for (int d = 0; d < LOOKUP_DEPTH && err == 0; d++) {
+		b->lookup_parent[d] = dir;
+		snprintf(b->lookup_name[d], sizeof(b->lookup_name[d]),
+			d == 0 ? "bench-lookup" : "d%d", d);
+		err = do_mkdir(b, dir, b->lookup_name[d], &dir);
+	}
+
+	if (err == 0) {
+		b->lookup_depth = LOOKUP_DEPTH;
+		return 0;
+	}
+
+	// A read-only filesystem: walk the deepest path it already has
+	if (err == ENOSYS && (err = find_file(b)) == 0) {
+		memcpy(b->lookup_parent, b->found_parent, sizeof(b->lookup_parent));
+		memcpy(b->lookup_name, b->found_name, sizeof(b->lookup_name));
+		b->lookup_depth = b->found_depth;
+	}
+	return err;
+}
+
+static int
+lookup_run(struct bench_thread *t, size_t i)
+{
+	struct bench *b = t->bench;
+	int err = 0;
+
+	op_begin(t);
+	for (int d = 0; d < b->lookup_depth && err == 0; d++) {
+		err = do_lookup(b, b->lookup_parent[d], b->lookup_name[d], NULL);
+	}
+	op_end(t);
+
+	return err;
+}
+
+static int
+readdir_setup(struct bench *b)
+{
+	if (b->readdir_dir != 0) {
+		return 0;
+	}
+
+	int err = do_mkdir(b, ROOT_DIR, "bench-readdir", &b->readdir_dir);
+	if (err == ENOSYS) {
+		b->readdir_dir = ROOT_DIR;
+		return 0;
+	}
+
+	size_t count = b->dir_entries;
+	for (size_t i = 0; err == 0 && i < count; i++) {
+		struct fuse_file_info fi;
+		fuse_ino_t ino;
+		char name[32];
+		snprintf(name, sizeof(name), "entry-%zu", i);
+		if ((err = do_create(b, b->readdir_dir, name, &ino, &fi)) == 0) {
+			do_release(b, ino, false, &fi);
+		}
+	}
+	return err;
+}
+
+/**
+ * One readdir request per operation, starting a new listing (with a new
+ * opendir) whenever the last one reached the end.
+ */
+static int
+readdir_run(struct bench_thread *t, size_t i)
+{
+	struct bench *b = t->bench;
+	static __thread struct fuse_file_info fi;
+	static __thread off_t off;
+	static __thread bool listing;
+	char buf[READDIR_SIZE];
+	int err = 0;
+
+	if (!listing) {
+		if ((err = do_open(b, b->readdir_dir, O_RDONLY, true, &fi)) != 0) {
+			return err;
+		}
+		listing = true;
+		off = 0;
+	}
+
+	size_t got;
+	op_begin(t);
+	err = do_readdir(b, b->readdir_dir, buf, off, &fi, &got);
+	op_end(t);
+
+	for (size_t pos = 0; err == 0 && pos < got; t->units++) {
+		struct bench_dirent *d = (struct bench_dirent *)(buf + pos);
+		off = d->off;
+		pos += (offsetof(struct bench_dirent, name) + d->namelen + 7)
+			& ~(size_t) 7;
+	}
+
+	if (err != 0 || got == 0 || i == t->first + t->count - 1) {
+		do_release(b, b->readdir_dir, true, &fi);
+		listing = false;
+	}
+	return err;
+}
+
+/**
+ * One readdirplus request per operation, like readdir_run(), then forget
+ * the entries it returned so that the references don't pile up.
+ */
+static int
+readdirplus_run(struct bench_thread *t, size_t i)
+{
+	struct bench *b = t->bench;
+	static __thread struct fuse_file_info fi;
+	static __thread off_t off;
+	static __thread bool listing;
+	char buf[READDIR_SIZE];
+	int err = 0;
+
+	if (!listing) {
+		if ((err = do_open(b, b->readdir_dir, O_RDONLY, true, &fi)) != 0) {
+			return err;
+		}
+		listing = true;
+		off = 0;
+	}
+
+	size_t got;
+	op_begin(t);
+	err = do_readdirplus(b, b->readdir_dir, buf, off, &fi, &got);
+	op_end(t);
+
+	for (size_t pos = 0; err == 0 && pos < got; t->units++) {
+		struct bench_direntplus *d = (struct bench_direntplus *)(buf + pos);
+		off = d->dirent.off;
+		pos += (offsetof(struct bench_direntplus, dirent.name)
+			+ d->dirent.namelen + 7) & ~(size_t) 7;
+		if (d->nodeid != 0 && !(d->dirent.namelen <= 2
+		    && strncmp(d->dirent.name, "..", d->dirent.namelen) == 0)) {
+			do_forget(b, d->nodeid, 1);
+		}
+	}
+
+	if (err != 0 || got == 0 || i == t->first + t->count - 1) {
+		do_release(b, b->readdir_dir, true, &fi);
+		listing = false;
+	}
+	return err;
+}
+
+/**
+ * List the readdir workload's directory, as ls -l does before it looks up
+ * every name.
+ */
+static int
+scan_setup(struct bench *b)
+{
+	int err = readdir_setup(b);
+	if (err != 0 || b->scan_names != NULL) {
+		return err;
+	}
+
+	size_t capacity = 64;
+	b->scan_names = malloc(capacity * sizeof(*b->scan_names));
+	if (b->scan_names == NULL) {
+		return ENOMEM;
+	}
+
+	struct fuse_file_info fi;
+	char buf[READDIR_SIZE];
+	off_t off = 0;
+	size_t got;
+	if ((err = do_open(b, b->readdir_dir, O_RDONLY, true, &fi)) != 0) {
+		return err;
+	}
+
+	while ((err = do_readdir(b, b->readdir_dir, buf, off, &fi, &got)) == 0
+	    && got > 0) {
+		for (size_t pos = 0; pos < got && err == 0; ) {
+			struct bench_dirent *d = (struct bench_dirent *)(buf + pos);
+			off = d->off;
+			pos += (offsetof(struct bench_dirent, name) + d->namelen
+				+ 7) & ~(size_t) 7;
+			if (d->namelen <= 2 && strncmp(d->name, "..", d->namelen) == 0) {
+				continue;
+			}
+
+			if (b->scan_count == capacity) {
+				char **names = realloc(b->scan_names,
+					2 * capacity * sizeof(*names));
+				if (names == NULL) {
+					err = ENOMEM;
+					break;
+				}
+				b->scan_names = names;
+				capacity *= 2;
+			}
+			if ((b->scan_names[b->scan_count] = strndup(d->name,
+			    d->namelen)) == NULL) {
+				err = ENOMEM;
+				break;
+			}
+			b->scan_count++;
+		}
+	}
+	do_release(b, b->readdir_dir, true, &fi);
+
+	return (err == 0 && b->scan_count == 0) ? ENOENT : err;
+}
+
+/**
+ * Look up a random name of the directory: with thousands of entries, the
+ * hash chains and nodes walked are rarely in cache.
+ */
+static int
+scan_run(struct bench_thread *t, size_t i)
+{
+	struct bench *b = t->bench;
+	const char *name = b->scan_names[next_rand(t) % b->scan_count];
+
+	op_begin(t);
+	int err = do_lookup(b, b->readdir_dir, name, NULL);
+	op_end(t);
+
+	return err;
+}
+
+/**
+ * Create (or find) the files the IO workloads use and open them.
+ */
+static int
+io_setup(struct bench *b)
+{
+	if (b->io_open) {
+		return 0;
+	}
+
+	int err = 0;
+	for (int i = 0; i < b->threads && err == 0; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "bench-io.%d", i);
+		err = do_create(b, ROOT_DIR, name, &b->io_file[i], &b->io_fi[i]);
+	}
+
+	if (err == ENOSYS && (err = find_file(b)) == 0) {
+		b->io_readonly = true;
+		for (int i = 0; i < b->threads && err == 0; i++) {
+			b->io_file[i] = b->io_file[0];
+			err = do_open(b, b->io_file[i], O_RDONLY, false, &b->io_fi[i]);
+		}
+	}
+
+	b->io_open = (err == 0);
+	return err;
+}
+
+static size_t
+io_span(struct bench *b)
+{
+	if (b->io_readonly) {
+		return b->found_size;
+	}
+
+	size_t per_thread = (b->ops_per_workload + b->threads - 1) / b->threads;
+	size_t span = per_thread * b->io_size;
+	return span < IO_FILE_MAX ? span : IO_FILE_MAX;
+}
+
+/**
+ * The IO workloads write by default; reads need the files filled first.
+ */
+static int
+io_fill(struct bench *b)
+{
+	int err = io_setup(b);
+	if (err != 0 || b->io_readonly || b->io_filled >= io_span(b)) {
+		return err;
+	}
+
+	char *buf = malloc(b->io_size);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	memset(buf, 'x', b->io_size);
+
+	for (int i = 0; i < b->threads && err == 0; i++) {
+		for (size_t off = 0; off < io_span(b) && err == 0; off += b->io_size) {
+			err = do_write(b, b->io_file[i], buf, b->io_size, off,
+				&b->io_fi[i]);
+		}
+	}
+
+	free(buf);
+	b->io_filled = io_span(b);
+	return err;
+}
+
+static int
+write_setup(struct bench *b)
+{
+	int err = io_setup(b);
+	return (err == 0 && b->io_readonly) ? ENOSYS : err;
+}
+
+static off_t
+io_offset(struct bench_thread *t, size_t i, bool random)
+{
+	size_t blocks = io_span(t->bench) / t->bench->io_size;
+	if (blocks == 0) {
+		return 0;
+	}
+
+	size_t block = random ? next_rand(t) % blocks : (i - t->first) % blocks;
+	return (off_t) block * t->bench->io_size;
+}
+
+static int
+io_write(struct bench_thread *t, size_t i, bool random)
+{
+	struct bench *b = t->bench;
+	static __thread char *buf;
+	if (buf == NULL && (buf = malloc(b->io_size)) == NULL) {
+		return ENOMEM;
+	}
+	memset(buf, (int) i, b->io_size);
+
+	off_t off = io_offset(t, i, random);
+	op_begin(t);
+	int err = do_write(b, b->io_file[t->id], buf, b->io_size, off,
+		&b->io_fi[t->id]);
+	op_end(t);
+
+	if (err == 0) {
+		t->units += b->io_size;
+		if ((size_t) off + b->io_size > b->io_filled) {
+			// Racy across threads, but only ever grows to the span
+			b->io_filled = off + b->io_size;
+		}
+	}
+	return err;
+}
+
+static int
+io_read(struct bench_thread *t, size_t i, bool random)
+{
+	struct bench *b = t->bench;
+	static __thread char *buf;
+	if (buf == NULL && (buf = malloc(b->io_size)) == NULL) {
+		return ENOMEM;
+	}
+
+	size_t got;
+	off_t off = io_offset(t, i, random);
+	op_begin(t);
+	int err = do_read(b, b->io_file[t->id], buf, b->io_size, off,
+		&b->io_fi[t->id], &got);
+	op_end(t);
+
+	t->units += got;
+	return err;
+}
+
+static int
+seqwrite_run(struct bench_thread *t, size_t i)
+{
+	return io_write(t, i, false);
+}
+
+static int
+randwrite_run(struct bench_thread *t, size_t i)
+{
+	return io_write(t, i, true);
+}
+
+static int
+seqread_run(struct bench_thread *t, size_t i)
+{
+	return io_read(t, i, false);
+}
+
+static int
+randread_run(struct bench_thread *t, size_t i)
+{
+	return io_read(t, i, true);
+}
+
+static void
+append_close(struct bench *b)
+{
+	for (int i = 0; b->append_open && i < b->threads; i++) {
+		do_release(b, b->append_file[i], false, &b->append_fi[i]);
+	}
+	b->append_open = false;
+}
+
+/**
+ * Create an empty file per thread and open it for appending.
+ */
+static int
+append_setup(struct bench *b)
+{
+	append_close(b);
+
+	size_t run = b->append_count++;
+	int err = 0;
+	for (int i = 0; i < b->threads && err == 0; i++) {
+		char name[48];
+		struct fuse_file_info fi;
+		snprintf(name, sizeof(name), "bench-append.%zu.%d", run, i);
+		if ((err = do_create(b, ROOT_DIR, name, &b->append_file[i],
+			&fi)) != 0) {
+			break;
+		}
+		do_release(b, b->append_file[i], false, &fi);
+		err = do_open(b, b->append_file[i], O_WRONLY | O_APPEND, false,
+			&b->append_fi[i]);
+	}
+
+	b->append_open = (err == 0);
+	return err;
+}
+
+static size_t
+append_ops(struct bench *b)
+{
+	return b->threads * (b->append_size / b->io_size);
+}
+
+static int
+append_run(struct bench_thread *t, size_t i)
+{
+	struct bench *b = t->bench;
+	static __thread char *buf;
+	if (buf == NULL && (buf = malloc(b->io_size)) == NULL) {
+		return ENOMEM;
+	}
+	memset(buf, (int) i, b->io_size);
+
+	// Where O_APPEND puts it anyway, for filesystems that ignore the flag
+	off_t off = (off_t) (i - t->first) * b->io_size;
+	if (off == 0) {
+		t->append_start_ns = now_ns();
+	}
+
+	op_begin(t);
+	int err = do_write(b, b->append_file[t->id], buf, b->io_size, off,
+		&b->append_fi[t->id]);
+	op_end(t);
+
+	if (err == 0) {
+		t->units += b->io_size;
+		while (t->append_marks < APPEND_MARKS && (size_t) off +
+		    b->io_size >= APPEND_MARK << (2 * t->append_marks)) {
+			t->append_mark_ns[t->append_marks++] = now_ns();
+		}
+	}
+	return err;
+}
+
+/**
+ * Throughput up to each report size (across every thread's file, from the
+ * first thread's start to the last one's reaching it), and within the
+ * step from the size before.
+ */
+static void
+append_report(struct bench *b, const struct bench_thread *threads)
+{
+	uint64_t start = UINT64_MAX;
+	for (int i = 0; i < b->threads; i++) {
+		if (threads[i].count > 0 && threads[i].append_start_ns < start) {
+			start = threads[i].append_start_ns;
+		}
+	}
+
+	printf("  %-12s %14s %14s\n", "file MiB", "MiB/s to size",
+		"MiB/s in step");
+	uint64_t last = start;
+	size_t last_size = 0;
+	for (int mark = 0; mark < APPEND_MARKS; mark++) {
+		size_t size = APPEND_MARK << (2 * mark);
+		uint64_t end = 0;
+		for (int i = 0; i < b->threads; i++) {
+			if (threads[i].count == 0) {
+				continue;
+			}
+			if (threads[i].append_marks <= mark) {
+				end = 0;
+				break;
+			}
+			if (threads[i].append_mark_ns[mark] > end) {
+				end = threads[i].append_mark_ns[mark];
+			}
+		}
+		if (end == 0) {
+			break;
+		}
+
+		double mib = (double) b->threads / (1 << 20);
+		printf("  %-12zu %14.1f %14.1f\n", size >> 20,
+			size * mib / ((end - start) / 1e9),
+			(size - last_size) * mib / ((end - last) / 1e9));
+		last = end;
+		last_size = size;
+	}
+}
+
+static const struct workload workloads[] = {
+	{ "create", "create files in one directory",
+	  create_setup, create_run, NULL },
+	{ "lookup", "look up every component of a deep path",
+	  lookup_setup, lookup_run, NULL },
+	{ "readdir", "list a large directory, one request at a time",
+	  readdir_setup, readdir_run, "entries" },
+	{ "readdirplus", "list a large directory with attributes",
+	  readdir_setup, readdirplus_run, "entries" },
+	{ "scan", "look up random names in the large directory",
+	  scan_setup, scan_run, NULL },
+	{ "seqwrite", "write a file sequentially",
+	  write_setup, seqwrite_run, "bytes" },
+	{ "seqread", "read a file sequentially",
+	  io_fill, seqread_run, "bytes" },
+	{ "randwrite", "write at random offsets",
+	  write_setup, randwrite_run, "bytes" },
+	{ "randread", "read at random offsets",
+	  io_fill, randread_run, "bytes" },
+	{ "append", "grow a new file to the -a size, one write at a time",
+	  append_setup, append_run, "bytes", append_ops, append_report },
+};
+
+#define	WORKLOAD_COUNT	(sizeof(workloads) / sizeof(workloads[0]))
+
+
+//
+// Driver
+//
+
+static void *
+bench_thread_main(void *arg)
+{
+	struct bench_thread *t = arg;
+
+	for (size_t i = t->first; i < t->first + t->count && t->err == 0; i++) {
+		t->err = t->workload->run(t, i);
+	}
+	return NULL;
+}
+
+/**
+ * Open a counter of the cache misses of this thread and the threads it
+ * starts from now on (the workers, not the filesystem's own threads).
+ *
+ * @returns    a perf_event file descriptor, or -1 if the kernel or the
+ *             hardware won't count them
+ */
+static int
+miss_counter_open(void)
+{
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_HARDWARE,
+		.size = sizeof(attr),
+		.config = PERF_COUNT_HW_CACHE_MISSES,
+		.disabled = 1,
+		.inherit = 1,
+		.exclude_kernel = 1,
+		.exclude_hv = 1,
+	};
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+static uint64_t
+percentile(const uint64_t *sorted, size_t count, unsigned pct)
+{
+	if (count == 0) {
+		return 0;
+	}
+	size_t index = (count * pct + 99) / 100;
+	return sorted[index > 0 ? index - 1 : 0];
+}
+
+/**
+ * Run one workload on every thread and print a line of results.
+ *
+ * @returns    0, or an errno value if an operation failed
+ */
+static int
+run_workload(struct bench *b, const struct workload *w)
+{
+	int err = w->setup(b);
+	if (err != 0) {
+		printf("%-10s skipped: %s\n", w->name, strerror(err));
+		return err == ENOSYS ? 0 : err;
+	}
+
+	size_t n = w->ops != NULL ? w->ops(b) : b->ops_per_workload;
+	uint64_t *latency = calloc(n > 0 ? n : 1, sizeof(*latency));
+	struct bench_thread threads[MAX_THREADS];
+	pthread_t tids[MAX_THREADS];
+	if (latency == NULL) {
+		return ENOMEM;
+	}
+
+	size_t first = 0;
+	for (int i = 0; i < b->threads; i++) {
+		struct bench_thread *t = &threads[i];
+		memset(t, 0, sizeof(*t));
+		t->bench = b;
+		t->workload = w;
+		t->id = i;
+		t->first = first;
+		t->count = n / b->threads + ((size_t) i < n % b->threads);
+		t->rand = b->seed + i * 7919 + 1;
+		t->latency_ns = latency + first;
+		first += t->count;
+	}
+
+	int misses_fd = miss_counter_open();
+	if (misses_fd >= 0) {
+		ioctl(misses_fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(misses_fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	uint64_t start = now_ns();
+	for (int i = 0; i < b->threads; i++) {
+		if (threads[i].count == 0) {
+			continue;
+		}
+		pthread_create(&tids[i], NULL, bench_thread_main, &threads[i]);
+	}
+
+	size_t done = 0;
+	uint64_t units = 0;
+	for (int i = 0; i < b->threads; i++) {
+		if (threads[i].count == 0) {
+			continue;
+		}
+		pthread_join(tids[i], NULL);
+
+		// Compact each thread's latencies to the front
+		memmove(latency + done, threads[i].latency_ns,
+			threads[i].done * sizeof(*latency));
+		done += threads[i].done;
+		units += threads[i].units;
+		if (err == 0) {
+			err = threads[i].err;
+		}
+	}
+	double seconds = (now_ns() - start) / 1e9;
+
+	// Exited workers have added their counts to this thread's
+	uint64_t misses = 0;
+	if (misses_fd >= 0) {
+		ioctl(misses_fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(misses_fd, &misses, sizeof(misses)) != sizeof(misses)) {
+			close(misses_fd);
+			misses_fd = -1;
+		}
+	}
+
+	qsort(latency, done, sizeof(*latency), compare_u64);
+	printf("%-10s %9zu %12.0f %10lu %10lu %10lu %10lu", w->name, done,
+		seconds > 0 ? done / seconds : 0.0,
+		(unsigned long) percentile(latency, done, 50),
+		(unsigned long) percentile(latency, done, 90),
+		(unsigned long) percentile(latency, done, 99),
+		(unsigned long) (done ? latency[done - 1] : 0));
+	if (misses_fd >= 0) {
+		printf(" %9.1f", done ? (double) misses / done : 0.0);
+		close(misses_fd);
+	} else {
+		printf(" %9s", "-");
+	}
+	if (w->units != NULL && strcmp(w->units, "bytes") == 0) {
+		printf("  %.1f MiB/s", seconds > 0 ? units / seconds / (1 << 20) : 0.0);
+	} else if (w->units != NULL) {
+		printf("  %.0f %s/s", seconds > 0 ? units / seconds : 0.0, w->units);
+	}
+	if (err != 0) {
+		printf("  (stopped: %s)", strerror(err));
+	}
+	printf("\n");
+	if (w->report != NULL) {
+		w->report(b, threads);
+	}
+
+	free(latency);
+	return err;
+}
+
+#define	ASSIGN5_OPT(templ, field, value) \
+	{ templ, offsetof(struct assign5_options, field), value }
+
+// The -o options of run-assign5 (see main.c), parsed without libfuse
+static const struct {
+	const char	*templ;
+	size_t		 offset;
+	int		 value;
+} assign5_opts[] = {
+	ASSIGN5_OPT("cache=mmap", ao_cache_mmap, 1),
+	ASSIGN5_OPT("cache=clock", ao_cache_mmap, 0),
+	ASSIGN5_OPT("cache_mb=%u", ao_cache_mb, 0),
+	ASSIGN5_OPT("commit=sync", ao_commit_sync, 1),
+	ASSIGN5_OPT("commit=group", ao_commit_sync, 0),
+	ASSIGN5_OPT("commit_window_us=%u", ao_commit_window_us, 0),
+	ASSIGN5_OPT("trace=%u", ao_trace_entries, 0),
+	ASSIGN5_OPT("dedup", ao_dedup, 1),
+	ASSIGN5_OPT("writeback_cache", ao_writeback_cache, 1),
+	ASSIGN5_OPT("compress_idle=%u", ao_compress_idle, 0),
+	ASSIGN5_OPT("compress_ratio=%u", ao_compress_ratio, 0),
+};
+
+static int
+parse_options(char *list, struct assign5_options *options)
+{
+	char *save;
+	for (char *opt = strtok_r(list, ",", &save); opt != NULL;
+	     opt = strtok_r(NULL, ",", &save)) {
+		size_t i;
+		for (i = 0; i < sizeof(assign5_opts) / sizeof(assign5_opts[0]); i++) {
+			const char *templ = assign5_opts[i].templ;
+			void *field = (char *) options + assign5_opts[i].offset;
+			const char *arg = strstr(templ, "%u");
+
+			if (arg == NULL && strcmp(opt, templ) == 0) {
+				*(int *) field = assign5_opts[i].value;
+				break;
+			}
+			if (arg != NULL && strncmp(opt, templ, arg - templ) == 0 &&
+			    sscanf(opt + (arg - templ), "%u", (unsigned *) field) == 1) {
+				break;
+			}
+		}
+
+		if (i == sizeof(assign5_opts) / sizeof(assign5_opts[0])) {
+			fprintf(stderr, "unknown option '%s'\n", opt);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+print_usage()
+{
+	fprintf(stderr,
+		"Usage:  bench-assign5 [options] [workload ...]\n"
+		"\n"
+		"Options:\n"
+		"  -d N         entries in the large directory (default 10000)\n"
+		"  -e           benchmark the example filesystem instead\n"
+		"  -f FILE      back the filesystem with FILE (default: memory)\n"
+		"  -n N         operations per workload (default 10000)\n"
+		"  -j N         worker threads (default 1)\n"
+		"  -s BYTES     request size of the IO workloads (default 4096)\n"
+		"  -a BYTES     size the append workload grows files to (default 1 GiB)\n"
+		"  -S SEED      seed for the random offsets\n"
+		"  -o OPTS      assign5 options, as for run-assign5 -o\n"
+		"  -v           keep the filesystem's output on stderr\n"
+		"\n"
+		"Workloads (default: all, in this order):\n");
+
+	for (size_t i = 0; i < WORKLOAD_COUNT; i++) {
+		fprintf(stderr, "  %-12s %s\n", workloads[i].name,
+			workloads[i].description);
+	}
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	struct bench b = {
+		.ops = assign5_fuse_ops(),
+		.backing = {
+			.bf_path = "(memory)",
+			.bf_fd = -1,
+		},
+		.ops_per_workload = 10000,
+		.dir_entries = 0,
+		.threads = 1,
+		.io_size = 4096,
+		.append_size = APPEND_SIZE,
+		.seed = 1,
+	};
+	bool verbose = false;
+	// The -o options as given, to label the results with
+	char options[256] = "";
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:ef:n:j:s:a:S:o:vh")) != -1) {
+		switch (opt) {
+		case 'd':
+			b.dir_entries = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			b.ops = example_fuse_ops();
+			break;
+		case 'f':
+			b.backing.bf_path = optarg;
+			break;
+		case 'n':
+			b.ops_per_workload = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			b.threads = atoi(optarg);
+			break;
+		case 's':
+			b.io_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			b.append_size = strtoull(optarg, NULL, 0);
+			break;
+		case 'S':
+			b.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			snprintf(options + strlen(options),
+				sizeof(options) - strlen(options), "%s%s",
+				options[0] ? "," : "", optarg);
+			if (parse_options(optarg, &b.backing.bf_options) != 0) {
+				return 1;
+			}
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			print_usage();
+			return 1;
+		}
+	}
+
+	if (b.threads < 1 || b.threads > MAX_THREADS || b.io_size == 0) {
+		print_usage();
+		return 1;
+	}
+	if (b.dir_entries == 0) {
+		b.dir_entries = b.ops_per_workload < READDIR_ENTRIES ?
+			b.ops_per_workload : READDIR_ENTRIES;
+	}
+
+	// Check the workload names before setting anything up
+	for (int i = optind; i < argc; i++) {
+		size_t w = 0;
+		while (w < WORKLOAD_COUNT && strcmp(argv[i], workloads[w].name) != 0) {
+			w++;
+		}
+		if (w == WORKLOAD_COUNT) {
+			fprintf(stderr, "unknown workload '%s'\n", argv[i]);
+			print_usage();
+			return 1;
+		}
+	}
+
+	if (strcmp(b.backing.bf_path, "(memory)") != 0) {
+		b.backing.bf_fd = open(b.backing.bf_path, O_RDWR | O_CREAT, 0644);
+		if (b.backing.bf_fd < 0) {
+			perror(b.backing.bf_path);
+			return 1;
+		}
+	}
+
+	// The example filesystem logs every operation, which would be most
+	// of what gets measured
+	int stderr_fd = dup(STDERR_FILENO);
+	int null_fd = open("/dev/null", O_WRONLY);
+	if (!verbose && null_fd >= 0) {
+		dup2(null_fd, STDERR_FILENO);
+	}
+
+	struct fuse_conn_info conn = {
+		.proto_major = 7,
+		.proto_minor = 26,
+		.max_write = 1 << 20,
+		.max_readahead = 1 << 20,
+	};
+	if (b.ops->init != NULL) {
+		b.ops->init(&b.backing, &conn);
+	}
+
+	printf("# %s, %d thread%s%s%s\n", b.backing.bf_path, b.threads,
+		b.threads == 1 ? "" : "s", options[0] ? ", -o " : "", options);
+	printf("%-10s %9s %12s %10s %10s %10s %10s %9s\n", "workload", "ops",
+		"ops/s", "p50_ns", "p90_ns", "p99_ns", "max_ns", "misses/op");
+
+	int err = 0;
+	for (size_t w = 0; w < WORKLOAD_COUNT; w++) {
+		bool wanted = optind == argc;
+		for (int i = optind; i < argc; i++) {
+			wanted |= strcmp(argv[i], workloads[w].name) == 0;
+		}
+		if (wanted && run_workload(&b, &workloads[w]) != 0) {
+			err = 1;
+		}
+	}
+
+	for (int i = 0; b.io_open && i < b.threads; i++) {
+		do_release(&b, b.io_file[i], false, &b.io_fi[i]);
+	}
+	append_close(&b);
+
+	if (b.ops->destroy != NULL) {
+		b.ops->destroy(&b.backing);
+	}
+
+	for (size_t i = 0; i < b.scan_count; i++) {
+		free(b.scan_names[i]);
+	}
+	free(b.scan_names);
+
+	dup2(stderr_fd, STDERR_FILENO);
+	if (b.backing.bf_fd >= 0) {
+		close(b.backing.bf_fd);
+	}
+
+	return err;
+}
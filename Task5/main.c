@@ -15,8 +15,10 @@
  */
 
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "assign5.h"
 
@@ -30,9 +32,37 @@ print_usage()
 		"Options:\n"
 		"  -f    foreground (don't daemonize)\n"
 		"  -d    debug output (implies -f)\n"
+		"  -s    single-threaded\n"
+		"  -o cache=mmap|clock    block cache for the backing file\n"
+		"  -o cache_mb=N          CLOCK block cache budget (MiB)\n"
+		"  -o commit=group|sync   journal commit mode\n"
+		"  -o commit_window_us=N  group commit window (microseconds)\n"
+		"  -o trace=N             keep the last N operations in /.trace\n"
+		"  -o dedup               share memory between identical pages\n"
+		"  -o writeback_cache     let the kernel cache writes\n"
+		"  -o compress_idle=N     compress files unused for N seconds\n"
+		"  -o compress_ratio=P    keep pages compressed to P%% or less\n"
 	);
 }
 
+#define ASSIGN5_OPT(templ, field, value) \
+	{ templ, offsetof(struct assign5_options, field), value }
+
+static const struct fuse_opt assign5_opts[] = {
+	ASSIGN5_OPT("cache=mmap", ao_cache_mmap, 1),
+	ASSIGN5_OPT("cache=clock", ao_cache_mmap, 0),
+	ASSIGN5_OPT("cache_mb=%u", ao_cache_mb, 0),
+	ASSIGN5_OPT("commit=sync", ao_commit_sync, 1),
+	ASSIGN5_OPT("commit=group", ao_commit_sync, 0),
+	ASSIGN5_OPT("commit_window_us=%u", ao_commit_window_us, 0),
+	ASSIGN5_OPT("trace=%u", ao_trace_entries, 0),
+	ASSIGN5_OPT("dedup", ao_dedup, 1),
+	ASSIGN5_OPT("writeback_cache", ao_writeback_cache, 1),
+	ASSIGN5_OPT("compress_idle=%u", ao_compress_idle, 0),
+	ASSIGN5_OPT("compress_ratio=%u", ao_compress_ratio, 0),
+	FUSE_OPT_END
+};
+
 
 int
 main(int argc, char *argv[])
@@ -40,11 +70,7 @@ main(int argc, char *argv[])
 	//
 	// Parse command-line arguments
 	//
-	struct fuse_args args = {
-		.argc = argc - 1,
-		.argv = argv,
-		.allocated = 0,
-	};
+	struct fuse_args args = FUSE_ARGS_INIT(argc - 1, argv);
 
 	if (argc < 2) {
 		print_usage();
@@ -56,22 +82,33 @@ main(int argc, char *argv[])
 		.bf_fd = -1,
 	};
 
-	char *mountpoint;
-	int foreground, multi;
+	struct fuse_cmdline_opts opts = { .mountpoint = NULL };
 
-	int ret = fuse_parse_cmdline(&args, &mountpoint, &multi, &foreground);
-	if (ret != 0 || !mountpoint || backing.bf_path == mountpoint) {
+	// Pull out our own -o options before FUSE sees (and rejects) them
+	int ret = fuse_opt_parse(&args, &backing.bf_options, assign5_opts, NULL);
+	if (ret == 0) {
+		ret = fuse_parse_cmdline(&args, &opts);
+	}
+	if (ret == 0 && opts.show_help) {
 		print_usage();
-		goto done;
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		goto err_with_args;
+	}
+	if (ret != 0 || !opts.mountpoint) {
+		print_usage();
+		ret = 1;
+		goto err_with_args;
 	}
 
 	// Set `ret` to -1 in case any of the following operations fail (and
 	// boot us straight to the end of main())
 	ret = -1;
 
-	// Create the FUSE mountpoint
-	struct fuse_chan *channel = fuse_mount(mountpoint, &args);
-	if (channel == NULL) {
+	// Open (or create) the file that holds the filesystem's contents
+	backing.bf_fd = open(backing.bf_path, O_RDWR | O_CREAT, 0644);
+	if (backing.bf_fd < 0) {
+		perror(backing.bf_path);
 		goto err_with_args;
 	}
 
@@ -84,51 +121,57 @@ main(int argc, char *argv[])
 	struct fuse_lowlevel_ops *ops = assign5_fuse_ops();
 #endif
 	if (ops == NULL) {
-		goto err_with_channel;
+		goto err_with_backing;
 	}
 
 	struct fuse_session *se =
-		fuse_lowlevel_new(&args, ops, sizeof(*ops), &backing);
+		fuse_session_new(&args, ops, sizeof(*ops), &backing);
 	if (se == NULL) {
-		goto err_with_channel;
+		goto err_with_backing;
 	}
-
-	fuse_session_add_chan(se, channel);
+	backing.bf_session = se;
 
 	// Handle HUP, TERM and INT for clean shutdown
 	if (fuse_set_signal_handlers(se) != 0) {
 		goto err_with_session;
 	}
 
+	// Create the FUSE mountpoint
+	if (fuse_session_mount(se, opts.mountpoint) != 0) {
+		goto err_with_signals;
+	}
+
 	// Go into the background (unless `-f` and/or `-d` are set)
-	if (fuse_daemonize(foreground) != 0) {
-		goto err_with_session;
+	if (fuse_daemonize(opts.foreground) != 0) {
+		goto err_with_mount;
 	}
 
 	// Block until process terminated or filesystem unmounted
-	if (multi) {
-		ret = fuse_session_loop_mt(se);
-	} else {
+	if (opts.singlethread) {
 		ret = fuse_session_loop(se);
+	} else {
+		ret = fuse_session_loop_mt(se, opts.clone_fd);
 	}
 
-	// Reset signal handlers to defaults
-	fuse_remove_signal_handlers(se);
-
 	//
 	// Cleanup in reverse order
 	//
+err_with_mount:
+	fuse_session_unmount(se);
+
+err_with_signals:
+	// Reset signal handlers to defaults
+	fuse_remove_signal_handlers(se);
+
 err_with_session:
-	fuse_session_remove_chan(channel);
 	fuse_session_destroy(se);
 
-err_with_channel:
-	fuse_unmount(mountpoint, channel);
+err_with_backing:
+	close(backing.bf_fd);
 
 err_with_args:
-	free(mountpoint);
+	free(opts.mountpoint);
 	fuse_opt_free_args(&args);
 
-done:
 	return ret;
 }
\ No newline at end of file